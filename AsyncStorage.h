@@ -0,0 +1,108 @@
+#pragma once
+#include <exception>
+#include <memory>
+#include <optional>
+#include <string>
+#include <utility>
+#include <boost/asio.hpp>
+#include "ThreadPool.h"
+#include "Storage.h"
+#include "DatabaseManager.h"
+
+#ifndef ASYNCSTORAGE_H
+#define ASYNCSTORAGE_H
+
+/*
+    Hops from a coroutine to a ThreadPool, and the awaitable facade of Storage used by the coroutine handlers.
+    The coroutine is suspended while the function runs on the pool and resumed on its own executor afterwards, so
+    a handler waiting for blocking work holds no reactor thread: the reactors (one per core) keep serving the other
+    requests and only the pool's threads block.
+    pqxx and the connection pool are blocking, AsyncStorage runs every call on the db executor, which has one thread
+    per pooled connection: a request waiting for a connection or a query result is a suspended coroutine, queued
+    on the db executor, rather than a parked thread.
+*/
+
+namespace asyncHop {
+    // Post the handler to its own executor, the coroutine must not resume on the pool's thread
+    template <typename Handler>
+    void complete(Handler handler, bool accepted) {
+        auto executor = boost::asio::get_associated_executor(handler);
+        boost::asio::post(executor, [handler = std::move(handler), accepted]() mutable {
+            std::move(handler)(accepted);
+        });
+    }
+
+    template <typename F>
+    boost::asio::awaitable<bool> run(ThreadPool& pool, F& function, bool bounded) {
+        std::exception_ptr error;
+        bool accepted = co_await boost::asio::async_initiate<const boost::asio::use_awaitable_t<>&, void(bool)>(
+            [&pool, &function, &error, bounded](auto handler) {
+                using Handler = decltype(handler);
+                // Shared so the handler is still there to report a rejection once the task was dropped
+                auto pending = std::make_shared<std::optional<Handler>>(std::move(handler));
+                Task task([&function, &error, pending]() {
+                    try {
+                        function();
+                    }
+                    catch (...) {
+                        error = std::current_exception();
+                    }
+                    complete(std::move(**pending), true);
+                });
+                if (!bounded) {
+                    pool.enqueueTask(std::move(task));
+                }
+                else if (!pool.tryEnqueueTask(std::move(task))) {
+                    complete(std::move(**pending), false);
+                }
+            },
+            boost::asio::use_awaitable);
+        if (error) {
+            std::rethrow_exception(error);
+        }
+        co_return accepted;
+    }
+}
+
+// Run function on the pool and resume once it returned, rethrowing what it threw.
+// False when the pool's queue is full, the function did not run then
+template <typename F>
+boost::asio::awaitable<bool> tryRunOn(ThreadPool& pool, F function) {
+    co_return co_await asyncHop::run(pool, function, true);
+}
+
+// Same as tryRunOn without the admission control, for work that must not be shed
+template <typename F>
+boost::asio::awaitable<void> runOn(ThreadPool& pool, F function) {
+    co_await asyncHop::run(pool, function, false);
+}
+
+class AsyncStorage {
+public:
+    // session is the client session the calls are made for (read-your-writes stickiness)
+    AsyncStorage(ThreadPool& dbPool, std::string session) : dbPool_(dbPool), session_(std::move(session)) {}
+
+    // Run function(storage) on the db executor, false when its queue is full
+    template <typename F>
+    boost::asio::awaitable<bool> tryRun(F function) {
+        co_return co_await tryRunOn(dbPool_, [this, &function]() {
+            DatabaseManager::SessionScope scope(session_);
+            function(Storage::getInstance());
+        });
+    }
+
+    // Same as tryRun without the admission control, for work that must not be shed
+    template <typename F>
+    boost::asio::awaitable<void> run(F function) {
+        co_await runOn(dbPool_, [this, &function]() {
+            DatabaseManager::SessionScope scope(session_);
+            function(Storage::getInstance());
+        });
+    }
+
+private:
+    ThreadPool& dbPool_;
+    std::string session_;
+};
+
+#endif //ASYNCSTORAGE_H
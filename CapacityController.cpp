@@ -0,0 +1,179 @@
+#include "CapacityController.h"
+#include "DatabaseManager.h"
+#include <algorithm>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+
+/*
+    The CapacityController class samples the managed executors every interval and resizes them within their bounds.
+*/
+
+CapacityController::CapacityController(const CapacityOptions& options)
+    : options_(options) {
+}
+
+CapacityController::~CapacityController() {
+    stop();
+}
+
+void CapacityController::manageExecutor(ThreadPool& pool, size_t minThreads) {
+    addResource(pool, minThreads, false);
+}
+
+void CapacityController::manageDatabase(ThreadPool& dbPool, size_t minThreads) {
+    addResource(dbPool, minThreads, true);
+}
+
+void CapacityController::addResource(ThreadPool& pool, size_t minThreads, bool database) {
+    Resource resource;
+    resource.pool = &pool;
+    resource.database = database;
+    resource.maxSize = pool.maxThreadCount();
+    resource.minSize = std::clamp<size_t>(minThreads, 1, resource.maxSize);
+    resource.lastPool = pool.stats();
+    if (resource.lastPool.threads > 0) {
+        resource.queuePerThread = static_cast<double>(resource.lastPool.maxQueueSize) / resource.lastPool.threads;
+    }
+    if (database) {
+        resource.lastConnections = DatabaseManager::getInstance().getPoolStats();
+    }
+    resource.lastSampleAt = std::chrono::steady_clock::now();
+    resources_.push_back(resource);
+
+    CapacityResourceStats published;
+    published.name = pool.getName();
+    published.size = pool.threadCount();
+    published.minSize = resource.minSize;
+    published.maxSize = resource.maxSize;
+    std::lock_guard<std::mutex> lock(statsMutex_);
+    published_.push_back(published);
+}
+
+void CapacityController::start() {
+    stop_ = false;
+    thread_ = std::thread([this]() { run(); });
+}
+
+void CapacityController::stop() {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        stop_ = true;
+    }
+    condition_.notify_one();
+    if (thread_.joinable()) {
+        thread_.join();
+    }
+}
+
+void CapacityController::run() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (!stop_) {
+        condition_.wait_for(lock, options_.interval, [this]() { return stop_; });
+        if (stop_) {
+            break;
+        }
+        lock.unlock();
+        for (Resource& resource : resources_) {
+            try {
+                adjust(resource);
+            }
+            catch (const std::exception& e) {
+                // Sampled again at the next interval
+                std::cerr << "Capacity adjustment of " << resource.pool->getName() << " failed: " << e.what() << "\n";
+            }
+        }
+        lock.lock();
+    }
+}
+
+void CapacityController::adjust(Resource& resource) {
+    auto now = std::chrono::steady_clock::now();
+    double elapsedMicros = std::chrono::duration<double, std::micro>(now - resource.lastSampleAt).count();
+    ThreadPoolStats pool = resource.pool->stats();
+
+    // Tasks queued while none completed waited at least the whole interval
+    uint64_t completed = pool.completed - resource.lastPool.completed;
+    uint64_t queueWait = completed == 0
+        ? (pool.queued > 0 ? static_cast<uint64_t>(elapsedMicros) : 0)
+        : (pool.totalQueueWaitMicros - resource.lastPool.totalQueueWaitMicros) / completed;
+    double utilization = elapsedMicros <= 0 ? 0 : std::min(1.0,
+        static_cast<double>(pool.totalRunMicros - resource.lastPool.totalRunMicros) / (elapsedMicros * pool.threads));
+
+    uint64_t acquireWait = 0;
+    if (resource.database) {
+        PoolStats connections = DatabaseManager::getInstance().getPoolStats();
+        // Thread cache hits never wait and record none, averaging over them would hide a contended pool
+        uint64_t waited = (connections.acquired - connections.threadCacheHits)
+            - (resource.lastConnections.acquired - resource.lastConnections.threadCacheHits);
+        acquireWait = waited == 0 ? 0 : (connections.totalWaitMicros - resource.lastConnections.totalWaitMicros) / waited;
+        resource.lastConnections = connections;
+    }
+    resource.lastPool = pool;
+    resource.lastSampleAt = now;
+
+    size_t current = pool.threads;
+    size_t target = std::clamp(current, resource.minSize, resource.maxSize);
+    if (queueWait > static_cast<uint64_t>(options_.growQueueWait.count())
+        || acquireWait > static_cast<uint64_t>(options_.growAcquireWait.count())) {
+        target = std::min(resource.maxSize, current + std::max<size_t>(1, current / 4));
+        resource.idleSamples = 0;
+    }
+    else if (queueWait < static_cast<uint64_t>(options_.shrinkQueueWait.count())
+        && utilization < options_.shrinkUtilization) {
+        if (++resource.idleSamples >= options_.shrinkAfter) {
+            target = std::max(resource.minSize, current - std::min(current, std::max<size_t>(1, current / 10)));
+            resource.idleSamples = 0;
+        }
+    }
+    else {
+        resource.idleSamples = 0;
+    }
+
+    std::ostringstream reason;
+    reason << std::fixed << std::setprecision(1) << "queue wait " << queueWait / 1000.0 << " ms";
+    if (resource.database) {
+        reason << ", acquire wait " << acquireWait / 1000.0 << " ms";
+    }
+    reason << ", utilization " << std::setprecision(0) << utilization * 100 << "%";
+
+    if (target != current) {
+        resource.pool->resize(target);
+        if (resource.queuePerThread > 0) {
+            resource.pool->setMaxQueueSize(std::max<size_t>(1, static_cast<size_t>(resource.queuePerThread * target + 0.5)));
+        }
+        if (resource.database) {
+            DatabaseManager::getInstance().resizeConnectionPools(target);
+        }
+        target > current ? ++resource.grows : ++resource.shrinks;
+        std::cout << "Capacity: " << pool.name << " " << current << " -> " << target
+            << (resource.database ? " threads and connections (" : " threads (") << reason.str() << ")\n";
+    }
+
+    std::lock_guard<std::mutex> lock(statsMutex_);
+    for (CapacityResourceStats& published : published_) {
+        if (published.name != pool.name) {
+            continue;
+        }
+        published.size = target;
+        published.queueWaitMicros = queueWait;
+        published.acquireWaitMicros = acquireWait;
+        published.utilization = utilization;
+        published.grows = resource.grows;
+        published.shrinks = resource.shrinks;
+    }
+    if (target != current) {
+        decisions_.push_back({ pool.name, current, target, reason.str(), std::chrono::system_clock::now() });
+        if (decisions_.size() > kMaxDecisions) {
+            decisions_.pop_front();
+        }
+    }
+}
+
+CapacityStats CapacityController::stats() {
+    std::lock_guard<std::mutex> lock(statsMutex_);
+    CapacityStats stats;
+    stats.resources = published_;
+    stats.decisions.assign(decisions_.begin(), decisions_.end());
+    return stats;
+}
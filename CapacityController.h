@@ -0,0 +1,125 @@
+#pragma once
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "ThreadPool.h"
+#include "ConnectionPool.h"
+
+#ifndef CAPACITYCONTROLLER_H
+#define CAPACITYCONTROLLER_H
+
+/*
+    The CapacityController class sizes the executors and the database connection pools from the load, on a background
+    thread, so capacity follows the traffic of the day instead of a fixed guess that oversubscribes a small machine
+    and undersizes a big one.
+    Every interval it samples each managed executor: the average queue wait of the tasks taken since the last sample,
+    the busy fraction of its threads and, for the db executor, the average wait for a pooled connection.
+    A resource whose queue wait (or acquire wait) is above the grow threshold gets a quarter more threads at once;
+    one that stayed under the shrink threshold and mostly idle for shrinkAfter samples in a row gives a tenth back.
+    Sizes stay within the bounds of each resource, and a bounded queue keeps its ratio of queued tasks per thread so a
+    grown executor does not shed load at the bound of its old size. The db executor and the connection pools move
+    together, as many connections as threads, so a db thread never waits for a lease. Every decision is logged and kept
+    for the metrics.
+    The cpu executor is not managed: hashing is bound by the cores, more threads would not make it faster.
+*/
+
+struct CapacityOptions {
+    std::chrono::milliseconds interval{ 5000 };
+    // Average queue wait above which a resource grows, and below which it may shrink
+    std::chrono::microseconds growQueueWait{ 5000 };
+    std::chrono::microseconds shrinkQueueWait{ 500 };
+    // Average wait for a database connection above which the db executor and the pools grow
+    std::chrono::microseconds growAcquireWait{ 2000 };
+    // Busy fraction of the threads under which a resource counts as idle
+    double shrinkUtilization = 0.5;
+    // Idle samples in a row before shrinking, growing does not wait
+    size_t shrinkAfter = 6;
+};
+
+// The last sample of one managed resource, the waits are averages over the last interval
+struct CapacityResourceStats {
+    std::string name;
+    size_t size = 0;
+    size_t minSize = 0;
+    size_t maxSize = 0;
+    uint64_t queueWaitMicros = 0;
+    uint64_t acquireWaitMicros = 0;
+    double utilization = 0;
+    uint64_t grows = 0;
+    uint64_t shrinks = 0;
+};
+
+struct CapacityDecision {
+    std::string resource;
+    size_t from = 0;
+    size_t to = 0;
+    std::string reason;
+    std::chrono::system_clock::time_point at;
+};
+
+struct CapacityStats {
+    std::vector<CapacityResourceStats> resources;
+    // Most recent last
+    std::vector<CapacityDecision> decisions;
+};
+
+class CapacityController {
+public:
+    explicit CapacityController(const CapacityOptions& options);
+    ~CapacityController();
+    CapacityController(const CapacityController&) = delete;
+    CapacityController& operator=(const CapacityController&) = delete;
+
+    // Register the resources before start(), a pool grows up to its maxThreadCount()
+    void manageExecutor(ThreadPool& pool, size_t minThreads);
+    // The db executor, the database connection pools are resized with it
+    void manageDatabase(ThreadPool& dbPool, size_t minThreads);
+
+    void start();
+    void stop();
+    CapacityStats stats();
+
+private:
+    struct Resource {
+        ThreadPool* pool = nullptr;
+        bool database = false;
+        size_t minSize = 1;
+        size_t maxSize = 1;
+        // Queue bound per thread at registration, kept on resize, 0 when the queue is unbounded
+        double queuePerThread = 0;
+        ThreadPoolStats lastPool;
+        PoolStats lastConnections;
+        std::chrono::steady_clock::time_point lastSampleAt;
+        size_t idleSamples = 0;
+        uint64_t grows = 0;
+        uint64_t shrinks = 0;
+    };
+
+    void addResource(ThreadPool& pool, size_t minThreads, bool database);
+    void run();
+    void adjust(Resource& resource);
+
+    // Keep the last decisions for the metrics
+    static constexpr size_t kMaxDecisions = 32;
+
+    CapacityOptions options_;
+    // Only touched by the controller thread once it started
+    std::vector<Resource> resources_;
+
+    std::mutex mutex_;
+    std::condition_variable condition_;
+    std::thread thread_;
+    bool stop_ = false;
+
+    // What stats() reports, guarded by statsMutex_
+    std::mutex statsMutex_;
+    std::vector<CapacityResourceStats> published_;
+    std::deque<CapacityDecision> decisions_;
+};
+
+#endif //CAPACITYCONTROLLER_H
@@ -0,0 +1,115 @@
+#include "ClientSession.h"
+#include <iostream>
+#include <simdjson.h>
+
+/*
+    The ClientSession class is one client connection of TcpServer.
+    readFrames is spawned on the strand, between two frames it is suspended on the read and while a frame is handled
+    on the handler's hops. A write completes on the strand and starts the next queued payload, close waits for the
+    queue to drain.
+*/
+
+ClientSession::ClientSession(boost::asio::ip::tcp::socket socket)
+    : socket_(std::move(socket)), strand_(boost::asio::make_strand(socket_.get_executor())),
+      buffer_(kFrameBytes + simdjson::SIMDJSON_PADDING) {
+}
+
+void ClientSession::start(FrameHandler handler, CloseHandler onClose) {
+    handler_ = std::move(handler);
+    onClose_ = std::move(onClose);
+    boost::asio::co_spawn(strand_, readFrames(), boost::asio::detached);
+}
+
+boost::asio::awaitable<void> ClientSession::readFrames() {
+    auto self = shared_from_this();
+    while (!closing_ && socket_.is_open()) {
+        boost::system::error_code ec;
+        size_t length = co_await socket_.async_read_some(boost::asio::buffer(buffer_.data(), kFrameBytes),
+            boost::asio::redirect_error(boost::asio::use_awaitable, ec));
+        if (ec) {
+            if (ec != boost::asio::error::eof && ec != boost::asio::error::operation_aborted) {
+                std::cerr << "Failed to read from client: " << ec.message() << "\n";
+            }
+            shutdown();
+            co_return;
+        }
+        try {
+            co_await handler_(self, buffer_.data(), length, buffer_.size());
+        }
+        catch (const std::exception& e) {
+            std::cerr << "Failed to process frame: " << e.what() << "\n";
+        }
+    }
+}
+
+void ClientSession::send(std::shared_ptr<const std::string> payload) {
+    boost::asio::post(strand_, [self = shared_from_this(), payload = std::move(payload)]() mutable {
+        if (self->closing_ || !self->socket_.is_open()) {
+            return;
+        }
+        if (self->outbound_.size() >= kMaxOutbound) {
+            std::cerr << "Client is not reading its messages, closing the session\n";
+            self->shutdown();
+            return;
+        }
+        self->outbound_.push_back(std::move(payload));
+        if (!self->writing_) {
+            self->writeNext();
+        }
+    });
+}
+
+void ClientSession::writeNext() {
+    writing_ = true;
+    // The handler holds the payload, shutdown may clear the queue while the write is in flight
+    std::shared_ptr<const std::string> payload = outbound_.front();
+    boost::asio::async_write(socket_, boost::asio::buffer(*payload),
+        boost::asio::bind_executor(strand_, [self = shared_from_this(), payload](boost::system::error_code ec, size_t /*length*/) {
+            if (ec) {
+                if (ec != boost::asio::error::operation_aborted) {
+                    std::cerr << "Failed to send message: " << ec.message() << "\n";
+                }
+                self->shutdown();
+                return;
+            }
+            if (!self->socket_.is_open()) {
+                // Shut down while the write was completing, the queue is gone
+                return;
+            }
+            self->outbound_.pop_front();
+            if (!self->outbound_.empty()) {
+                self->writeNext();
+                return;
+            }
+            self->writing_ = false;
+            if (self->closing_) {
+                self->shutdown();
+            }
+        }));
+}
+
+void ClientSession::close() {
+    open_.store(false, std::memory_order_release);
+    boost::asio::post(strand_, [self = shared_from_this()]() {
+        self->closing_ = true;
+        if (!self->writing_) {
+            self->shutdown();
+        }
+    });
+}
+
+// On the strand: drop the queue and close the socket, which aborts the pending read, then tell the owner
+void ClientSession::shutdown() {
+    open_.store(false, std::memory_order_release);
+    closing_ = true;
+    outbound_.clear();
+    writing_ = false;
+    boost::system::error_code ec;
+    socket_.shutdown(boost::asio::ip::tcp::socket::shutdown_both, ec);
+    socket_.close(ec);
+    if (onClose_) {
+        CloseHandler onClose = std::move(onClose_);
+        onClose_ = nullptr;
+        onClose(shared_from_this());
+    }
+}
@@ -0,0 +1,67 @@
+#pragma once
+#include <atomic>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+#include <boost/asio.hpp>
+
+#ifndef CLIENTSESSION_H
+#define CLIENTSESSION_H
+
+/*
+    The ClientSession class is one client connection of TcpServer.
+    Everything touching the socket (reads, writes, close) runs on the session's strand. Outbound payloads are queued
+    and written one after the other, so the socket has a single writer and payloads sent from several threads are
+    never interleaved. Frames are read by a coroutine on the strand that awaits the frame handler before reading the
+    next one: the frames of a session are handled in order, different sessions run in parallel and a session
+    waiting for its handler (or for the client) holds no thread.
+    The close handler is called once on the strand when the socket is closed, whichever side closed it, so the
+    owner can forget a client that dropped without saying goodbye.
+*/
+
+class ClientSession : public std::enable_shared_from_this<ClientSession> {
+public:
+    // Awaited on the strand for every frame read, data has simdjson::SIMDJSON_PADDING readable bytes past length
+    // and stays valid until the handler completes
+    using FrameHandler = std::function<boost::asio::awaitable<void>(const std::shared_ptr<ClientSession>& session,
+        const char* data, size_t length, size_t capacity)>;
+    using CloseHandler = std::function<void(const std::shared_ptr<ClientSession>& session)>;
+
+    // Bytes read per frame
+    static constexpr size_t kFrameBytes = 1024;
+    // Payloads queued for a client that does not read them, the session is closed beyond this
+    static constexpr size_t kMaxOutbound = 1024;
+
+    explicit ClientSession(boost::asio::ip::tcp::socket socket);
+    ClientSession(const ClientSession&) = delete;
+    ClientSession& operator=(const ClientSession&) = delete;
+
+    void start(FrameHandler handler, CloseHandler onClose = {});
+    // Queue a payload, written after the ones queued before it
+    void send(std::shared_ptr<const std::string> payload);
+    // Stop reading and close once the queued payloads are written
+    void close();
+    bool isOpen() const { return open_.load(std::memory_order_acquire); }
+
+private:
+    boost::asio::awaitable<void> readFrames();
+    void writeNext();
+    void shutdown();
+
+    boost::asio::ip::tcp::socket socket_;
+    boost::asio::strand<boost::asio::any_io_executor> strand_;
+    FrameHandler handler_;
+    // Reset once called, only touched on the strand
+    CloseHandler onClose_;
+    std::vector<char> buffer_;
+    std::atomic<bool> open_{ true };
+
+    // Only touched on the strand
+    std::deque<std::shared_ptr<const std::string>> outbound_;
+    bool writing_ = false;
+    bool closing_ = false;
+};
+
+#endif //CLIENTSESSION_H
@@ -1,16 +1,54 @@
 #include "ConnectionPool.h"
+#include <algorithm>
+#include <iostream>
+#include <thread>
 
 /*
     The purpose of a connection pool is to
     optimise the management and use of connections to the database (DB) in the thread pool server.
+    Each thread keeps the connection it released last in its own slot, so the common acquire/release
+    cycle of a worker is two atomic exchanges and never takes the pool mutex.
  */
 
+namespace {
+    int64_t toTicks(std::chrono::steady_clock::time_point time) {
+        return time.time_since_epoch().count();
+    }
+
+    std::chrono::steady_clock::time_point fromTicks(int64_t ticks) {
+        return std::chrono::steady_clock::time_point(std::chrono::steady_clock::duration(ticks));
+    }
+}
 
-// Constructor to initialize the connection pool with the connection information and pool size
-ConnectionPool::ConnectionPool(const std::string& conninfo, size_t poolSize)
-    : conninfo_(conninfo), poolSize_(poolSize) {
-    for (size_t i = 0; i < poolSize_; ++i) {
-        pool_.emplace(std::make_shared<pqxx::connection>(conninfo_));
+
+// Constructor to initialize the connection pool with the connection information and sizing.
+// The first minSize connections are opened in parallel, the others lazily when they are needed.
+ConnectionPool::ConnectionPool(const std::string& conninfo, const PoolOptions& options, std::vector<PreparedStatement> statements)
+    : conninfo_(conninfo), options_(options), statements_(std::move(statements)) {
+    options_.minSize = std::min(options_.minSize, options_.maxSize);
+    size_ = options_.minSize;
+
+    std::vector<std::thread> openers;
+    size_t openerCount = std::min<size_t>(options_.minSize, 16);
+    for (size_t i = 0; i < openerCount; ++i) {
+        openers.emplace_back([this, i, openerCount]() {
+            for (size_t n = i; n < options_.minSize; n += openerCount) {
+                try {
+                    auto conn = createConnection();
+                    std::lock_guard<std::mutex> lock(mutex_);
+                    idle_.push_back({ std::move(conn), std::chrono::steady_clock::now() });
+                }
+                catch (const std::exception& e) {
+                    // The database may not be up yet, the slot is opened again on demand
+                    std::cerr << "Failed to open pooled connection: " << e.what() << "\n";
+                    std::lock_guard<std::mutex> lock(mutex_);
+                    --size_;
+                }
+            }
+        });
+    }
+    for (auto& opener : openers) {
+        opener.join();
     }
 }
 
@@ -18,27 +56,307 @@ ConnectionPool::ConnectionPool(const std::string& conninfo, size_t poolSize)
 ConnectionPool::~ConnectionPool() {
     // Lock the mutex to access the pool, ensuring that no other thread is using the pool
     std::lock_guard<std::mutex> lock(mutex_);
-    while (!pool_.empty()) {
-        pool_.pop();
+    idle_.clear();
+    for (auto& slot : slots_) {
+        delete slot.conn.exchange(nullptr);
+    }
+}
+
+// Threads get a slot the first time they touch any pool, the index is stable for the life of the thread
+size_t ConnectionPool::threadSlotIndex() {
+    static std::atomic<size_t> nextIndex{ 0 };
+    thread_local size_t index = nextIndex.fetch_add(1, std::memory_order_relaxed) % kThreadSlots;
+    return index;
+}
+
+// Park the connection in the calling thread's slot, fails if the slot is taken
+// (another thread mapped to the same slot) so the caller falls back to the shared list
+bool ConnectionPool::tryCacheInSlot(std::unique_ptr<pqxx::connection>& conn) {
+    ThreadSlot& slot = slots_[threadSlotIndex()];
+    pqxx::connection* expected = nullptr;
+    slot.idleSince.store(toTicks(std::chrono::steady_clock::now()), std::memory_order_relaxed);
+    if (!slot.conn.compare_exchange_strong(expected, conn.get())) {
+        return false;
+    }
+    conn.release();
+    parked_.fetch_add(1);
+
+    // A thread may have started waiting while the connection was parked, and it could not see it when it
+    // scanned the slots; take it back and hand it over through the shared list so the waiter is not starved
+    if (waiting_.load() > 0) {
+        pqxx::connection* parked = slot.conn.exchange(nullptr);
+        if (parked != nullptr) {
+            parked_.fetch_sub(1);
+            conn.reset(parked);
+            return false;
+        }
+    }
+    return true;
+}
+
+// Take every connection parked in a thread slot, used when the shared list is empty
+// and the pool cannot grow, instead of waiting while connections sit idle in other threads' slots
+std::unique_ptr<pqxx::connection> ConnectionPool::stealFromSlots() {
+    size_t start = threadSlotIndex();
+    for (size_t i = 0; i < kThreadSlots; ++i) {
+        ThreadSlot& slot = slots_[(start + i) % kThreadSlots];
+        // Sequentially consistent so it pairs with the waiting_ check in tryCacheInSlot
+        if (slot.conn.load() == nullptr) {
+            continue;
+        }
+        pqxx::connection* parked = slot.conn.exchange(nullptr);
+        if (parked != nullptr) {
+            parked_.fetch_sub(1);
+            return std::unique_ptr<pqxx::connection>(parked);
+        }
+    }
+    return nullptr;
+}
+
+// Open a new connection and prepare every registered statement on it,
+// the server then parses and plans each statement once per connection instead of once per query
+std::unique_ptr<pqxx::connection> ConnectionPool::createConnection() {
+    auto conn = std::make_unique<pqxx::connection>(conninfo_);
+    for (const auto& statement : statements_) {
+        conn->prepare(statement.name, statement.sql);
+    }
+    return conn;
+}
+
+// A connection that sat idle for a while may have been closed by the server (restart, idle timeout),
+// check it with a round trip before handing it out
+bool ConnectionPool::isHealthy(pqxx::connection& conn, std::chrono::steady_clock::time_point idleSince) {
+    if (!conn.is_open()) {
+        return false;
     }
+    if (std::chrono::steady_clock::now() - idleSince < options_.healthCheckAfter) {
+        return true;
+    }
+    try {
+        pqxx::nontransaction txn(conn);
+        txn.exec("SELECT 1");
+        return true;
+    }
+    catch (const std::exception&) {
+        return false;
+    }
+}
+
+ConnectionPool::Lease ConnectionPool::acquire() {
+    return acquire(options_.acquireTimeout);
 }
 
-std::shared_ptr<pqxx::connection> ConnectionPool::getConnection() {
+ConnectionPool::Lease ConnectionPool::acquire(std::chrono::milliseconds timeout) {
+    auto start = std::chrono::steady_clock::now();
+    auto deadline = start + timeout;
+
+    // Fast path, the connection this thread released last is still parked in its slot
+    ThreadSlot& slot = slots_[threadSlotIndex()];
+    if (slot.conn.load(std::memory_order_relaxed) != nullptr) {
+        int64_t idleSince = slot.idleSince.load(std::memory_order_relaxed);
+        pqxx::connection* parked = slot.conn.exchange(nullptr);
+        if (parked != nullptr) {
+            parked_.fetch_sub(1);
+            std::unique_ptr<pqxx::connection> conn(parked);
+            if (isHealthy(*conn, fromTicks(idleSince))) {
+                slot.hits.fetch_add(1, std::memory_order_relaxed);
+                return Lease(this, std::move(conn));
+            }
+            // Broken, drop it and take the slow path which may open a replacement
+            conn.reset();
+            std::lock_guard<std::mutex> lock(mutex_);
+            --size_;
+            ++stats_.replaced;
+        }
+    }
+
     // Lock the mutex to access the pool, ensuring that no other thread is using the pool,
     // avoid the case of multiple threads accessing the pool at the same time and then they get the same connection
     std::unique_lock<std::mutex> lock(mutex_);
-    condition_.wait(lock, [this]() { return !pool_.empty(); });
+    for (;;) {
+        if (!idle_.empty()) {
+            // Most recently used first, it is the most likely to still be alive
+            IdleConnection entry = std::move(idle_.back());
+            idle_.pop_back();
+            lock.unlock();
 
-    // Get the connection from the front of the pool
-    auto conn = pool_.front();
-    pool_.pop();
-    return conn;
+            if (isHealthy(*entry.conn, entry.idleSince)) {
+                recordWait(start);
+                return Lease(this, std::move(entry.conn));
+            }
+
+            // Replace the broken connection, its slot stays reserved while the new one is opened
+            entry.conn.reset();
+            try {
+                auto conn = createConnection();
+                lock.lock();
+                ++stats_.replaced;
+                lock.unlock();
+                recordWait(start);
+                return Lease(this, std::move(conn));
+            }
+            catch (...) {
+                lock.lock();
+                --size_;
+                condition_.notify_one();
+                throw;
+            }
+        }
+
+        if (size_ < options_.maxSize) {
+            // Grow the pool, the connection is opened outside the lock
+            ++size_;
+            lock.unlock();
+            try {
+                auto conn = createConnection();
+                recordWait(start);
+                return Lease(this, std::move(conn));
+            }
+            catch (...) {
+                lock.lock();
+                --size_;
+                condition_.notify_one();
+                throw;
+            }
+        }
+
+        // Every connection is in use, announce the wait first so releasing threads stop parking
+        // connections in their slots, then steal whatever is already parked there
+        ++waiting_;
+        if (auto stolen = stealFromSlots()) {
+            --waiting_;
+            lock.unlock();
+            if (stolen->is_open()) {
+                recordWait(start);
+                return Lease(this, std::move(stolen));
+            }
+            stolen.reset();
+            lock.lock();
+            --size_;
+            continue;
+        }
+        bool available = condition_.wait_until(lock, deadline, [this]() {
+            return !idle_.empty() || size_ < options_.maxSize;
+        });
+        --waiting_;
+        if (!available) {
+            ++stats_.timeouts;
+            throw PoolTimeoutError("Timed out waiting for a database connection");
+        }
+    }
 }
 
-// Release the connection back to the pool
-void ConnectionPool::releaseConnection(std::shared_ptr<pqxx::connection> conn) {
-    std::lock_guard<std::mutex> lock(mutex_);
-    pool_.push(conn);
-    // Notify one of the waiting threads that there is a connection available
+// Release the connection back to the pool, a broken one is dropped and its slot freed
+void ConnectionPool::release(std::unique_ptr<pqxx::connection> conn, bool broken) {
+    leased_.fetch_sub(1, std::memory_order_relaxed);
+    // The pool was shrunk below the connections it holds, close this one instead of keeping it
+    if (surplus_.load(std::memory_order_relaxed) != 0) {
+        std::unique_lock<std::mutex> lock(mutex_);
+        if (size_ > options_.maxSize) {
+            --size_;
+            surplus_.store(size_ - std::min(size_, options_.maxSize), std::memory_order_relaxed);
+            lock.unlock();
+            conn.reset();
+            return;
+        }
+        surplus_.store(0, std::memory_order_relaxed);
+    }
+    if (broken || !conn->is_open()) {
+        conn.reset();
+        std::lock_guard<std::mutex> lock(mutex_);
+        --size_;
+    }
+    else {
+        // Fast path, keep the connection for this thread's next acquire unless someone is waiting for it
+        if (waiting_.load() == 0 && tryCacheInSlot(conn)) {
+            return;
+        }
+        std::lock_guard<std::mutex> lock(mutex_);
+        idle_.push_back({ std::move(conn), std::chrono::steady_clock::now() });
+    }
+    // Notify one of the waiting threads that there is a connection (or a free slot) available
     condition_.notify_one();
 }
+
+// Growing wakes every waiter since each of them may now open a connection. Shrinking closes the oldest idle
+// connections and the parked ones first, the leased surplus is closed by release
+void ConnectionPool::resize(size_t maxSize) {
+    std::vector<std::unique_ptr<pqxx::connection>> closing;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        options_.maxSize = std::max<size_t>(1, maxSize);
+        while (size_ > options_.maxSize && !idle_.empty()) {
+            closing.push_back(std::move(idle_.front().conn));
+            idle_.pop_front();
+            --size_;
+        }
+        while (size_ > options_.maxSize) {
+            auto parked = stealFromSlots();
+            if (!parked) {
+                break;
+            }
+            closing.push_back(std::move(parked));
+            --size_;
+        }
+        surplus_.store(size_ - std::min(size_, options_.maxSize), std::memory_order_relaxed);
+    }
+    condition_.notify_all();
+    // The connections are closed here, outside the lock
+}
+
+void ConnectionPool::recordWait(std::chrono::steady_clock::time_point start) {
+    auto waited = static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::steady_clock::now() - start).count());
+    std::lock_guard<std::mutex> lock(mutex_);
+    ++stats_.acquired;
+    stats_.totalWaitMicros += waited;
+    stats_.maxWaitMicros = std::max(stats_.maxWaitMicros, waited);
+}
+
+PoolStats ConnectionPool::stats() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    PoolStats snapshot = stats_;
+    for (const auto& slot : slots_) {
+        snapshot.threadCacheHits += slot.hits.load(std::memory_order_relaxed);
+    }
+    snapshot.acquired += snapshot.threadCacheHits;
+    size_t parked = parked_.load();
+    snapshot.size = size_;
+    snapshot.idle = idle_.size() + parked;
+    snapshot.inUse = size_ - std::min(size_, snapshot.idle);
+    snapshot.waiting = waiting_;
+    snapshot.maxSize = options_.maxSize;
+    return snapshot;
+}
+
+ConnectionPool::Lease::Lease(ConnectionPool* pool, std::unique_ptr<pqxx::connection> conn)
+    : pool_(pool), conn_(std::move(conn)) {
+    pool_->leased_.fetch_add(1, std::memory_order_relaxed);
+}
+
+ConnectionPool::Lease::Lease(Lease&& other) noexcept
+    : pool_(other.pool_), conn_(std::move(other.conn_)), broken_(other.broken_) {
+    other.pool_ = nullptr;
+}
+
+ConnectionPool::Lease& ConnectionPool::Lease::operator=(Lease&& other) noexcept {
+    if (this != &other) {
+        release();
+        pool_ = other.pool_;
+        conn_ = std::move(other.conn_);
+        broken_ = other.broken_;
+        other.pool_ = nullptr;
+    }
+    return *this;
+}
+
+ConnectionPool::Lease::~Lease() {
+    release();
+}
+
+void ConnectionPool::Lease::release() {
+    if (pool_ != nullptr && conn_ != nullptr) {
+        pool_->release(std::move(conn_), broken_);
+    }
+    pool_ = nullptr;
+}
@@ -1,28 +1,147 @@
 #pragma once
 #include <pqxx/pqxx>
-#include <queue>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <deque>
 #include <mutex>
 #include <condition_variable>
+#include <stdexcept>
 #include <string>
+#include <vector>
 
 /*
     The purpose of a connection pool is to
     optimise the management and use of connections to the database (DB) in the thread pool server.
+    The pool is elastic: it opens minSize connections in parallel at startup and grows on demand up to maxSize.
+    Connections are handed out as RAII leases that go back to the pool when they are destroyed,
+    broken connections are dropped and replaced, and acquiring a connection fails fast after a timeout.
+
+    Fast path: a released connection is parked in a slot owned by the releasing thread, and the next acquire
+    on that thread takes it back with a single atomic exchange, without touching the shared mutex.
+    Only when its slot is empty does a thread fall back to the shared free list, and a thread that would
+    otherwise wait steals connections parked in the other threads' slots.
+
+    maxSize can be changed while the pool is in use (resize, driven by the CapacityController): growing lets the
+    waiting threads open connections at once, shrinking closes the idle connections above the new size right away
+    and the leased ones as they are returned.
  */
 
+// A statement prepared once on every pooled connection and then run with exec_prepared
+struct PreparedStatement {
+    std::string name;
+    std::string sql;
+};
+
+struct PoolOptions {
+    size_t minSize = 8;
+    size_t maxSize = 150;
+    std::chrono::milliseconds acquireTimeout{ 2000 };
+    // A connection idle for longer than this is checked with a round trip before being handed out
+    std::chrono::seconds healthCheckAfter{ 30 };
+};
+
+struct PoolStats {
+    size_t size = 0;
+    size_t idle = 0;
+    size_t inUse = 0;
+    size_t waiting = 0;
+    size_t maxSize = 0;
+    uint64_t acquired = 0;
+    uint64_t threadCacheHits = 0;
+    uint64_t timeouts = 0;
+    uint64_t replaced = 0;
+    uint64_t totalWaitMicros = 0;
+    uint64_t maxWaitMicros = 0;
+};
+
+// Thrown when no connection could be acquired before the timeout
+class PoolTimeoutError : public std::runtime_error {
+public:
+    using std::runtime_error::runtime_error;
+};
+
 class ConnectionPool {
 public:
-    ConnectionPool(const std::string& conninfo, size_t poolSize);
+    // A connection borrowed from the pool, returned automatically when the lease goes out of scope
+    class Lease {
+    public:
+        Lease() = default;
+        Lease(Lease&& other) noexcept;
+        Lease& operator=(Lease&& other) noexcept;
+        Lease(const Lease&) = delete;
+        Lease& operator=(const Lease&) = delete;
+        ~Lease();
+
+        pqxx::connection& operator*() const { return *conn_; }
+        pqxx::connection* operator->() const { return conn_.get(); }
+        explicit operator bool() const { return conn_ != nullptr; }
+
+        // Drop the connection instead of returning it to the pool
+        void markBroken() { broken_ = true; }
+
+    private:
+        friend class ConnectionPool;
+        Lease(ConnectionPool* pool, std::unique_ptr<pqxx::connection> conn);
+        void release();
+
+        ConnectionPool* pool_ = nullptr;
+        std::unique_ptr<pqxx::connection> conn_;
+        bool broken_ = false;
+    };
+
+    ConnectionPool(const std::string& conninfo, const PoolOptions& options, std::vector<PreparedStatement> statements = {});
     ~ConnectionPool();
 
-    std::shared_ptr<pqxx::connection> getConnection();
-    void releaseConnection(std::shared_ptr<pqxx::connection> conn);
+    // Throws PoolTimeoutError when no connection is available before the timeout
+    Lease acquire();
+    Lease acquire(std::chrono::milliseconds timeout);
+    PoolStats stats();
+    // Change maxSize, at least 1
+    void resize(size_t maxSize);
+    // Leases currently held, read without the lock to balance load across pools
+    size_t outstanding() const { return leased_.load(std::memory_order_relaxed); }
 
 private:
-    std::queue<std::shared_ptr<pqxx::connection>> pool_;
+    struct IdleConnection {
+        std::unique_ptr<pqxx::connection> conn;
+        std::chrono::steady_clock::time_point idleSince;
+    };
+
+    // A per-thread parking spot for one idle connection, on its own cache line
+    struct alignas(64) ThreadSlot {
+        std::atomic<pqxx::connection*> conn{ nullptr };
+        std::atomic<int64_t> idleSince{ 0 };
+        std::atomic<uint64_t> hits{ 0 };
+    };
+
+    // Threads are mapped to slots round robin, threads beyond kThreadSlots share slots
+    static constexpr size_t kThreadSlots = 256;
+    static size_t threadSlotIndex();
+    bool tryCacheInSlot(std::unique_ptr<pqxx::connection>& conn);
+    std::unique_ptr<pqxx::connection> stealFromSlots();
+
+    std::unique_ptr<pqxx::connection> createConnection();
+    bool isHealthy(pqxx::connection& conn, std::chrono::steady_clock::time_point idleSince);
+    void release(std::unique_ptr<pqxx::connection> conn, bool broken);
+    void recordWait(std::chrono::steady_clock::time_point start);
+
+    std::deque<IdleConnection> idle_;
     std::mutex mutex_;
     std::condition_variable condition_;
     std::string conninfo_;
-    size_t poolSize_;
-};
+    PoolOptions options_;
+    std::vector<PreparedStatement> statements_;
 
+    // Connections that exist or are being opened, guarded by mutex_
+    size_t size_ = 0;
+    PoolStats stats_;
+
+    // Read on the lock-free release path to decide whether the connection must go to a waiter
+    std::atomic<size_t> waiting_{ 0 };
+    std::atomic<size_t> parked_{ 0 };
+    std::atomic<size_t> leased_{ 0 };
+    // Connections above maxSize after a shrink, released leases are closed while it is not 0
+    std::atomic<size_t> surplus_{ 0 };
+    std::array<ThreadSlot, kThreadSlots> slots_;
+};
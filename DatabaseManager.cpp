@@ -1,7 +1,14 @@
 #include "DatabaseManager.h"
+#include "Utils.h"
+#include "UserDirectory.h"
+#include "RoomDirectory.h"
+#include <algorithm>
 #include <iostream>
+#include <limits>
 #include <stdexcept>
 #include <mutex>
+#include <sstream>
+#include <thread>
 
 /*
     The DatabaseManager class is a singleton class that provides an interface to interact with the database.
@@ -12,6 +19,229 @@
 std::unique_ptr<DatabaseManager> DatabaseManager::instance_ = nullptr;
 std::once_flag DatabaseManager::initInstanceFlag;
 
+namespace {
+    /*
+        The statements used by the query methods, declared once and prepared on every pooled connection.
+        The parameters are sent separately from the SQL text, so nothing has to be quoted into the query
+        and the server parses and plans each statement once per connection instead of once per call.
+    */
+    const std::vector<PreparedStatement> kPreparedStatements = {
+        { "email_exists", "SELECT 1 FROM users WHERE email = $1" },
+        { "register_user", "INSERT INTO users (email, user_name) VALUES ($1, $1) RETURNING user_id" },
+        { "insert_password_hash", "INSERT INTO authentication (user_id, password_hash) VALUES ($1, $2)" },
+        { "update_password_hash",
+            "UPDATE authentication SET password_hash = $2 "
+            "WHERE user_id = (SELECT user_id FROM users WHERE email = $1)" },
+        { "password_hash",
+            "SELECT password_hash FROM authentication "
+            "WHERE user_id = (SELECT user_id FROM users WHERE email = $1)" },
+        { "invalidate_token", "INSERT INTO token_blacklist (token) VALUES ($1)" },
+        { "revoked_tokens", "SELECT token FROM token_blacklist" },
+        { "notify", "SELECT pg_notify($1, $2)" },
+        { "cluster_nodes", "SELECT node_id, address FROM cluster_nodes ORDER BY node_id" },
+        { "update_user_status", "UPDATE users SET status = $2 WHERE email = $1" },
+        { "users",
+            "SELECT user_id, user_name, email, profile_picture, status, "
+            "(EXTRACT(EPOCH FROM created_at) * 1000)::bigint AS created_at FROM users" },
+        { "user_by_id",
+            "SELECT user_id, user_name, email, profile_picture, status, "
+            "(EXTRACT(EPOCH FROM created_at) * 1000)::bigint AS created_at FROM users WHERE user_id = $1" },
+        { "user_by_email",
+            "SELECT user_id, user_name, email, profile_picture, status, "
+            "(EXTRACT(EPOCH FROM created_at) * 1000)::bigint AS created_at FROM users WHERE email = $1" },
+        /*
+            Send path: the room comes from RoomDirectory, so storing a message is this one statement. It inserts the
+            message and moves rooms.last_message_at to the message time; data-modifying CTEs run in the statement's
+            implicit transaction, so both commit together in a single round trip.
+        */
+        { "save_message",
+            "WITH inserted AS ("
+            "INSERT INTO messages (room_id, sender_id, content) VALUES ($1, $2, $3) "
+            "RETURNING message_id, room_id, sender_id, created_at), "
+            "bumped AS ("
+            "UPDATE rooms SET last_message_at = inserted.created_at "
+            "FROM inserted WHERE rooms.room_id = inserted.room_id) "
+            "SELECT message_id, room_id, sender_id, "
+            "(EXTRACT(EPOCH FROM created_at) * 1000)::bigint AS created_at FROM inserted" },
+        { "update_last_message_at", "UPDATE rooms SET last_message_at = CURRENT_TIMESTAMP WHERE room_id = $1" },
+        { "update_message_status",
+            "INSERT INTO message_status (message_id, user_id, status) VALUES ($1, $2, $3) "
+            "ON CONFLICT (message_id, user_id) DO UPDATE SET status = $3, updated_at = CURRENT_TIMESTAMP" },
+        { "room_by_id",
+            "SELECT r.room_id, ru.user_id_1, ru.user_id_2, "
+            "(EXTRACT(EPOCH FROM r.last_message_at) * 1000)::bigint AS last_message_at, "
+            "(EXTRACT(EPOCH FROM r.created_at) * 1000)::bigint AS created_at "
+            "FROM rooms r "
+            "JOIN relation_user ru ON r.room_id = ru.room_id "
+            "WHERE r.room_id = $1" },
+        { "room_by_user_ids",
+            "SELECT r.room_id, ru.user_id_1, ru.user_id_2, "
+            "(EXTRACT(EPOCH FROM r.last_message_at) * 1000)::bigint AS last_message_at, "
+            "(EXTRACT(EPOCH FROM r.created_at) * 1000)::bigint AS created_at "
+            "FROM rooms r "
+            "JOIN relation_user ru ON r.room_id = ru.room_id "
+            // The pair is normalized so relation_user_pair_idx serves the lookup, whichever way round the relation was stored
+            "WHERE LEAST(ru.user_id_1, ru.user_id_2) = LEAST($1::int, $2::int) "
+            "AND GREATEST(ru.user_id_1, ru.user_id_2) = GREATEST($1::int, $2::int)" },
+        { "rooms_by_user_id",
+            "SELECT r.room_id, ru.user_id_1, ru.user_id_2, "
+            "(EXTRACT(EPOCH FROM r.last_message_at) * 1000)::bigint AS last_message_at, "
+            "(EXTRACT(EPOCH FROM r.created_at) * 1000)::bigint AS created_at "
+            "FROM rooms r "
+            "JOIN relation_user ru ON r.room_id = ru.room_id "
+            "WHERE ru.user_id_1 = $1 OR ru.user_id_2 = $1" },
+        // Bounded by time so only the monthly partitions of the window are scanned (pruned at execution)
+        { "messages_by_room",
+            "SELECT message_id, room_id, sender_id, content, is_read, "
+            "(EXTRACT(EPOCH FROM created_at) * 1000)::bigint AS created_at FROM messages "
+            "WHERE room_id = $1 AND created_at >= to_timestamp($2::bigint / 1000.0) "
+            "AND created_at < to_timestamp($3::bigint / 1000.0) "
+            "ORDER BY created_at" },
+        { "relation_by_user_ids",
+            "SELECT user_id_1, user_id_2, is_accepted, room_id FROM relation_user "
+            "WHERE LEAST(user_id_1, user_id_2) = LEAST($1::int, $2::int) "
+            "AND GREATEST(user_id_1, user_id_2) = GREATEST($1::int, $2::int)" },
+        { "insert_relation", "INSERT INTO relation_user (user_id_1, user_id_2, is_accepted) VALUES ($1, $2, true)" },
+        { "accept_relation",
+            "UPDATE relation_user SET is_accepted = true "
+            "WHERE LEAST(user_id_1, user_id_2) = LEAST($1::int, $2::int) "
+            "AND GREATEST(user_id_1, user_id_2) = GREATEST($1::int, $2::int)" },
+        { "friend_requests",
+            "SELECT u.user_id, u.user_name, u.email, u.profile_picture, u.status, "
+            "(EXTRACT(EPOCH FROM u.created_at) * 1000)::bigint AS created_at "
+            "FROM users u "
+            "JOIN relation_user ru ON u.user_id = ru.user_id_1 "
+            "WHERE ru.user_id_2 = $1 AND ru.is_accepted = false" },
+        { "friends",
+            "SELECT u.user_id, u.user_name, u.email, u.profile_picture, u.status, "
+            "(EXTRACT(EPOCH FROM u.created_at) * 1000)::bigint AS created_at "
+            "FROM users u "
+            "JOIN relation_user ru ON u.user_id = ru.user_id_1 "
+            "WHERE ru.user_id_2 = $1 AND ru.is_accepted = true" },
+        { "friend_requests_pending",
+            "SELECT u.user_id, u.user_name, u.email, u.profile_picture, u.status, "
+            "(EXTRACT(EPOCH FROM u.created_at) * 1000)::bigint AS created_at "
+            "FROM users u "
+            "JOIN relation_user ru ON u.user_id = ru.user_id_2 "
+            "WHERE ru.user_id_1 = $1 AND ru.is_accepted = false" },
+    };
+
+    /*
+        Idempotent schema objects the queries above rely on, applied by ensureSchema at startup.
+    */
+    const std::vector<std::string> kSchemaStatements = {
+        // Normalized pair index behind the room and relation lookups of a pair of users
+        "CREATE INDEX IF NOT EXISTS relation_user_pair_idx "
+        "ON relation_user (LEAST(user_id_1, user_id_2), GREATEST(user_id_1, user_id_2))",
+        // Every update or delete of a user row notifies UserDirectory listeners with its id
+        "CREATE OR REPLACE FUNCTION notify_users_changed() RETURNS trigger AS $$ "
+        "BEGIN "
+        "PERFORM pg_notify('users_changed', OLD.user_id::text); "
+        "RETURN NULL; "
+        "END; "
+        "$$ LANGUAGE plpgsql",
+        "DROP TRIGGER IF EXISTS users_changed ON users",
+        "CREATE TRIGGER users_changed AFTER UPDATE OR DELETE ON users "
+        "FOR EACH ROW EXECUTE FUNCTION notify_users_changed()",
+        // Every revoked token is sent to the TokenValidator listeners of all the nodes
+        "CREATE OR REPLACE FUNCTION notify_token_revoked() RETURNS trigger AS $$ "
+        "BEGIN "
+        "PERFORM pg_notify('tokens_revoked', NEW.token); "
+        "RETURN NULL; "
+        "END; "
+        "$$ LANGUAGE plpgsql",
+        "DROP TRIGGER IF EXISTS tokens_revoked ON token_blacklist",
+        "CREATE TRIGGER tokens_revoked AFTER INSERT ON token_blacklist "
+        "FOR EACH ROW EXECUTE FUNCTION notify_token_revoked()",
+        // Ring membership when CHAT_CLUSTER_SOURCE=db
+        "CREATE TABLE IF NOT EXISTS cluster_nodes (node_id TEXT PRIMARY KEY, address TEXT NOT NULL)",
+        // messages.journal_id and its unique index are created by migrations/041_message_journal_id.sql,
+        // built per partition without blocking writes
+    };
+
+    /*
+        Row decoders, the only place that knows the columns of each statement.
+        Nullable columns (profile_picture, last_message_at, room_id) decode to their default value.
+    */
+    User readUser(const pqxx::row& row) {
+        return User{
+            row["user_id"].as<int>(),
+            row["user_name"].c_str(),
+            row["email"].c_str(),
+            row["profile_picture"].c_str(),
+            row["status"].c_str(),
+            row["created_at"].as<int64_t>(0)
+        };
+    }
+
+    UserView readUserView(const pqxx::row& row) {
+        return UserView{
+            row["user_id"].as<int>(),
+            row["user_name"].view(),
+            row["email"].view(),
+            row["profile_picture"].view(),
+            row["status"].view(),
+            row["created_at"].as<int64_t>(0)
+        };
+    }
+
+    Room readRoom(const pqxx::row& row) {
+        return Room{
+            row["room_id"].as<int>(),
+            row["user_id_1"].as<int>(),
+            row["user_id_2"].as<int>(),
+            row["last_message_at"].as<int64_t>(0),
+            row["created_at"].as<int64_t>(0)
+        };
+    }
+
+    MessageView readMessageView(const pqxx::row& row) {
+        return MessageView{
+            row["message_id"].as<int64_t>(),
+            row["room_id"].as<int>(),
+            row["sender_id"].as<int>(),
+            row["content"].view(),
+            row["is_read"].as<bool>(false),
+            row["created_at"].as<int64_t>(0)
+        };
+    }
+
+    FriendEdge readFriendEdge(const pqxx::row& row) {
+        return FriendEdge{
+            row["user_id_1"].as<int>(),
+            row["user_id_2"].as<int>(),
+            row["is_accepted"].as<bool>(false),
+            row["room_id"].as<int>(0)
+        };
+    }
+
+    // Decode a bulk result into views that borrow from it, the result itself is kept alive by the view
+    template <typename Row, typename Read>
+    ResultView<Row> makeResultView(pqxx::result result, Read read) {
+        auto owner = std::make_shared<const pqxx::result>(std::move(result));
+        std::vector<Row> rows;
+        rows.reserve(owner->size());
+        for (const auto& row : *owner) {
+            rows.push_back(read(row));
+        }
+        return ResultView<Row>(std::move(owner), std::move(rows));
+    }
+
+    // Replicas are read only (hot standby), only the SELECT statements are prepared on them
+    std::vector<PreparedStatement> readOnlyStatements() {
+        std::vector<PreparedStatement> statements;
+        for (const auto& statement : kPreparedStatements) {
+            if (statement.sql.rfind("SELECT", 0) == 0) {
+                statements.push_back(statement);
+            }
+        }
+        return statements;
+    }
+
+    // The session of the client the current thread is working for, empty outside of a SessionScope
+    thread_local std::string currentSession;
+}
+
 // Get the singleton instance of DatabaseManager
 DatabaseManager& DatabaseManager::getInstance() {
   // Use std::call_once to ensure that the instance is created only once
@@ -23,58 +253,188 @@ DatabaseManager& DatabaseManager::getInstance() {
 }
 
 // Constructor to initialize the connection pool
-// The connection pool is created with the connection information and pool size
-DatabaseManager::DatabaseManager()
-    : connectionPool_(std::make_unique<ConnectionPool>(
-        "host=localhost port=5432 dbname=chat_message_db user=postgres password=root",
-        150
-    )) {
+// The connection pool is created with the connection information, its sizing and the statements to prepare.
+// It starts at CHAT_DB_POOL_SIZE connections (4 per core by default), the CapacityController then moves its size
+// between CHAT_DB_POOL_MIN and CHAT_DB_POOL_MAX with the load
+DatabaseManager::DatabaseManager() {
+    PoolOptions options;
+    minConnections_ = std::max<size_t>(1, Utils::getEnvSize("CHAT_DB_POOL_MIN", options.minSize));
+    maxConnections_ = std::max(minConnections_, Utils::getEnvSize("CHAT_DB_POOL_MAX", options.maxSize));
+    size_t cores = std::max(1u, std::thread::hardware_concurrency());
+    options.minSize = minConnections_;
+    options.maxSize = std::clamp(Utils::getEnvSize("CHAT_DB_POOL_SIZE", 4 * cores), minConnections_, maxConnections_);
+    options.acquireTimeout = std::chrono::milliseconds(
+        Utils::getEnvSize("CHAT_DB_ACQUIRE_TIMEOUT_MS", static_cast<size_t>(options.acquireTimeout.count())));
+
+    primaryConninfo_ = Utils::getEnv("CHAT_DB_PRIMARY",
+        "host=localhost port=5432 dbname=chat_message_db user=postgres password=root");
+    connectionPool_ = std::make_unique<ConnectionPool>(
+        primaryConninfo_,
+        options,
+        kPreparedStatements
+    );
+
+    // Replica conninfos separated by ';', e.g. a local streaming replica:
+    // CHAT_DB_REPLICAS="host=localhost port=5433 dbname=chat_message_db user=postgres password=root"
+    std::stringstream replicas(Utils::getEnv("CHAT_DB_REPLICAS", ""));
+    std::string conninfo;
+    std::vector<PreparedStatement> replicaStatements = readOnlyStatements();
+    while (std::getline(replicas, conninfo, ';')) {
+        if (conninfo.find_first_not_of(' ') == std::string::npos) {
+            continue;
+        }
+        replicaPools_.push_back(std::make_unique<ConnectionPool>(conninfo, options, replicaStatements));
+    }
+
+    stickyWindow_ = std::chrono::milliseconds(
+        Utils::getEnvSize("CHAT_DB_STICKY_MS", static_cast<size_t>(stickyWindow_.count())));
+}
+
+// Apply the schema objects the queries rely on, each statement is idempotent and a failure is only logged
+// so the server still starts against a database where the objects were created by hand
+void DatabaseManager::ensureSchema() {
+    for (const auto& statement : kSchemaStatements) {
+        try {
+            auto conn = getConnection();
+            pqxx::nontransaction txn(*conn);
+            txn.exec(statement);
+        }
+        catch (const std::exception& e) {
+            std::cerr << "Failed to apply schema statement: " << e.what() << "\n";
+        }
+    }
+}
+
+DatabaseManager::SessionScope::SessionScope(std::string key)
+    : previous_(std::move(currentSession)) {
+    currentSession = std::move(key);
+}
+
+DatabaseManager::SessionScope::~SessionScope() {
+    currentSession = std::move(previous_);
 }
 
 DatabaseManager::~DatabaseManager() {}
 
 // Get a connection from the connection pool
-std::shared_ptr<pqxx::connection> DatabaseManager::getConnection() {
-    return connectionPool_->getConnection();
+// The lease releases the connection back to the pool when it goes out of scope, on every path,
+// and throws PoolTimeoutError when no connection frees up in time
+ConnectionPool::Lease DatabaseManager::getConnection() {
+    return connectionPool_->acquire();
+}
+
+ConnectionPool::Lease DatabaseManager::getWriteConnection() {
+    noteSessionWrite();
+    return connectionPool_->acquire();
+}
+
+// Pick the replica with the fewest outstanding leases, ties are broken round robin so the load spreads
+// when every replica is idle. A replica that cannot hand out a connection sends the read to the primary.
+ConnectionPool::Lease DatabaseManager::getReadConnection() {
+    if (replicaPools_.empty() || sessionNeedsPrimary()) {
+        return getConnection();
+    }
+
+    size_t start = nextReplica_.fetch_add(1, std::memory_order_relaxed);
+    ConnectionPool* best = nullptr;
+    size_t bestOutstanding = std::numeric_limits<size_t>::max();
+    for (size_t i = 0; i < replicaPools_.size(); ++i) {
+        ConnectionPool* replica = replicaPools_[(start + i) % replicaPools_.size()].get();
+        size_t outstanding = replica->outstanding();
+        if (outstanding < bestOutstanding) {
+            best = replica;
+            bestOutstanding = outstanding;
+        }
+    }
+
+    try {
+        return best->acquire();
+    }
+    catch (const std::exception& e) {
+        std::cerr << "Replica unavailable, reading from the primary: " << e.what() << "\n";
+        return getConnection();
+    }
+}
+
+void DatabaseManager::noteSessionWrite() {
+    if (replicaPools_.empty() || currentSession.empty()) {
+        return;
+    }
+    auto now = std::chrono::steady_clock::now();
+    std::lock_guard<std::mutex> lock(lastWritesMutex_);
+    lastWrites_[currentSession] = now;
+
+    // Forget the sessions whose window is over once the map has doubled since the last sweep
+    if (lastWrites_.size() >= sweepLastWritesAt_) {
+        for (auto it = lastWrites_.begin(); it != lastWrites_.end();) {
+            if (now - it->second > stickyWindow_) {
+                it = lastWrites_.erase(it);
+            }
+            else {
+                ++it;
+            }
+        }
+        sweepLastWritesAt_ = std::max<size_t>(1024, lastWrites_.size() * 2);
+    }
 }
 
+// A session that wrote within the sticky window reads from the primary, a replica may not have replayed the write yet
+bool DatabaseManager::sessionNeedsPrimary() {
+    if (currentSession.empty()) {
+        return false;
+    }
+    std::lock_guard<std::mutex> lock(lastWritesMutex_);
+    auto it = lastWrites_.find(currentSession);
+    return it != lastWrites_.end() && std::chrono::steady_clock::now() - it->second <= stickyWindow_;
+}
 
-// Release the connection back to the connection pool
-// This allows other threads to use the connection
-void DatabaseManager::releaseConnection(std::shared_ptr<pqxx::connection> conn) {
-    connectionPool_->releaseConnection(conn);
+PoolStats DatabaseManager::getPoolStats() {
+    return connectionPool_->stats();
+}
+
+// Replicas are sized like the primary, they serve the reads of the same db executor threads
+void DatabaseManager::resizeConnectionPools(size_t maxSize) {
+    maxSize = std::clamp(maxSize, minConnections_, maxConnections_);
+    connectionPool_->resize(maxSize);
+    for (const auto& replica : replicaPools_) {
+        replica->resize(maxSize);
+    }
+}
+
+std::vector<PoolStats> DatabaseManager::getReplicaPoolStats() {
+    std::vector<PoolStats> stats;
+    for (const auto& replica : replicaPools_) {
+        stats.push_back(replica->stats());
+    }
+    return stats;
 }
 
 // Excuting the query
 bool DatabaseManager::executeQuery(const std::string& query) {
-     // Get a connection from the connection pool
-     // The connection is automatically released back to the pool when the function exits
-    auto conn = getConnection();
     try {
+        // Get a connection from the connection pool
+        // The connection is automatically released back to the pool when the function exits
+        auto conn = getWriteConnection();
         // Start a transaction
         // The transaction is automatically committed when the function exits
         pqxx::work txn(*conn);
         txn.exec(query);
         txn.commit();
 
-        // When the transaction is committed, the connection is released back to the pool
-        releaseConnection(conn);
         return true;
     }
     catch (const std::exception& e) {
         handleError(e.what());
-        // If an error occurs, the connection is released back to the pool
-        releaseConnection(conn);
         return false;
     }
 }
 
 std::vector<std::vector<std::string>> DatabaseManager::fetchQuery(const std::string& query) {
-    // Get a connection from the connection pool
-    // The connection is automatically released back to the pool when the function exits
-    auto conn = getConnection();
     std::vector<std::vector<std::string>> results;
     try {
+        // Get a connection from the connection pool
+        // The connection is automatically released back to the pool when the function exits
+        auto conn = getConnection();
         pqxx::work txn(*conn);
         pqxx::result res = txn.exec(query);
         for (const auto& row : res) {
@@ -84,11 +444,38 @@ std::vector<std::vector<std::string>> DatabaseManager::fetchQuery(const std::str
             }
             results.push_back(resultRow);
         }
-        releaseConnection(conn);
     }
     catch (const std::exception& e) {
         handleError(e.what());
-        releaseConnection(conn);
+    }
+    return results;
+}
+
+/*
+    The statements of a pipeline run in a nontransaction: pqxx sends them as one batch and each one
+    commits on its own, so there is no BEGIN/COMMIT round trip around the batch either.
+*/
+std::vector<pqxx::result> DatabaseManager::executePipeline(const QueryPipeline& batch) {
+    std::vector<pqxx::result> results;
+    try {
+        auto conn = getWriteConnection();
+        pqxx::nontransaction txn(*conn);
+        pqxx::pipeline pipeline(txn);
+
+        std::vector<pqxx::pipeline::query_id> ids;
+        ids.reserve(batch.statements_.size());
+        for (const auto& render : batch.statements_) {
+            ids.push_back(pipeline.insert(render(txn)));
+        }
+        pipeline.complete();
+
+        results.reserve(ids.size());
+        for (auto id : ids) {
+            results.push_back(pipeline.retrieve(id));
+        }
+    }
+    catch (const std::exception& e) {
+        handleError(e.what());
     }
     return results;
 }
@@ -131,56 +518,64 @@ bool DatabaseManager::updateData(const std::string& table, const std::vector<std
 
 /*
     The query methods below will be built according to the basic flow as follows:
-      1. Get a connection from the connection pool
-      2. Execute the query
-      3. Release the connection back to the pool
-      4. If an exception occurs, handle the error and release the connection back to the pool
+      1. Lease a connection from the connection pool
+      2. Execute the prepared statement, reads run in a nontransaction to skip the BEGIN/COMMIT round trips
+      3. The lease returns the connection to the pool when it goes out of scope, also when an exception is thrown
+      4. If an exception occurs (including an acquire timeout), handle the error
       5. Return the result of the query
 */
 
 bool DatabaseManager::emailExists(const std::string& email) {
-    auto conn = getConnection();
     try {
-        pqxx::work txn(*conn);
-        pqxx::result result = txn.exec("SELECT 1 FROM users WHERE email = " + txn.quote(email));
-        releaseConnection(conn);
+        auto conn = getReadConnection();
+        pqxx::nontransaction txn(*conn);
+        pqxx::result result = txn.exec_prepared("email_exists", email);
         return !result.empty();
     }
     catch (const std::exception& e) {
         handleError(e.what());
-        releaseConnection(conn);
         return false;
     }
 }
 
 bool DatabaseManager::registerUser(const std::string& email, const std::string& passwordHash) {
-    auto conn = getConnection();
     try {
+        auto conn = getWriteConnection();
         pqxx::work txn(*conn);
-        pqxx::result result = txn.exec("INSERT INTO users (email, user_name) VALUES (" + txn.quote(email) + ", " + txn.quote(email) + ") RETURNING user_id");
+        pqxx::result result = txn.exec_prepared("register_user", email);
         if (result.empty()) {
-            releaseConnection(conn);
             return false;
         }
         int userId = result[0][0].as<int>();
-        txn.exec("INSERT INTO authentication (user_id, password_hash) VALUES (" + txn.quote(userId) + ", " + txn.quote(passwordHash) + ")");
+        txn.exec_prepared("insert_password_hash", userId, passwordHash);
         txn.commit();
-        releaseConnection(conn);
         return true;
     }
     catch (const std::exception& e) {
         handleError(e.what());
-        releaseConnection(conn);
         return false;
     }
 }
 
-std::string DatabaseManager::getPasswordHash(const std::string& email) {
-    auto conn = getConnection();
+bool DatabaseManager::updatePasswordHash(const std::string& email, const std::string& passwordHash) {
     try {
+        auto conn = getWriteConnection();
         pqxx::work txn(*conn);
-        pqxx::result result = txn.exec("SELECT password_hash FROM authentication WHERE user_id = (SELECT user_id FROM users WHERE email = " + txn.quote(email) + ")");
-        releaseConnection(conn);
+        txn.exec_prepared("update_password_hash", email, passwordHash);
+        txn.commit();
+        return true;
+    }
+    catch (const std::exception& e) {
+        handleError(e.what());
+        return false;
+    }
+}
+
+std::string DatabaseManager::getPasswordHash(const std::string& email) {
+    try {
+        auto conn = getConnection();
+        pqxx::nontransaction txn(*conn);
+        pqxx::result result = txn.exec_prepared("password_hash", email);
         if (result.empty()) {
             return "";
         }
@@ -188,425 +583,564 @@ std::string DatabaseManager::getPasswordHash(const std::string& email) {
     }
     catch (const std::exception& e) {
         handleError(e.what());
-        releaseConnection(conn);
         return "";
     }
 }
 
 bool DatabaseManager::invalidateToken(const std::string& token) {
-    auto conn = getConnection();
     try {
+        auto conn = getWriteConnection();
         pqxx::work txn(*conn);
-        txn.exec("INSERT INTO token_blacklist (token) VALUES (" + txn.quote(token) + ")");
+        txn.exec_prepared("invalidate_token", token);
         txn.commit();
-        releaseConnection(conn);
         return true;
     }
     catch (const std::exception& e) {
         handleError(e.what());
-        releaseConnection(conn);
         return false;
     }
 }
 
+std::vector<ClusterNode> DatabaseManager::getClusterNodes() {
+    std::vector<ClusterNode> nodes;
+    try {
+        auto conn = getConnection();
+        pqxx::nontransaction txn(*conn);
+        for (const auto& row : txn.exec_prepared("cluster_nodes")) {
+            nodes.push_back(ClusterNode{ row["node_id"].c_str(), row["address"].c_str() });
+        }
+    }
+    catch (const std::exception& e) {
+        handleError(e.what());
+    }
+    return nodes;
+}
+
+std::vector<std::string> DatabaseManager::getRevokedTokens() {
+    std::vector<std::string> tokens;
+    try {
+        auto conn = getConnection();
+        pqxx::nontransaction txn(*conn);
+        pqxx::result result = txn.exec_prepared("revoked_tokens");
+        for (const auto& row : result) {
+            tokens.push_back(row["token"].c_str());
+        }
+    }
+    catch (const std::exception& e) {
+        handleError(e.what());
+    }
+    return tokens;
+}
+
 bool DatabaseManager::updateUserStatus(const std::string& email, const std::string& status) {
-    auto conn = getConnection();
     try {
+        auto conn = getWriteConnection();
         pqxx::work txn(*conn);
-        txn.exec("UPDATE users SET status = " + txn.quote(status) + " WHERE email = " + txn.quote(email));
+        txn.exec_prepared("update_user_status", email, status);
         txn.commit();
-        releaseConnection(conn);
+        // The trigger notifies the other nodes, this one drops its entry right away
+        UserDirectory::getInstance().invalidateEmail(email);
         return true;
     }
     catch (const std::exception& e) {
         handleError(e.what());
-        releaseConnection(conn);
         return false;
     }
 }
 
-std::vector<std::vector<std::string>> DatabaseManager::getUsers() {
-    auto conn = getConnection();
-    std::vector<std::vector<std::string>> users;
+ResultView<UserView> DatabaseManager::getUsers() {
+    ResultView<UserView> users;
     try {
-        pqxx::work txn(*conn);
-        pqxx::result result = txn.exec("SELECT user_name, email, profile_picture, status, created_at FROM users");
-        for (const auto& row : result) {
-            std::vector<std::string> user;
-            user.push_back(row["user_name"].c_str());
-            user.push_back(row["email"].c_str());
-            user.push_back(row["profile_picture"].c_str());
-            user.push_back(row["status"].c_str());
-            user.push_back(row["created_at"].c_str());
-            users.push_back(user);
-        }
-        releaseConnection(conn);
+        auto conn = getReadConnection();
+        pqxx::nontransaction txn(*conn);
+        users = makeResultView<UserView>(txn.exec_prepared("users"), readUserView);
     }
     catch (const std::exception& e) {
         handleError(e.what());
-        releaseConnection(conn);
     }
     return users;
 }
 
 bool DatabaseManager::saveMessage(int roomId, int senderId, const std::string& content) {
-    auto conn = getConnection();
+    return insertMessage(roomId, senderId, content).has_value();
+}
+
+std::optional<Message> DatabaseManager::insertMessage(int roomId, int senderId, const std::string& content) {
+    std::optional<Message> message;
     try {
-        pqxx::work txn(*conn);
-        txn.exec("INSERT INTO messages (room_id, sender_id, content) VALUES (" + txn.quote(roomId) + ", " + txn.quote(senderId) + ", " + txn.quote(content) + ")");
-        txn.commit();
-        releaseConnection(conn);
+        auto conn = getWriteConnection();
+        // A single statement commits on its own, no BEGIN/COMMIT round trips around it
+        pqxx::nontransaction txn(*conn);
+        pqxx::result res = txn.exec_prepared("save_message", roomId, senderId, content);
+        if (!res.empty()) {
+            message = Message{
+                res[0]["message_id"].as<int64_t>(),
+                res[0]["room_id"].as<int>(),
+                res[0]["sender_id"].as<int>(),
+                content,
+                false,
+                res[0]["created_at"].as<int64_t>(0)
+            };
+        }
+    }
+    catch (const std::exception& e) {
+        handleError(e.what());
+    }
+    return message;
+}
+
+// Store a message between two users, the room comes from RoomDirectory so the only round trip is the insert
+std::optional<Message> DatabaseManager::sendMessage(int senderId, int recipientId, const std::string& content) {
+    std::optional<int> roomId = getRoomIdByUserIds(senderId, recipientId);
+    if (!roomId) {
+        // The two users have no room together
+        return std::nullopt;
+    }
+    try {
+        return insertMessage(*roomId, senderId, content);
+    }
+    catch (...) {
+        // The cached room may be gone, resolve it again on the next message
+        RoomDirectory::getInstance().erase(senderId, recipientId);
+        throw;
+    }
+}
+
+// Sender and recipient come from UserDirectory and the room from RoomDirectory,
+// so once they are warm the message costs one round trip
+std::optional<SentMessage> DatabaseManager::sendMessage(const std::string& senderEmail, int recipientId, const std::string& content) {
+    std::optional<User> sender = getUserByEmail(senderEmail);
+    if (!sender) {
+        return std::nullopt;
+    }
+    std::optional<Message> message = sendMessage(sender->id, recipientId, content);
+    if (!message) {
+        return std::nullopt;
+    }
+
+    SentMessage sent;
+    sent.sender = std::move(*sender);
+    sent.recipient = getUserById(recipientId);
+    sent.message = std::move(*message);
+    return sent;
+}
+
+// Store a batch drained from the MessageJournal in one statement: the rows that are not stored yet are inserted
+// and each room's last_message_at is bumped. Not prepared, the batch size varies and journal_id is only there
+// once migrations/041_message_journal_id.sql ran; until then the statement fails and the journal retries it.
+bool DatabaseManager::storeJournaledMessages(const std::vector<JournalEntry>& entries, std::vector<Message>& stored) {
+    if (entries.empty()) {
+        return true;
+    }
+    try {
+        auto conn = getWriteConnection();
+        pqxx::nontransaction txn(*conn);
+
+        std::ostringstream query;
+        query << "WITH batch (journal_id, room_id, sender_id, content, created_at) AS (VALUES ";
+        for (size_t i = 0; i < entries.size(); ++i) {
+            const JournalEntry& entry = entries[i];
+            query << (i == 0 ? "" : ", ")
+                << "(" << txn.quote(entry.id) << ", " << entry.roomId << ", " << entry.senderId << ", "
+                << txn.quote(entry.content) << ", to_timestamp(" << entry.createdAt << " / 1000.0))";
+        }
+        query << "), inserted AS ("
+            "INSERT INTO messages (journal_id, room_id, sender_id, content, created_at) "
+            "SELECT journal_id, room_id, sender_id, content, created_at FROM batch "
+            "ON CONFLICT (journal_id, created_at) DO NOTHING "
+            "RETURNING message_id, journal_id, room_id, created_at), "
+            "bumped AS ("
+            "UPDATE rooms SET last_message_at = GREATEST(rooms.last_message_at, latest.created_at) "
+            "FROM (SELECT room_id, max(created_at) AS created_at FROM inserted GROUP BY room_id) AS latest "
+            "WHERE rooms.room_id = latest.room_id) "
+            "SELECT message_id, journal_id FROM inserted";
+        pqxx::result inserted = txn.exec(query.str());
+
+        // The rows skipped as already stored are not returned, the others are matched back to their entries
+        std::unordered_map<std::string_view, const JournalEntry*> byId;
+        for (const JournalEntry& entry : entries) {
+            byId.emplace(entry.id, &entry);
+        }
+        for (const auto& row : inserted) {
+            auto it = byId.find(std::string_view(row[1].c_str()));
+            if (it == byId.end()) {
+                continue;
+            }
+            const JournalEntry& entry = *it->second;
+            stored.push_back(Message{ row[0].as<int64_t>(), entry.roomId, entry.senderId, entry.content, false,
+                entry.createdAt, entry.id });
+        }
+        return true;
+    }
+    catch (const std::exception& e) {
+        std::cerr << "Failed to store journaled messages: " << e.what() << "\n";
+        return false;
+    }
+}
+
+/*
+    Partition maintenance for the monthly partitioned messages table (migrations/040_partition_messages.sql).
+    These run a few times a day and are not prepared: the function they call only exists once the migration ran.
+*/
+bool DatabaseManager::ensureMessagePartitions(int monthsAhead) {
+    try {
+        auto conn = getConnection();
+        pqxx::nontransaction txn(*conn);
+        pqxx::result partitioned = txn.exec(
+            "SELECT 1 FROM pg_partitioned_table WHERE partrelid = to_regclass('messages')");
+        if (partitioned.empty()) {
+            // The migration has not run, messages is still a single heap
+            return false;
+        }
+        txn.exec("SELECT ensure_message_partitions(" + txn.quote(monthsAhead) + ")");
         return true;
     }
     catch (const std::exception& e) {
         handleError(e.what());
-        releaseConnection(conn);
         return false;
     }
+}
+
+// Detach the monthly partitions older than retainMonths. DETACH ... CONCURRENTLY only takes a
+// SHARE UPDATE EXCLUSIVE lock on messages, so inserts into the current month carry on meanwhile.
+// The detached tables stay in the database as plain tables, ready to be dumped to cold storage and dropped.
+std::vector<std::string> DatabaseManager::detachMessagePartitions(int retainMonths) {
+    std::vector<std::string> detached;
+    try {
+        auto conn = getConnection();
+        std::vector<std::string> partitions;
+        {
+            pqxx::nontransaction txn(*conn);
+            pqxx::result result = txn.exec(
+                "SELECT c.relname FROM pg_inherits i JOIN pg_class c ON c.oid = i.inhrelid "
+                "WHERE i.inhparent = to_regclass('messages') AND c.relname ~ '^messages_p[0-9]{6}$' "
+                "AND to_date(substring(c.relname FROM 11 FOR 6), 'YYYYMM') < "
+                "date_trunc('month', now()) - make_interval(months => " + txn.quote(retainMonths) + ") "
+                "ORDER BY c.relname");
+            for (const auto& row : result) {
+                partitions.emplace_back(row[0].c_str());
+            }
+        }
+        for (const auto& partition : partitions) {
+            // CONCURRENTLY cannot run inside a transaction block
+            pqxx::nontransaction txn(*conn);
+            txn.exec("ALTER TABLE messages DETACH PARTITION " + txn.quote_name(partition) + " CONCURRENTLY");
+            detached.push_back(partition);
+        }
+    }
+    catch (const std::exception& e) {
+        handleError(e.what());
+    }
+    return detached;
+}
+
+// Send NOTIFY payloads (channel, payload), every channel in one pipelined round trip
+bool DatabaseManager::notify(const std::vector<std::pair<std::string, std::string>>& notifications) {
+    if (notifications.empty()) {
+        return true;
+    }
+    QueryPipeline pipeline;
+    for (const auto& [channel, payload] : notifications) {
+        pipeline.add("notify", channel, payload);
+    }
+    return executePipeline(pipeline).size() == pipeline.size();
+}
 
-	updateLastMessageAt(roomId);
+bool DatabaseManager::recordLogin(const std::string& email, const std::string& upgradedPasswordHash) {
+    QueryPipeline pipeline;
+    if (!upgradedPasswordHash.empty()) {
+        pipeline.add("update_password_hash", email, upgradedPasswordHash);
+    }
+    pipeline.add("update_user_status", email, std::string("online"));
+    bool recorded = executePipeline(pipeline).size() == pipeline.size();
+    UserDirectory::getInstance().invalidateEmail(email);
+    return recorded;
 }
 
 bool DatabaseManager::updateLastMessageAt(int roomId) {
-	auto conn = getConnection();
 	try {
+		auto conn = getWriteConnection();
 		pqxx::work txn(*conn);
-		txn.exec("UPDATE rooms SET last_message_at = CURRENT_TIMESTAMP WHERE room_id = " + txn.quote(roomId));
+		txn.exec_prepared("update_last_message_at", roomId);
 		txn.commit();
-		releaseConnection(conn);
 		return true;
 	}
 	catch (const std::exception& e) {
 		handleError(e.what());
-		releaseConnection(conn);
 		return false;
 	}
 }
 
 bool DatabaseManager::updateMessageStatus(int messageId, int userId, const std::string& status) {
-    auto conn = getConnection();
     try {
+        auto conn = getWriteConnection();
         pqxx::work txn(*conn);
-        txn.exec("INSERT INTO message_status (message_id, user_id, status) VALUES (" + txn.quote(messageId) + ", " + txn.quote(userId) + ", " + txn.quote(status) + ") ON CONFLICT (message_id, user_id) DO UPDATE SET status = " + txn.quote(status) + ", updated_at = CURRENT_TIMESTAMP");
+        txn.exec_prepared("update_message_status", messageId, userId, status);
         txn.commit();
-        releaseConnection(conn);
         return true;
     }
     catch (const std::exception& e) {
         handleError(e.what());
-        releaseConnection(conn);
         return false;
     }
 }
 
-std::vector<std::string> DatabaseManager::getRoomById(int roomId) {
-    auto conn = getConnection();
-    std::vector<std::string> room;
+std::optional<Room> DatabaseManager::getRoomById(int roomId) {
+    std::optional<Room> room;
     try {
-        pqxx::work txn(*conn);
-        pqxx::result result = txn.exec(
-            "SELECT r.last_message_at r.created_at, ru.user_id_1, ru.user_id_2 "
-            "FROM rooms r "
-            "JOIN relation_user ru ON r.room_id = ru.room_id "
-            "WHERE r.room_id = " + txn.quote(roomId)
-        );
-        if (result.empty()) {
-            releaseConnection(conn);
-            return room;
+        auto conn = getReadConnection();
+        pqxx::nontransaction txn(*conn);
+        pqxx::result result = txn.exec_prepared("room_by_id", roomId);
+        if (!result.empty()) {
+            room = readRoom(result[0]);
         }
-		room.push_back(result[0]["room_id"].c_str());
-        room.push_back(result[0]["user_id_1"].c_str());
-        room.push_back(result[0]["user_id_2"].c_str());
-        room.push_back(result[0]["last_message_at"].c_str());
-        room.push_back(result[0]["created_at"].c_str());
-
-        releaseConnection(conn);
     }
     catch (const std::exception& e) {
         handleError(e.what());
-        releaseConnection(conn);
     }
     return room;
 }
 
 
-std::vector<std::string> DatabaseManager::getRoomByUserIds(int userId1, int userId2) {
-	auto conn = getConnection();
-	std::vector<std::string> room;
-	try {
-		pqxx::work txn(*conn);
-		pqxx::result result = txn.exec(
-			"SELECT r.room_id, r.last_message_at, r.created_at, ru.user_id_1, ru.user_id_2 "
-			"FROM rooms r "
-			"JOIN relation_user ru ON r.room_id = ru.room_id "
-			"WHERE (ru.user_id_1 = " + txn.quote(userId1) + " AND ru.user_id_2 = " + txn.quote(userId2) + ") "
-			"OR (ru.user_id_1 = " + txn.quote(userId2) + " AND ru.user_id_2 = " + txn.quote(userId1) + ")"
-		);
-		if (result.empty()) {
-			releaseConnection(conn);
-			return room;
-		}
-		room.push_back(result[0]["room_id"].c_str());
-		room.push_back(result[0]["user_id_1"].c_str());
-		room.push_back(result[0]["user_id_2"].c_str());
-		room.push_back(result[0]["last_message_at"].c_str());
-		room.push_back(result[0]["created_at"].c_str());
-		releaseConnection(conn);
-	}
-	catch (const std::exception& e) {
-		handleError(e.what());
-		releaseConnection(conn);
-	}
-	return room;
+std::optional<Room> DatabaseManager::getRoomByUserIds(int userId1, int userId2) {
+    std::optional<Room> room;
+    try {
+        auto conn = getReadConnection();
+        pqxx::nontransaction txn(*conn);
+        pqxx::result result = txn.exec_prepared("room_by_user_ids", userId1, userId2);
+        if (!result.empty()) {
+            room = readRoom(result[0]);
+            RoomDirectory::getInstance().insert(userId1, userId2, room->id);
+        }
+    }
+    catch (const std::exception& e) {
+        handleError(e.what());
+    }
+    return room;
+}
+
+std::optional<int> DatabaseManager::getRoomIdByUserIds(int userId1, int userId2) {
+    std::optional<int> roomId = RoomDirectory::getInstance().find(userId1, userId2);
+    if (roomId) {
+        return roomId;
+    }
+    std::optional<Room> room = getRoomByUserIds(userId1, userId2);
+    if (room) {
+        roomId = room->id;
+    }
+    return roomId;
 }
 
 
-std::vector<std::vector<std::string>> DatabaseManager::getRoomsByUserId(int userId) {
-    auto conn = getConnection();
-    std::vector<std::vector<std::string>> rooms;
+std::vector<Room> DatabaseManager::getRoomsByUserId(int userId) {
+    std::vector<Room> rooms;
     try {
-        pqxx::work txn(*conn);
-        pqxx::result result = txn.exec(
-            "SELECT r.room_id, r.last_message_at, r.created_at, ru.user_id_1, ru.user_id_2 "
-            "FROM rooms r "
-            "JOIN relation_user ru ON r.room_id = ru.room_id "
-            "WHERE ru.user_id_1 = " + txn.quote(userId) + " OR ru.user_id_2 = " + txn.quote(userId)
-        );
+        auto conn = getReadConnection();
+        pqxx::nontransaction txn(*conn);
+        pqxx::result result = txn.exec_prepared("rooms_by_user_id", userId);
+        rooms.reserve(result.size());
         for (const auto& row : result) {
-            std::vector<std::string> room;
-            room.push_back(row["room_id"].c_str());
-			room.push_back(row["user_id_1"].c_str());
-			room.push_back(row["user_id_2"].c_str());
-            room.push_back(row["last_message_at"].c_str());
-            room.push_back(row["created_at"].c_str());
-            rooms.push_back(room);
+            rooms.push_back(readRoom(row));
         }
-        releaseConnection(conn);
     }
     catch (const std::exception& e) {
         handleError(e.what());
-        releaseConnection(conn);
     }
     return rooms;
-};
-
-std::vector<std::vector<std::string>> DatabaseManager::getMessages(int roomId) {
-	auto conn = getConnection();
-	std::vector<std::vector<std::string>> messages;
-	try {
-		pqxx::work txn(*conn);
-		pqxx::result result = txn.exec("SELECT message_id, sender_id, content, is_read, created_at FROM messages WHERE room_id = " + txn.quote(roomId));
-		for (const auto& row : result) {
-			std::vector<std::string> message;
-			message.push_back(row["message_id"].c_str());
-			message.push_back(row["sender_id"].c_str());
-			message.push_back(row["content"].c_str());
-			message.push_back(row["is_read"].c_str());
-			message.push_back(row["created_at"].c_str());
-			messages.push_back(message);
-		}
-		releaseConnection(conn);
-	}
-	catch (const std::exception& e) {
-		handleError(e.what());
-		releaseConnection(conn);
-	}
-
-};
+}
 
-std::vector<std::string> DatabaseManager::getUserById(int userId) {
-	auto conn = getConnection();
-	std::vector<std::string> user;
-	try {
-		pqxx::work txn(*conn);
-		pqxx::result result = txn.exec("SELECT user_name, email, profile_picture, status, created_at FROM users WHERE user_id = " + txn.quote(userId));
-		if (result.empty()) {
-			releaseConnection(conn);
-			return user;
-		}
-		user.push_back(userId + "");
-		user.push_back(result[0]["user_name"].c_str());
-		user.push_back(result[0]["email"].c_str());
-		user.push_back(result[0]["profile_picture"].c_str());
-		user.push_back(result[0]["status"].c_str());
-		user.push_back(result[0]["created_at"].c_str());
-		releaseConnection(conn);
-	}
-	catch (const std::exception& e) {
-		handleError(e.what());
-		releaseConnection(conn);
-	}
-};
+ResultView<MessageView> DatabaseManager::getMessages(int roomId, int64_t fromMs, int64_t toMs) {
+    ResultView<MessageView> messages;
+    try {
+        auto conn = getReadConnection();
+        pqxx::nontransaction txn(*conn);
+        messages = makeResultView<MessageView>(
+            txn.exec_prepared("messages_by_room", roomId, fromMs, toMs), readMessageView);
+    }
+    catch (const std::exception& e) {
+        handleError(e.what());
+    }
+    return messages;
+}
 
+// Served from the user directory, a miss is loaded from the primary: a replica could return the row
+// as it was before the change whose notification just evicted it
+std::optional<User> DatabaseManager::getUserById(int userId) {
+    UserDirectory& directory = UserDirectory::getInstance();
+    std::optional<User> user = directory.findById(userId);
+    if (user) {
+        return user;
+    }
+    try {
+        uint64_t epoch = directory.epoch();
+        auto conn = getConnection();
+        pqxx::nontransaction txn(*conn);
+        pqxx::result result = txn.exec_prepared("user_by_id", userId);
+        if (!result.empty()) {
+            user = readUser(result[0]);
+            directory.insert(*user, epoch);
+        }
+    }
+    catch (const std::exception& e) {
+        handleError(e.what());
+    }
+    return user;
+}
 
-std::vector<std::string> DatabaseManager::getUserByEmail(std::string& email) {
-	auto conn = getConnection();
-	std::vector<std::string> user;
-	try {
-		pqxx::work txn(*conn);
-		pqxx::result result = txn.exec("SELECT user_name, email, profile_picture, status, created_at FROM users WHERE email = " + txn.quote(email));
-		if (result.empty()) {
-			releaseConnection(conn);
-			return user;
-		}
-
-		user.push_back(result[0]["user_id"].c_str());
-		user.push_back(result[0]["user_name"].c_str());
-		user.push_back(result[0]["email"].c_str());
-		user.push_back(result[0]["profile_picture"].c_str());
-		user.push_back(result[0]["status"].c_str());
-		user.push_back(result[0]["created_at"].c_str());
-		releaseConnection(conn);
-	}
-	catch (const std::exception& e) {
-		handleError(e.what());
-		releaseConnection(conn);
-	}
 
-};
+std::optional<User> DatabaseManager::getUserByEmail(const std::string& email) {
+    UserDirectory& directory = UserDirectory::getInstance();
+    std::optional<User> user = directory.findByEmail(email);
+    if (user) {
+        return user;
+    }
+    try {
+        uint64_t epoch = directory.epoch();
+        auto conn = getConnection();
+        pqxx::nontransaction txn(*conn);
+        pqxx::result result = txn.exec_prepared("user_by_email", email);
+        if (!result.empty()) {
+            user = readUser(result[0]);
+            directory.insert(*user, epoch);
+        }
+    }
+    catch (const std::exception& e) {
+        handleError(e.what());
+    }
+    return user;
+}
 
-std::vector<std::string> DatabaseManager::updateFriendRequest(const int userId, const int friendId) {
-    auto conn = getConnection();
-    std::vector<std::string> relation;
+std::optional<FriendEdge> DatabaseManager::updateFriendRequest(const int userId, const int friendId) {
+    std::optional<FriendEdge> relation;
     try {
+        auto conn = getWriteConnection();
         pqxx::work txn(*conn);
-        pqxx::result result = txn.exec(
-            "SELECT * FROM relation_user "
-            "WHERE (user_id_1 = " + txn.quote(userId) + " AND user_id_2 = " + txn.quote(friendId) + ") "
-            "OR (user_id_1 = " + txn.quote(friendId) + " AND user_id_2 = " + txn.quote(userId) + ")"
-        );
+        pqxx::result result = txn.exec_prepared("relation_by_user_ids", userId, friendId);
 
         if (result.empty()) {
-            txn.exec(
-                "INSERT INTO relation_user (user_id_1, user_id_2, is_accepted) VALUES ("
-                + txn.quote(userId) + ", " + txn.quote(friendId) + ", true)"
-            );
+            txn.exec_prepared("insert_relation", userId, friendId);
         }
         else {
-            txn.exec(
-                "UPDATE relation_user SET is_accepted = true "
-                "WHERE (user_id_1 = " + txn.quote(userId) + " AND user_id_2 = " + txn.quote(friendId) + ") "
-                "OR (user_id_1 = " + txn.quote(friendId) + " AND user_id_2 = " + txn.quote(userId) + ")"
-            );
+            txn.exec_prepared("accept_relation", userId, friendId);
         }
 
+        // Fetch the updated or newly created relation before committing
+        result = txn.exec_prepared("relation_by_user_ids", userId, friendId);
         txn.commit();
 
-        // Fetch the updated or newly created relation
-        result = txn.exec(
-            "SELECT * FROM relation_user "
-            "WHERE (user_id_1 = " + txn.quote(userId) + " AND user_id_2 = " + txn.quote(friendId) + ") "
-            "OR (user_id_1 = " + txn.quote(friendId) + " AND user_id_2 = " + txn.quote(userId) + ")"
-        );
-
         if (!result.empty()) {
-            relation.push_back(result[0]["user_id_1"].c_str());
-            relation.push_back(result[0]["user_id_2"].c_str());
-            relation.push_back(result[0]["is_accepted"].c_str());
+            relation = readFriendEdge(result[0]);
+            if (relation->roomId != 0) {
+                RoomDirectory::getInstance().insert(userId, friendId, relation->roomId);
+            }
         }
-
-        releaseConnection(conn);
     }
     catch (const std::exception& e) {
         handleError(e.what());
-        releaseConnection(conn);
     }
     return relation;
 }
 
-std::vector<std::vector<std::string>> DatabaseManager::getFriendRequests(const int userId) {
-	auto conn = getConnection();
-	std::vector<std::vector<std::string>> friendRequests;
-	try {
-		pqxx::work txn(*conn);
-		pqxx::result result = txn.exec(
-			"SELECT u.user_name, u.email, u.profile_picture, u.status, u.created_at "
-			"FROM users u "
-			"JOIN relation_user ru ON u.user_id = ru.user_id_1 "
-			"WHERE ru.user_id_2 = " + txn.quote(userId) + " AND ru.is_accepted = false"
-		);
-		for (const auto& row : result) {
-			std::vector<std::string> friendRequest;
-            friendRequest.push_back(row["user_id"].c_str());
-			friendRequest.push_back(row["user_name"].c_str());
-			friendRequest.push_back(row["email"].c_str());
-			friendRequest.push_back(row["profile_picture"].c_str());
-			friendRequest.push_back(row["status"].c_str());
-			friendRequest.push_back(row["created_at"].c_str());
-			friendRequests.push_back(friendRequest);
-		}
-		releaseConnection(conn);
-	}
-	catch (const std::exception& e) {
-		handleError(e.what());
-		releaseConnection(conn);
-	}
-	return friendRequests;
+/*
+    Search the messages of the rooms the user belongs to. The GIN index over (room_id, content_tsv) finds the matches,
+    but a common word can match a large part of a long history, so the search looks back over growing windows
+    (a week, a month, a year, then everything): the first window holding a full page ends it, and since messages
+    are partitioned by month a short window only touches the newest partitions.
+    Not prepared, content_tsv only exists once the migration ran.
+*/
+MessageSearchPage DatabaseManager::searchMessages(int userId, const std::string& text,
+    const std::optional<MessageSearchCursor>& after, size_t limit) {
+    const int64_t kDayMicros = int64_t{ 24 } * 60 * 60 * 1000 * 1000;
+    const int64_t kWindows[] = { 7 * kDayMicros, 30 * kDayMicros, 365 * kDayMicros, 0 };
+
+    MessageSearchPage page;
+    try {
+        int64_t upper = after ? after->createdAtMicros
+            : std::chrono::duration_cast<std::chrono::microseconds>(
+                std::chrono::system_clock::now().time_since_epoch()).count();
+        auto conn = getReadConnection();
+        pqxx::nontransaction txn(*conn);
+        pqxx::result result;
+        for (int64_t window : kWindows) {
+            std::string sql =
+                "SELECT m.message_id, m.room_id, m.sender_id, m.content, m.is_read, "
+                "(EXTRACT(EPOCH FROM m.created_at) * 1000)::bigint AS created_at, "
+                "(EXTRACT(EPOCH FROM m.created_at) * 1000000)::bigint AS created_at_us "
+                "FROM messages m "
+                "WHERE m.room_id = ANY (ARRAY(SELECT room_id FROM relation_user "
+                "WHERE (user_id_1 = $1 OR user_id_2 = $1) AND room_id IS NOT NULL)) "
+                "AND m.content_tsv @@ websearch_to_tsquery('simple', $2) ";
+            // The bounds are plain integers, inlined so the planner prunes the partitions outside the window
+            if (window != 0) {
+                sql += "AND m.created_at >= TIMESTAMPTZ 'epoch' + " + txn.quote(upper - window)
+                    + " * INTERVAL '1 microsecond' ";
+            }
+            if (after) {
+                // Keyset: strictly after the last row of the previous page, ties on created_at ordered by id
+                sql += "AND (m.created_at, m.message_id) < (TIMESTAMPTZ 'epoch' + " + txn.quote(after->createdAtMicros)
+                    + " * INTERVAL '1 microsecond', " + txn.quote(after->messageId) + ") ";
+            }
+            sql += "ORDER BY m.created_at DESC, m.message_id DESC LIMIT $3";
+
+            result = txn.exec_params(sql, userId, text, static_cast<int64_t>(limit));
+            if (static_cast<size_t>(result.size()) >= limit) {
+                break;
+            }
+        }
+
+        if (!result.empty() && static_cast<size_t>(result.size()) >= limit) {
+            const auto& last = result[result.size() - 1];
+            page.next = MessageSearchCursor{ last["created_at_us"].as<int64_t>(), last["message_id"].as<int64_t>() };
+        }
+        page.messages = makeResultView<MessageView>(std::move(result), readMessageView);
+    }
+    catch (const std::exception& e) {
+        handleError(e.what());
+    }
+    return page;
 }
 
+ResultView<UserView> DatabaseManager::getFriendRequests(const int userId) {
+    ResultView<UserView> friendRequests;
+    try {
+        auto conn = getReadConnection();
+        pqxx::nontransaction txn(*conn);
+        friendRequests = makeResultView<UserView>(txn.exec_prepared("friend_requests", userId), readUserView);
+    }
+    catch (const std::exception& e) {
+        handleError(e.what());
+    }
+    return friendRequests;
+}
 
-std::vector<std::vector<std::string>> DatabaseManager::getFriends(const int userId) {
-	auto conn = getConnection();
-	std::vector<std::vector<std::string>> friends;
-	try {
-		pqxx::work txn(*conn);
-		pqxx::result result = txn.exec(
-			"SELECT u.user_name, u.email, u.profile_picture, u.status, u.created_at "
-			"FROM users u "
-			"JOIN relation_user ru ON u.user_id = ru.user_id_1 "
-			"WHERE ru.user_id_2 = " + txn.quote(userId) + " AND ru.is_accepted = true"
-		);
-		for (const auto& row : result) {
-			std::vector<std::string> friend_;
-			friend_.push_back(row["user_id"].c_str());
-            friend_.push_back(row["user_name"].c_str());
-            friend_.push_back(row["email"].c_str());
-            friend_.push_back(row["profile_picture"].c_str());
-            friend_.push_back(row["status"].c_str());
-            friend_.push_back(row["created_at"].c_str());
-			friends.push_back(friend_);
-		}
-		releaseConnection(conn);
-	}
-	catch (const std::exception& e) {
-		handleError(e.what());
-		releaseConnection(conn);
-	}
-	return friends;
+
+ResultView<UserView> DatabaseManager::getFriends(const int userId) {
+    ResultView<UserView> friends;
+    try {
+        auto conn = getReadConnection();
+        pqxx::nontransaction txn(*conn);
+        friends = makeResultView<UserView>(txn.exec_prepared("friends", userId), readUserView);
+    }
+    catch (const std::exception& e) {
+        handleError(e.what());
+    }
+    return friends;
 }
 
-std::vector<std::vector<std::string>> DatabaseManager::getFriendRequestPending(const int userId) {
-	auto conn = getConnection();
-	std::vector<std::vector<std::string>> friendRequests;
-	try {
-		pqxx::work txn(*conn);
-		pqxx::result result = txn.exec(
-			"SELECT u.user_name, u.email, u.profile_picture, u.status, u.created_at "
-			"FROM users u "
-			"JOIN relation_user ru ON u.user_id = ru.user_id_2 "
-			"WHERE ru.user_id_1 = " + txn.quote(userId) + " AND ru.is_accepted = false"
-		);
-		for (const auto& row : result) {
-			std::vector<std::string> friendRequest;
-			friendRequest.push_back(row["user_id"].c_str());
-			friendRequest.push_back(row["user_name"].c_str());
-			friendRequest.push_back(row["email"].c_str());
-			friendRequest.push_back(row["profile_picture"].c_str());
-			friendRequest.push_back(row["status"].c_str());
-			friendRequest.push_back(row["created_at"].c_str());
-			friendRequests.push_back(friendRequest);
-		}
-		releaseConnection(conn);
-	}
-	catch (const std::exception& e) {
-		handleError(e.what());
-		releaseConnection(conn);
-	}
-	return friendRequests;
+ResultView<UserView> DatabaseManager::getFriendRequestPending(const int userId) {
+    ResultView<UserView> friendRequests;
+    try {
+        auto conn = getReadConnection();
+        pqxx::nontransaction txn(*conn);
+        friendRequests = makeResultView<UserView>(txn.exec_prepared("friend_requests_pending", userId), readUserView);
+    }
+    catch (const std::exception& e) {
+        handleError(e.what());
+    }
+    return friendRequests;
 }
 
 void DatabaseManager::handleError(const std::string& errorMessage) {
     std::cerr << "Database error: " << errorMessage << std::endl;
     throw std::runtime_error("Database error: " + errorMessage);
 }
-
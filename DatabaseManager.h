@@ -2,59 +2,172 @@
 #include <string>
 #include <vector>
 #include <memory>
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <unordered_map>
+#include <utility>
+#include <optional>
+#include <functional>
 #include "ConnectionPool.h"
+#include "Models.h"
+#include "Storage.h"
 
 #ifndef DATABASEMANAGER_H
 #define DATABASEMANAGER_H
 
 /*
     The DatabaseManager class is a singleton class that provides an interface to interact with the database.
+    It is the Postgres implementation of Storage, selected unless CHAT_STORAGE=memory.
     It manages the connection pool and provides methods to execute queries, fetch data, and perform CRUD operations.
     The DatabaseManager should be a singleton class to maintain a single connectionPool throughout the application's lifecycle.
+
+    Writes always go to the primary. When replicas are configured (CHAT_DB_REPLICAS), read-only methods go to the
+    replica with the fewest outstanding leases, except for a session that wrote recently: its reads stay on the primary
+    for CHAT_DB_STICKY_MS so it always sees its own writes despite replication lag.
 */
 
-class DatabaseManager {
+/*
+    A batch of prepared statements sent back to back on one connection through a pqxx::pipeline.
+    The results are collected after a single flush, so the whole batch costs one round trip.
+    Each entry is rendered as EXECUTE name(params), which reuses the plan prepared on the connection.
+*/
+class QueryPipeline {
+public:
+    // Queue a prepared statement, returns the index of its result
+    template <typename... Args>
+    size_t add(const std::string& statement, Args... args) {
+        statements_.push_back([statement, args...](pqxx::transaction_base& txn) {
+            std::string sql = "EXECUTE " + statement;
+            if constexpr (sizeof...(Args) > 0) {
+                std::string separator = "(";
+                ((sql += separator + txn.quote(args), separator = ", "), ...);
+                sql += ")";
+            }
+            return sql;
+        });
+        return statements_.size() - 1;
+    }
+
+    size_t size() const { return statements_.size(); }
+
+private:
+    friend class DatabaseManager;
+    std::vector<std::function<std::string(pqxx::transaction_base&)>> statements_;
+};
+
+class DatabaseManager : public Storage {
 public:
     static DatabaseManager& getInstance();
+    std::string backendName() const override { return "postgres"; }
+    // Create the indexes and triggers the queries rely on, run once at startup
+    void ensureSchema();
+
+    // Binds the calls made on this thread to a client session (e.g. its bearer token) until the scope ends,
+    // the session key is what read-your-writes stickiness is tracked by
+    class SessionScope {
+    public:
+        explicit SessionScope(std::string key);
+        ~SessionScope();
+        SessionScope(const SessionScope&) = delete;
+        SessionScope& operator=(const SessionScope&) = delete;
+
+    private:
+        std::string previous_;
+    };
 
     std::vector<std::vector<std::string>> fetchQuery(const std::string& query);
-    std::vector<std::vector<std::string>> getUsers();
-    std::vector<std::vector<std::string>> getRoomsByUserId(int userId);
-	std::vector<std::string> getRoomById(int roomId);
-	std::vector<std::string> getRoomByUserIds(int userId1, int userId2);
-    std::vector<std::vector<std::string>> getMessages(int roomId);
-    std::vector<std::string> getUserByEmail(std::string& email);
-	std::vector<std::string> getUserById(int userId);
-	std::vector<std::string> updateFriendRequest(const int userId, const int friendId);
-    std::string getPasswordHash(const std::string& email);
-	std::vector<std::vector<std::string>> getFriendRequests(const int userId);
-    std::vector<std::vector<std::string>> getFriends(const int userId);
-    std::vector<std::vector<std::string>> getFriendRequestPending(const int userId);
+    ResultView<UserView> getUsers() override;
+    std::vector<Room> getRoomsByUserId(int userId) override;
+	std::optional<Room> getRoomById(int roomId) override;
+	std::optional<Room> getRoomByUserIds(int userId1, int userId2) override;
+    // Served from RoomDirectory, loaded with getRoomByUserIds on a miss
+    std::optional<int> getRoomIdByUserIds(int userId1, int userId2) override;
+    // Messages of the room created in [fromMs, toMs), epoch milliseconds
+    ResultView<MessageView> getMessages(int roomId, int64_t fromMs, int64_t toMs) override;
+    std::optional<User> getUserByEmail(const std::string& email) override;
+	std::optional<User> getUserById(int userId) override;
+	std::optional<FriendEdge> updateFriendRequest(const int userId, const int friendId) override;
+    std::string getPasswordHash(const std::string& email) override;
+    std::vector<std::string> getRevokedTokens() override;
+    std::vector<ClusterNode> getClusterNodes();
+
+    // Create the monthly messages partitions up to monthsAhead, false when messages is not partitioned
+    bool ensureMessagePartitions(int monthsAhead);
+    // Detach the monthly partitions older than retainMonths, returns their table names
+    std::vector<std::string> detachMessagePartitions(int retainMonths);
+	ResultView<UserView> getFriendRequests(const int userId) override;
+    ResultView<UserView> getFriends(const int userId) override;
+    ResultView<UserView> getFriendRequestPending(const int userId) override;
+
+    // Send several statements in one round trip, results are returned in the order they were added
+    std::vector<pqxx::result> executePipeline(const QueryPipeline& pipeline);
+    // Store a message in the room of the two users and bump the room's last_message_at, in one statement
+    std::optional<Message> sendMessage(int senderId, int recipientId, const std::string& content) override;
+    // Resolve sender and recipient from the user directory and store the message
+    std::optional<SentMessage> sendMessage(const std::string& senderEmail, int recipientId, const std::string& content) override;
+    // Insert the entries drained from the MessageJournal, skipping the ones already stored (by journal_id)
+    bool storeJournaledMessages(const std::vector<JournalEntry>& entries, std::vector<Message>& stored) override;
+    // Mark a user online after a successful login and store the upgraded hash if there is one
+    bool recordLogin(const std::string& email, const std::string& upgradedPasswordHash) override;
+    // Send NOTIFY payloads (channel, payload) through the primary in one round trip
+    bool notify(const std::vector<std::pair<std::string, std::string>>& notifications);
 
     bool executeQuery(const std::string& query);
     bool deleteData(const std::string& table, const std::string& condition);
     bool insertData(const std::string& table, const std::vector<std::string>& columns, const std::vector<std::string>& values);
     bool updateData(const std::string& table, const std::vector<std::string>& columns, const std::vector<std::string>& values, const std::string& condition);
-    bool emailExists(const std::string& email);
-    bool registerUser(const std::string& email, const std::string& passwordHash);
-    bool invalidateToken(const std::string& token);
-    bool updateUserStatus(const std::string& email, const std::string& status);
-    bool saveMessage(int roomId, int senderId, const std::string& content);
-    bool updateMessageStatus(int messageId, int userId, const std::string& status);
-	bool updateLastMessageAt(int roomId);
+    bool emailExists(const std::string& email) override;
+    bool registerUser(const std::string& email, const std::string& passwordHash) override;
+    bool updatePasswordHash(const std::string& email, const std::string& passwordHash) override;
+    bool invalidateToken(const std::string& token) override;
+    bool updateUserStatus(const std::string& email, const std::string& status) override;
+    bool saveMessage(int roomId, int senderId, const std::string& content) override;
+    bool updateMessageStatus(int messageId, int userId, const std::string& status) override;
+    // Full-text search over content_tsv (migrations/044_message_search.sql)
+    MessageSearchPage searchMessages(int userId, const std::string& text,
+        const std::optional<MessageSearchCursor>& after, size_t limit) override;
+	bool updateLastMessageAt(int roomId) override;
+
+    PoolStats getPoolStats();
+    const std::string& getPrimaryConninfo() const { return primaryConninfo_; }
+    std::vector<PoolStats> getReplicaPoolStats();
+    // Bounds of the pool size (CHAT_DB_POOL_MIN, CHAT_DB_POOL_MAX) and resizing within them, primary and replicas
+    size_t getMinConnections() const { return minConnections_; }
+    size_t getMaxConnections() const { return maxConnections_; }
+    void resizeConnectionPools(size_t maxSize);
 
 
+    ~DatabaseManager();
+
 private:
     DatabaseManager();
-    ~DatabaseManager();
     DatabaseManager(const DatabaseManager&) = delete;
     DatabaseManager& operator=(const DatabaseManager&) = delete;
 
-    std::shared_ptr<pqxx::connection> getConnection();
-    void releaseConnection(std::shared_ptr<pqxx::connection> conn);
+    // Primary connection for reads that must be fresh
+    ConnectionPool::Lease getConnection();
+    // Primary connection for writes, marks the current session as having written
+    ConnectionPool::Lease getWriteConnection();
+    // Replica connection for reads that tolerate replication lag, falls back to the primary
+    ConnectionPool::Lease getReadConnection();
+    void noteSessionWrite();
+    std::optional<Message> insertMessage(int roomId, int senderId, const std::string& content);
+    bool sessionNeedsPrimary();
     void handleError(const std::string& errorMessage);
 
+    std::string primaryConninfo_;
     std::unique_ptr<ConnectionPool> connectionPool_;
+    std::vector<std::unique_ptr<ConnectionPool>> replicaPools_;
+    std::atomic<size_t> nextReplica_{ 0 };
+    size_t minConnections_ = 1;
+    size_t maxConnections_ = 1;
+
+    // Last write per session, entries older than the sticky window are swept lazily
+    std::unordered_map<std::string, std::chrono::steady_clock::time_point> lastWrites_;
+    std::mutex lastWritesMutex_;
+    size_t sweepLastWritesAt_ = 1024;
+    std::chrono::milliseconds stickyWindow_{ 2000 };
     static std::unique_ptr<DatabaseManager> instance_;
     static std::once_flag initInstanceFlag;
 };
@@ -0,0 +1,83 @@
+#include "HashRing.h"
+#include <algorithm>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+
+/*
+    The HashRing class maps every user id to a home node with consistent hashing over virtual nodes.
+    The hashes are fixed functions (not std::hash) so every process of the cluster builds the same ring.
+*/
+
+HashRing::HashRing(std::vector<ClusterNode> nodes, std::string selfId, size_t virtualNodes)
+    : nodes_(std::move(nodes)), selfId_(std::move(selfId)) {
+    points_.reserve(nodes_.size() * virtualNodes);
+    for (size_t node = 0; node < nodes_.size(); ++node) {
+        for (size_t replica = 0; replica < virtualNodes; ++replica) {
+            points_.emplace_back(hashLabel(nodes_[node].id + "#" + std::to_string(replica)), node);
+        }
+    }
+    std::sort(points_.begin(), points_.end());
+}
+
+std::vector<ClusterNode> HashRing::loadFile(const std::string& path) {
+    std::ifstream file(path);
+    if (!file) {
+        throw std::runtime_error("Cannot open cluster file " + path);
+    }
+    std::vector<ClusterNode> nodes;
+    std::string line;
+    while (std::getline(file, line)) {
+        std::istringstream fields(line);
+        ClusterNode node;
+        if (!(fields >> node.id) || node.id[0] == '#') {
+            continue;
+        }
+        if (!(fields >> node.address)) {
+            throw std::runtime_error("Missing address for node " + node.id + " in " + path);
+        }
+        nodes.push_back(std::move(node));
+    }
+    return nodes;
+}
+
+namespace {
+    // splitmix64 finalizer, spreads inputs that differ in a few bits over the whole ring
+    uint64_t mix(uint64_t x) {
+        x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ull;
+        x = (x ^ (x >> 27)) * 0x94D049BB133111EBull;
+        return x ^ (x >> 31);
+    }
+}
+
+// FNV-1a then mixed, the labels of one node ("n1#0", "n1#1", ...) only differ in their last characters
+uint64_t HashRing::hashLabel(const std::string& label) {
+    uint64_t hash = 14695981039346656037ull;
+    for (unsigned char c : label) {
+        hash ^= c;
+        hash *= 1099511628211ull;
+    }
+    return mix(hash);
+}
+
+// Sequential ids land far apart on the ring
+uint64_t HashRing::hashUser(int userId) {
+    return mix(static_cast<uint64_t>(static_cast<uint32_t>(userId)) + 0x9E3779B97F4A7C15ull);
+}
+
+const ClusterNode& HashRing::homeOf(int userId) const {
+    if (points_.empty()) {
+        throw std::logic_error("Hash ring has no nodes");
+    }
+    uint64_t hash = hashUser(userId);
+    auto it = std::lower_bound(points_.begin(), points_.end(), std::make_pair(hash, size_t{ 0 }));
+    // Past the last point wraps around to the first
+    if (it == points_.end()) {
+        it = points_.begin();
+    }
+    return nodes_[it->second];
+}
+
+bool HashRing::isLocal(int userId) const {
+    return !enabled() || homeOf(userId).id == selfId_;
+}
@@ -0,0 +1,44 @@
+#pragma once
+#include <cstdint>
+#include <string>
+#include <utility>
+#include <vector>
+#include "Models.h"
+
+#ifndef HASHRING_H
+#define HASHRING_H
+
+/*
+    The HashRing class maps every user id to a home node with consistent hashing.
+    Each node is placed on the ring at virtualNodes points, a user belongs to the first point clockwise from the
+    hash of its id, so adding or removing a node only moves the users of the arcs it takes or gives back
+    (about 1/N of them) and the virtual nodes keep the arcs balanced.
+    The TCP server redirects a client that connects to a node which is not its home, so the sockets of a user and
+    most of the deliveries to it stay on one node. An empty ring (no membership configured) disables routing.
+*/
+
+class HashRing {
+public:
+    HashRing() = default;
+    HashRing(std::vector<ClusterNode> nodes, std::string selfId, size_t virtualNodes = 128);
+
+    // Lines of "<node id> <host:port>", blank lines and lines starting with '#' are skipped
+    static std::vector<ClusterNode> loadFile(const std::string& path);
+
+    bool enabled() const { return !points_.empty(); }
+    const ClusterNode& homeOf(int userId) const;
+    bool isLocal(int userId) const;
+    const std::string& selfId() const { return selfId_; }
+    // Stable across processes, builds and standard libraries, for anything the nodes must agree on
+    static uint64_t hashLabel(const std::string& label);
+
+private:
+    static uint64_t hashUser(int userId);
+
+    std::vector<ClusterNode> nodes_;
+    std::string selfId_;
+    // Sorted by hash, the second member indexes nodes_
+    std::vector<std::pair<uint64_t, size_t>> points_;
+};
+
+#endif //HASHRING_H
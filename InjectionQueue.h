@@ -0,0 +1,92 @@
+#pragma once
+#include <atomic>
+#include <cstddef>
+#include <memory>
+
+#ifndef INJECTIONQUEUE_H
+#define INJECTIONQUEUE_H
+
+/*
+    The InjectionQueue class is the lock-free multi-producer multi-consumer queue through which threads outside
+    a ThreadPool (the io_context thread, other pools) hand it tasks. It is a bounded ring of cells, each with a
+    sequence number telling whether it is ready to be written or read for the current lap (D. Vyukov's bounded MPMC
+    queue): producers and consumers each claim a position with one CAS and never wait on each other.
+    capacity must be a power of two. push returns false when the ring is full.
+*/
+
+template <typename T>
+class InjectionQueue {
+public:
+    explicit InjectionQueue(size_t capacity = 65536)
+        : mask_(capacity - 1), cells_(new Cell[capacity]) {
+        for (size_t i = 0; i < capacity; ++i) {
+            cells_[i].sequence.store(i, std::memory_order_relaxed);
+        }
+    }
+    InjectionQueue(const InjectionQueue&) = delete;
+    InjectionQueue& operator=(const InjectionQueue&) = delete;
+
+    bool push(T* item) {
+        size_t position = enqueuePosition_.load(std::memory_order_relaxed);
+        Cell* cell;
+        for (;;) {
+            cell = &cells_[position & mask_];
+            size_t sequence = cell->sequence.load(std::memory_order_acquire);
+            auto difference = static_cast<std::ptrdiff_t>(sequence) - static_cast<std::ptrdiff_t>(position);
+            if (difference == 0) {
+                if (enqueuePosition_.compare_exchange_weak(position, position + 1, std::memory_order_relaxed)) {
+                    break;
+                }
+            }
+            else if (difference < 0) {
+                // The cell still holds the item of the previous lap
+                return false;
+            }
+            else {
+                position = enqueuePosition_.load(std::memory_order_relaxed);
+            }
+        }
+        cell->item = item;
+        cell->sequence.store(position + 1, std::memory_order_release);
+        return true;
+    }
+
+    // nullptr when empty
+    T* pop() {
+        size_t position = dequeuePosition_.load(std::memory_order_relaxed);
+        Cell* cell;
+        for (;;) {
+            cell = &cells_[position & mask_];
+            size_t sequence = cell->sequence.load(std::memory_order_acquire);
+            auto difference = static_cast<std::ptrdiff_t>(sequence) - static_cast<std::ptrdiff_t>(position + 1);
+            if (difference == 0) {
+                if (dequeuePosition_.compare_exchange_weak(position, position + 1, std::memory_order_relaxed)) {
+                    break;
+                }
+            }
+            else if (difference < 0) {
+                return nullptr;
+            }
+            else {
+                position = dequeuePosition_.load(std::memory_order_relaxed);
+            }
+        }
+        T* item = cell->item;
+        // Free for the producer of the next lap
+        cell->sequence.store(position + mask_ + 1, std::memory_order_release);
+        return item;
+    }
+
+private:
+    struct Cell {
+        std::atomic<size_t> sequence;
+        T* item = nullptr;
+    };
+
+    const size_t mask_;
+    std::unique_ptr<Cell[]> cells_;
+    alignas(64) std::atomic<size_t> enqueuePosition_{ 0 };
+    alignas(64) std::atomic<size_t> dequeuePosition_{ 0 };
+};
+
+#endif //INJECTIONQUEUE_H
@@ -0,0 +1,72 @@
+#include "LocalMessageBus.h"
+#include <algorithm>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+/*
+    The LocalMessageBus class connects the TcpServer instances living in the same process.
+*/
+
+namespace {
+    // Which buses hold each user, shared by every LocalMessageBus of the process
+    struct Hub {
+        std::mutex mutex;
+        std::unordered_map<std::string, std::vector<LocalMessageBus*>> subscribers;
+    };
+
+    Hub& hub() {
+        static Hub instance;
+        return instance;
+    }
+}
+
+LocalMessageBus::~LocalMessageBus() {
+    Hub& h = hub();
+    std::lock_guard<std::mutex> lock(h.mutex);
+    for (auto it = h.subscribers.begin(); it != h.subscribers.end();) {
+        auto& buses = it->second;
+        buses.erase(std::remove(buses.begin(), buses.end(), this), buses.end());
+        it = buses.empty() ? h.subscribers.erase(it) : std::next(it);
+    }
+}
+
+void LocalMessageBus::publish(const std::string& email, const std::string& message) {
+    std::vector<LocalMessageBus*> buses;
+    {
+        Hub& h = hub();
+        std::lock_guard<std::mutex> lock(h.mutex);
+        auto it = h.subscribers.find(email);
+        if (it == h.subscribers.end()) {
+            return;
+        }
+        buses = it->second;
+    }
+    // Delivered outside the hub lock, the handler takes the server's own locks
+    for (LocalMessageBus* bus : buses) {
+        bus->deliver(email, message);
+    }
+}
+
+void LocalMessageBus::subscribe(const std::string& email) {
+    Hub& h = hub();
+    std::lock_guard<std::mutex> lock(h.mutex);
+    auto& buses = h.subscribers[email];
+    if (std::find(buses.begin(), buses.end(), this) == buses.end()) {
+        buses.push_back(this);
+    }
+}
+
+void LocalMessageBus::unsubscribe(const std::string& email) {
+    Hub& h = hub();
+    std::lock_guard<std::mutex> lock(h.mutex);
+    auto it = h.subscribers.find(email);
+    if (it == h.subscribers.end()) {
+        return;
+    }
+    auto& buses = it->second;
+    buses.erase(std::remove(buses.begin(), buses.end(), this), buses.end());
+    if (buses.empty()) {
+        h.subscribers.erase(it);
+    }
+}
@@ -0,0 +1,26 @@
+#pragma once
+#include <string>
+#include "MessageBus.h"
+
+#ifndef LOCALMESSAGEBUS_H
+#define LOCALMESSAGEBUS_H
+
+/*
+    The LocalMessageBus class connects the TcpServer instances living in the same process, through a process-wide
+    subscription table. It is the single node default and lets several servers be run side by side in one process
+    to exercise cross-node delivery without a database.
+*/
+
+class LocalMessageBus : public MessageBus {
+public:
+    LocalMessageBus() = default;
+    ~LocalMessageBus() override;
+    LocalMessageBus(const LocalMessageBus&) = delete;
+    LocalMessageBus& operator=(const LocalMessageBus&) = delete;
+
+    void publish(const std::string& email, const std::string& message) override;
+    void subscribe(const std::string& email) override;
+    void unsubscribe(const std::string& email) override;
+};
+
+#endif //LOCALMESSAGEBUS_H
@@ -0,0 +1,472 @@
+#include "MemoryStorage.h"
+#include <algorithm>
+#include <cctype>
+#include <chrono>
+#include <functional>
+
+/*
+    The MemoryStorage class keeps users, relations, rooms and messages in sharded maps, see MemoryStorage.h.
+    Reads copy the rows out under a shared lock; bulk reads return a ResultView over a copy owned by the view.
+*/
+
+namespace {
+    int64_t nowMillis() {
+        return std::chrono::duration_cast<std::chrono::milliseconds>(
+            std::chrono::system_clock::now().time_since_epoch()).count();
+    }
+
+    template <typename Shards, typename Key>
+    auto& shardOf(Shards& shards, const Key& key) {
+        return shards[std::hash<Key>{}(key) % shards.size()];
+    }
+
+    ResultView<UserView> makeUserView(std::vector<User> users) {
+        auto owner = std::make_shared<const std::vector<User>>(std::move(users));
+        std::vector<UserView> rows;
+        rows.reserve(owner->size());
+        for (const User& user : *owner) {
+            rows.push_back(UserView{ user.id, user.name, user.email, user.profilePicture, user.status, user.createdAt });
+        }
+        return ResultView<UserView>(owner, std::move(rows));
+    }
+
+    // Lowercased words, split on ASCII punctuation and spaces (bytes of UTF-8 sequences are part of words),
+    // close to what to_tsvector('simple', ...) keeps
+    std::vector<std::string> words(const std::string& text) {
+        std::vector<std::string> result;
+        std::string word;
+        for (char c : text) {
+            auto byte = static_cast<unsigned char>(c);
+            if (byte >= 0x80 || std::isalnum(byte)) {
+                word += static_cast<char>(std::tolower(byte));
+            }
+            else if (!word.empty()) {
+                result.push_back(std::move(word));
+                word.clear();
+            }
+        }
+        if (!word.empty()) {
+            result.push_back(std::move(word));
+        }
+        return result;
+    }
+
+    ResultView<MessageView> makeMessageView(std::vector<Message> messages) {
+        auto owner = std::make_shared<const std::vector<Message>>(std::move(messages));
+        std::vector<MessageView> rows;
+        rows.reserve(owner->size());
+        for (const Message& message : *owner) {
+            rows.push_back(MessageView{ message.id, message.roomId, message.senderId, message.content,
+                message.isRead, message.createdAt });
+        }
+        return ResultView<MessageView>(owner, std::move(rows));
+    }
+}
+
+uint64_t MemoryStorage::pairKey(int userId1, int userId2) {
+    auto low = static_cast<uint32_t>(std::min(userId1, userId2));
+    auto high = static_cast<uint32_t>(std::max(userId1, userId2));
+    return (static_cast<uint64_t>(low) << 32) | high;
+}
+
+ResultView<UserView> MemoryStorage::getUsers() {
+    std::vector<User> users;
+    for (auto& shard : userShards_) {
+        std::shared_lock<std::shared_mutex> lock(shard.mutex);
+        for (const auto& [id, record] : shard.users) {
+            users.push_back(record.user);
+        }
+    }
+    return makeUserView(std::move(users));
+}
+
+std::optional<int> MemoryStorage::userIdByEmail(const std::string& email) {
+    EmailShard& shard = shardOf(emailShards_, email);
+    std::shared_lock<std::shared_mutex> lock(shard.mutex);
+    auto it = shard.ids.find(email);
+    if (it == shard.ids.end()) {
+        return std::nullopt;
+    }
+    return it->second;
+}
+
+std::optional<User> MemoryStorage::getUserById(int userId) {
+    UserShard& shard = shardOf(userShards_, userId);
+    std::shared_lock<std::shared_mutex> lock(shard.mutex);
+    auto it = shard.users.find(userId);
+    if (it == shard.users.end()) {
+        return std::nullopt;
+    }
+    return it->second.user;
+}
+
+std::optional<User> MemoryStorage::getUserByEmail(const std::string& email) {
+    std::optional<int> userId = userIdByEmail(email);
+    return userId ? getUserById(*userId) : std::nullopt;
+}
+
+bool MemoryStorage::emailExists(const std::string& email) {
+    return userIdByEmail(email).has_value();
+}
+
+bool MemoryStorage::registerUser(const std::string& email, const std::string& passwordHash) {
+    EmailShard& emailShard = shardOf(emailShards_, email);
+    std::unique_lock<std::shared_mutex> emailLock(emailShard.mutex);
+    if (emailShard.ids.count(email) != 0) {
+        return false;
+    }
+
+    // Like register_user the name defaults to the email
+    UserRecord record;
+    record.user.id = nextUserId_.fetch_add(1);
+    record.user.name = email;
+    record.user.email = email;
+    record.user.status = "offline";
+    record.user.createdAt = nowMillis();
+    record.passwordHash = passwordHash;
+    int userId = record.user.id;
+    {
+        // The row is reachable by id before its email points at it
+        UserShard& userShard = shardOf(userShards_, userId);
+        std::unique_lock<std::shared_mutex> userLock(userShard.mutex);
+        userShard.users.emplace(userId, std::move(record));
+    }
+    emailShard.ids.emplace(email, userId);
+    return true;
+}
+
+std::string MemoryStorage::getPasswordHash(const std::string& email) {
+    std::optional<int> userId = userIdByEmail(email);
+    if (!userId) {
+        return "";
+    }
+    UserShard& shard = shardOf(userShards_, *userId);
+    std::shared_lock<std::shared_mutex> lock(shard.mutex);
+    auto it = shard.users.find(*userId);
+    return it == shard.users.end() ? "" : it->second.passwordHash;
+}
+
+bool MemoryStorage::updatePasswordHash(const std::string& email, const std::string& passwordHash) {
+    std::optional<int> userId = userIdByEmail(email);
+    if (!userId) {
+        return true;
+    }
+    UserShard& shard = shardOf(userShards_, *userId);
+    std::unique_lock<std::shared_mutex> lock(shard.mutex);
+    auto it = shard.users.find(*userId);
+    if (it != shard.users.end()) {
+        it->second.passwordHash = passwordHash;
+    }
+    return true;
+}
+
+bool MemoryStorage::recordLogin(const std::string& email, const std::string& upgradedPasswordHash) {
+    if (!upgradedPasswordHash.empty()) {
+        updatePasswordHash(email, upgradedPasswordHash);
+    }
+    return updateUserStatus(email, "online");
+}
+
+bool MemoryStorage::updateUserStatus(const std::string& email, const std::string& status) {
+    std::optional<int> userId = userIdByEmail(email);
+    if (!userId) {
+        return true;
+    }
+    UserShard& shard = shardOf(userShards_, *userId);
+    std::unique_lock<std::shared_mutex> lock(shard.mutex);
+    auto it = shard.users.find(*userId);
+    if (it != shard.users.end()) {
+        it->second.user.status = status;
+    }
+    return true;
+}
+
+bool MemoryStorage::invalidateToken(const std::string& token) {
+    std::lock_guard<std::mutex> lock(revokedMutex_);
+    revoked_.push_back(token);
+    return true;
+}
+
+std::vector<std::string> MemoryStorage::getRevokedTokens() {
+    std::lock_guard<std::mutex> lock(revokedMutex_);
+    return revoked_;
+}
+
+std::optional<FriendEdge> MemoryStorage::findRelation(int userId1, int userId2) {
+    uint64_t key = pairKey(userId1, userId2);
+    RelationShard& shard = shardOf(relationShards_, key);
+    std::shared_lock<std::shared_mutex> lock(shard.mutex);
+    auto it = shard.relations.find(key);
+    if (it == shard.relations.end()) {
+        return std::nullopt;
+    }
+    return it->second;
+}
+
+// A new relation is accepted right away (as insert_relation does) and gets its room
+std::optional<FriendEdge> MemoryStorage::updateFriendRequest(const int userId, const int friendId) {
+    uint64_t key = pairKey(userId, friendId);
+    FriendEdge relation;
+    bool created = false;
+    bool roomCreated = false;
+    {
+        RelationShard& shard = shardOf(relationShards_, key);
+        std::unique_lock<std::shared_mutex> lock(shard.mutex);
+        auto it = shard.relations.find(key);
+        if (it == shard.relations.end()) {
+            it = shard.relations.emplace(key, FriendEdge{ userId, friendId, true, 0 }).first;
+            created = true;
+        }
+        it->second.isAccepted = true;
+        if (it->second.roomId == 0) {
+            it->second.roomId = nextRoomId_.fetch_add(1);
+            roomCreated = true;
+        }
+        relation = it->second;
+    }
+
+    if (roomCreated) {
+        RoomShard& shard = shardOf(roomShards_, relation.roomId);
+        std::unique_lock<std::shared_mutex> lock(shard.mutex);
+        RoomRecord& record = shard.rooms[relation.roomId];
+        record.room = Room{ relation.roomId, relation.userId1, relation.userId2, 0, nowMillis() };
+    }
+    if (created) {
+        for (auto [user, peer] : { std::pair<int, int>{ userId, friendId }, std::pair<int, int>{ friendId, userId } }) {
+            PeerShard& shard = shardOf(peerShards_, user);
+            std::unique_lock<std::shared_mutex> lock(shard.mutex);
+            shard.peers[user].push_back(peer);
+        }
+    }
+    return relation;
+}
+
+ResultView<UserView> MemoryStorage::relatedUsers(int userId, bool outgoing, bool accepted) {
+    std::vector<int> peers;
+    {
+        PeerShard& shard = shardOf(peerShards_, userId);
+        std::shared_lock<std::shared_mutex> lock(shard.mutex);
+        auto it = shard.peers.find(userId);
+        if (it != shard.peers.end()) {
+            peers = it->second;
+        }
+    }
+
+    std::vector<User> users;
+    for (int peer : peers) {
+        std::optional<FriendEdge> relation = findRelation(userId, peer);
+        if (!relation || relation->isAccepted != accepted) {
+            continue;
+        }
+        if ((outgoing ? relation->userId1 : relation->userId2) != userId) {
+            continue;
+        }
+        std::optional<User> user = getUserById(peer);
+        if (user) {
+            users.push_back(std::move(*user));
+        }
+    }
+    return makeUserView(std::move(users));
+}
+
+// Requests sent to the user: relation_user.user_id_2 is the user
+ResultView<UserView> MemoryStorage::getFriendRequests(const int userId) {
+    return relatedUsers(userId, false, false);
+}
+
+ResultView<UserView> MemoryStorage::getFriends(const int userId) {
+    return relatedUsers(userId, false, true);
+}
+
+// Requests the user sent: relation_user.user_id_1 is the user
+ResultView<UserView> MemoryStorage::getFriendRequestPending(const int userId) {
+    return relatedUsers(userId, true, false);
+}
+
+std::vector<Room> MemoryStorage::getRoomsByUserId(int userId) {
+    std::vector<int> peers;
+    {
+        PeerShard& shard = shardOf(peerShards_, userId);
+        std::shared_lock<std::shared_mutex> lock(shard.mutex);
+        auto it = shard.peers.find(userId);
+        if (it != shard.peers.end()) {
+            peers = it->second;
+        }
+    }
+
+    std::vector<Room> rooms;
+    for (int peer : peers) {
+        std::optional<int> roomId = getRoomIdByUserIds(userId, peer);
+        std::optional<Room> room = roomId ? getRoomById(*roomId) : std::nullopt;
+        if (room) {
+            rooms.push_back(std::move(*room));
+        }
+    }
+    return rooms;
+}
+
+std::optional<Room> MemoryStorage::getRoomById(int roomId) {
+    RoomShard& shard = shardOf(roomShards_, roomId);
+    std::shared_lock<std::shared_mutex> lock(shard.mutex);
+    auto it = shard.rooms.find(roomId);
+    if (it == shard.rooms.end()) {
+        return std::nullopt;
+    }
+    return it->second.room;
+}
+
+std::optional<Room> MemoryStorage::getRoomByUserIds(int userId1, int userId2) {
+    std::optional<int> roomId = getRoomIdByUserIds(userId1, userId2);
+    return roomId ? getRoomById(*roomId) : std::nullopt;
+}
+
+std::optional<int> MemoryStorage::getRoomIdByUserIds(int userId1, int userId2) {
+    std::optional<FriendEdge> relation = findRelation(userId1, userId2);
+    if (!relation || relation->roomId == 0) {
+        return std::nullopt;
+    }
+    return relation->roomId;
+}
+
+bool MemoryStorage::updateLastMessageAt(int roomId) {
+    RoomShard& shard = shardOf(roomShards_, roomId);
+    std::unique_lock<std::shared_mutex> lock(shard.mutex);
+    auto it = shard.rooms.find(roomId);
+    if (it != shard.rooms.end()) {
+        it->second.room.lastMessageAt = nowMillis();
+    }
+    return true;
+}
+
+ResultView<MessageView> MemoryStorage::getMessages(int roomId, int64_t fromMs, int64_t toMs) {
+    std::vector<Message> messages;
+    {
+        RoomShard& shard = shardOf(roomShards_, roomId);
+        std::shared_lock<std::shared_mutex> lock(shard.mutex);
+        auto it = shard.rooms.find(roomId);
+        if (it != shard.rooms.end()) {
+            const auto& stored = it->second.messages;
+            auto byTime = [](const Message& message, int64_t time) { return message.createdAt < time; };
+            auto first = std::lower_bound(stored.begin(), stored.end(), fromMs, byTime);
+            auto last = std::lower_bound(first, stored.end(), toMs, byTime);
+            messages.assign(first, last);
+        }
+    }
+    return makeMessageView(std::move(messages));
+}
+
+// Insert keeping the room's messages ordered by created_at, a journaled message may be older than the last one
+std::optional<Message> MemoryStorage::appendMessage(int roomId, int senderId, const std::string& content, int64_t createdAt) {
+    RoomShard& shard = shardOf(roomShards_, roomId);
+    std::unique_lock<std::shared_mutex> lock(shard.mutex);
+    auto it = shard.rooms.find(roomId);
+    if (it == shard.rooms.end()) {
+        return std::nullopt;
+    }
+    RoomRecord& record = it->second;
+    Message message{ nextMessageId_.fetch_add(1), roomId, senderId, content, false, createdAt };
+    auto position = std::upper_bound(record.messages.begin(), record.messages.end(), createdAt,
+        [](int64_t time, const Message& stored) { return time < stored.createdAt; });
+    record.messages.insert(position, message);
+    record.room.lastMessageAt = std::max(record.room.lastMessageAt, createdAt);
+    return message;
+}
+
+bool MemoryStorage::saveMessage(int roomId, int senderId, const std::string& content) {
+    return appendMessage(roomId, senderId, content, nowMillis()).has_value();
+}
+
+std::optional<Message> MemoryStorage::sendMessage(int senderId, int recipientId, const std::string& content) {
+    std::optional<int> roomId = getRoomIdByUserIds(senderId, recipientId);
+    if (!roomId) {
+        return std::nullopt;
+    }
+    return appendMessage(*roomId, senderId, content, nowMillis());
+}
+
+std::optional<SentMessage> MemoryStorage::sendMessage(const std::string& senderEmail, int recipientId, const std::string& content) {
+    std::optional<User> sender = getUserByEmail(senderEmail);
+    if (!sender) {
+        return std::nullopt;
+    }
+    std::optional<Message> message = sendMessage(sender->id, recipientId, content);
+    if (!message) {
+        return std::nullopt;
+    }
+
+    SentMessage sent;
+    sent.sender = std::move(*sender);
+    sent.recipient = getUserById(recipientId);
+    sent.message = std::move(*message);
+    return sent;
+}
+
+bool MemoryStorage::storeJournaledMessages(const std::vector<JournalEntry>& entries, std::vector<Message>& stored) {
+    for (const JournalEntry& entry : entries) {
+        {
+            JournalShard& shard = shardOf(journalShards_, entry.id);
+            std::lock_guard<std::mutex> lock(shard.mutex);
+            if (!shard.ids.insert(entry.id).second) {
+                continue;
+            }
+        }
+        if (std::optional<Message> message = appendMessage(entry.roomId, entry.senderId, entry.content, entry.createdAt)) {
+            message->journalId = entry.id;
+            stored.push_back(std::move(*message));
+        }
+    }
+    return true;
+}
+
+bool MemoryStorage::updateMessageStatus(int messageId, int userId, const std::string& status) {
+    uint64_t key = (static_cast<uint64_t>(static_cast<uint32_t>(messageId)) << 32) | static_cast<uint32_t>(userId);
+    StatusShard& shard = shardOf(statusShards_, key);
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    shard.statuses[key] = status;
+    return true;
+}
+
+// Every word of the text must appear in the message, newest matches first
+MessageSearchPage MemoryStorage::searchMessages(int userId, const std::string& text,
+    const std::optional<MessageSearchCursor>& after, size_t limit) {
+    MessageSearchPage page;
+    std::vector<std::string> terms = words(text);
+    if (terms.empty() || limit == 0) {
+        return page;
+    }
+
+    auto position = [](const Message& message) {
+        return std::make_pair(message.createdAt * 1000, message.id);
+    };
+    std::vector<Message> matches;
+    for (const Room& room : getRoomsByUserId(userId)) {
+        RoomShard& shard = shardOf(roomShards_, room.id);
+        std::shared_lock<std::shared_mutex> lock(shard.mutex);
+        auto it = shard.rooms.find(room.id);
+        if (it == shard.rooms.end()) {
+            continue;
+        }
+        for (const Message& message : it->second.messages) {
+            if (after && position(message) >= std::make_pair(after->createdAtMicros, after->messageId)) {
+                continue;
+            }
+            std::vector<std::string> content = words(message.content);
+            bool matched = std::all_of(terms.begin(), terms.end(), [&content](const std::string& term) {
+                return std::find(content.begin(), content.end(), term) != content.end();
+            });
+            if (matched) {
+                matches.push_back(message);
+            }
+        }
+    }
+
+    std::sort(matches.begin(), matches.end(), [&position](const Message& a, const Message& b) {
+        return position(a) > position(b);
+    });
+    if (matches.size() >= limit) {
+        matches.resize(limit);
+        page.next = MessageSearchCursor{ matches.back().createdAt * 1000, matches.back().id };
+    }
+    page.messages = makeMessageView(std::move(matches));
+    return page;
+}
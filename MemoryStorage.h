@@ -0,0 +1,133 @@
+#pragma once
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <mutex>
+#include <shared_mutex>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+#include "Storage.h"
+
+#ifndef MEMORYSTORAGE_H
+#define MEMORYSTORAGE_H
+
+/*
+    The MemoryStorage class is a Storage kept entirely in process memory, for benchmarks and load tests.
+    Nothing is persisted. Every table is split into kShardCount shards, each behind its own shared_mutex:
+    users by id, the email index by email, relations by their normalized user pair, rooms (with their messages)
+    by room id, so concurrent requests on different users or rooms rarely touch the same lock.
+    No method holds two shard locks at once.
+    It mirrors the queries of DatabaseManager, e.g. getFriends(X) returns the users that sent X an accepted request.
+*/
+
+class MemoryStorage : public Storage {
+public:
+    MemoryStorage() = default;
+    MemoryStorage(const MemoryStorage&) = delete;
+    MemoryStorage& operator=(const MemoryStorage&) = delete;
+
+    std::string backendName() const override { return "memory"; }
+
+    ResultView<UserView> getUsers() override;
+    std::optional<User> getUserByEmail(const std::string& email) override;
+    std::optional<User> getUserById(int userId) override;
+    bool emailExists(const std::string& email) override;
+    bool registerUser(const std::string& email, const std::string& passwordHash) override;
+    std::string getPasswordHash(const std::string& email) override;
+    bool updatePasswordHash(const std::string& email, const std::string& passwordHash) override;
+    bool recordLogin(const std::string& email, const std::string& upgradedPasswordHash) override;
+    bool updateUserStatus(const std::string& email, const std::string& status) override;
+    bool invalidateToken(const std::string& token) override;
+    std::vector<std::string> getRevokedTokens() override;
+
+    std::optional<FriendEdge> updateFriendRequest(const int userId, const int friendId) override;
+    ResultView<UserView> getFriendRequests(const int userId) override;
+    ResultView<UserView> getFriends(const int userId) override;
+    ResultView<UserView> getFriendRequestPending(const int userId) override;
+
+    std::vector<Room> getRoomsByUserId(int userId) override;
+    std::optional<Room> getRoomById(int roomId) override;
+    std::optional<Room> getRoomByUserIds(int userId1, int userId2) override;
+    std::optional<int> getRoomIdByUserIds(int userId1, int userId2) override;
+    bool updateLastMessageAt(int roomId) override;
+
+    ResultView<MessageView> getMessages(int roomId, int64_t fromMs, int64_t toMs) override;
+    bool saveMessage(int roomId, int senderId, const std::string& content) override;
+    std::optional<Message> sendMessage(int senderId, int recipientId, const std::string& content) override;
+    std::optional<SentMessage> sendMessage(const std::string& senderEmail, int recipientId, const std::string& content) override;
+    bool storeJournaledMessages(const std::vector<JournalEntry>& entries, std::vector<Message>& stored) override;
+    bool updateMessageStatus(int messageId, int userId, const std::string& status) override;
+    // Scans the messages of the user's rooms, there is no index
+    MessageSearchPage searchMessages(int userId, const std::string& text,
+        const std::optional<MessageSearchCursor>& after, size_t limit) override;
+
+private:
+    static constexpr size_t kShardCount = 16;
+
+    struct UserRecord {
+        User user;
+        std::string passwordHash;
+    };
+    struct UserShard {
+        std::shared_mutex mutex;
+        std::unordered_map<int, UserRecord> users;
+    };
+    struct EmailShard {
+        std::shared_mutex mutex;
+        std::unordered_map<std::string, int> ids;
+    };
+    // Relations keyed by the normalized pair, and for every user the users it has a relation with
+    struct RelationShard {
+        std::shared_mutex mutex;
+        std::unordered_map<uint64_t, FriendEdge> relations;
+    };
+    struct PeerShard {
+        std::shared_mutex mutex;
+        std::unordered_map<int, std::vector<int>> peers;
+    };
+    // A room and its messages, ordered by created_at
+    struct RoomRecord {
+        Room room;
+        std::vector<Message> messages;
+    };
+    struct RoomShard {
+        std::shared_mutex mutex;
+        std::unordered_map<int, RoomRecord> rooms;
+    };
+    // Journal ids already stored, so a replayed entry is skipped
+    struct JournalShard {
+        std::mutex mutex;
+        std::unordered_set<std::string> ids;
+    };
+    // message_status rows keyed by (message id, user id)
+    struct StatusShard {
+        std::mutex mutex;
+        std::unordered_map<uint64_t, std::string> statuses;
+    };
+
+    static uint64_t pairKey(int userId1, int userId2);
+    std::optional<int> userIdByEmail(const std::string& email);
+    std::optional<FriendEdge> findRelation(int userId1, int userId2);
+    // Users whose relation with userId matches (user_id_1 = the user when outgoing is true)
+    ResultView<UserView> relatedUsers(int userId, bool outgoing, bool accepted);
+    std::optional<Message> appendMessage(int roomId, int senderId, const std::string& content, int64_t createdAt);
+
+    std::array<UserShard, kShardCount> userShards_;
+    std::array<EmailShard, kShardCount> emailShards_;
+    std::array<RelationShard, kShardCount> relationShards_;
+    std::array<PeerShard, kShardCount> peerShards_;
+    std::array<RoomShard, kShardCount> roomShards_;
+    std::array<JournalShard, kShardCount> journalShards_;
+    std::array<StatusShard, kShardCount> statusShards_;
+
+    std::mutex revokedMutex_;
+    std::vector<std::string> revoked_;
+
+    std::atomic<int> nextUserId_{ 1 };
+    std::atomic<int> nextRoomId_{ 1 };
+    std::atomic<int64_t> nextMessageId_{ 1 };
+};
+
+#endif //MEMORYSTORAGE_H
@@ -0,0 +1,41 @@
+#pragma once
+#include <functional>
+#include <string>
+#include <utility>
+
+#ifndef MESSAGEBUS_H
+#define MESSAGEBUS_H
+
+/*
+    The MessageBus class is the interface between the TcpServer instances of several nodes.
+    A node subscribes to the users it holds sockets for, and publishes the deliveries for users it does not hold;
+    the bus hands each delivery to the delivery handler of the node(s) subscribed to its recipient.
+    LocalMessageBus connects the servers of one process, PgMessageBus connects processes through Postgres NOTIFY.
+*/
+
+class MessageBus {
+public:
+    using DeliveryHandler = std::function<void(const std::string& email, const std::string& message)>;
+
+    virtual ~MessageBus() = default;
+
+    virtual void publish(const std::string& email, const std::string& message) = 0;
+    // Called under the server's client lock so they follow its socket count, they must not block nor deliver
+    virtual void subscribe(const std::string& email) = 0;
+    virtual void unsubscribe(const std::string& email) = 0;
+
+    // Called for every delivery received for a subscribed user, possibly on a bus thread
+    void setDeliveryHandler(DeliveryHandler handler) { deliveryHandler_ = std::move(handler); }
+
+protected:
+    void deliver(const std::string& email, const std::string& message) {
+        if (deliveryHandler_) {
+            deliveryHandler_(email, message);
+        }
+    }
+
+private:
+    DeliveryHandler deliveryHandler_;
+};
+
+#endif //MESSAGEBUS_H
@@ -0,0 +1,501 @@
+#include "MessageJournal.h"
+#include <algorithm>
+#include <array>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <iostream>
+#include <random>
+#include <stdexcept>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+/*
+    The MessageJournal class is a local write-ahead log for chat messages, drained into Postgres in the background.
+
+    Segment layout: a 16 byte header (magic, run id) followed by records aligned on 8 bytes.
+    Record layout: length, checksum, sequence, createdAt, roomId, senderId, then the content bytes. The checksum
+    (CRC-32) covers the header fields after it and the content, so a record torn by a crash is detected.
+*/
+
+namespace {
+    const char kSegmentMagic[8] = { 'C', 'H', 'J', 'R', 'N', 'L', '0', '1' };
+    const size_t kSegmentHeaderBytes = 16;
+
+    struct RecordHeader {
+        uint32_t length;
+        uint32_t checksum;
+        uint64_t sequence;
+        int64_t createdAt;
+        int32_t roomId;
+        int32_t senderId;
+    };
+
+    size_t recordBytes(size_t contentLength) {
+        return (sizeof(RecordHeader) + contentLength + 7) & ~size_t{ 7 };
+    }
+
+    uint32_t crc32(uint32_t crc, const void* data, size_t length) {
+        static const std::array<uint32_t, 256> table = []() {
+            std::array<uint32_t, 256> values{};
+            for (uint32_t i = 0; i < 256; ++i) {
+                uint32_t c = i;
+                for (int k = 0; k < 8; ++k) {
+                    c = (c & 1) ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+                }
+                values[i] = c;
+            }
+            return values;
+        }();
+        const auto* bytes = static_cast<const unsigned char*>(data);
+        crc = ~crc;
+        for (size_t i = 0; i < length; ++i) {
+            crc = table[(crc ^ bytes[i]) & 0xFF] ^ (crc >> 8);
+        }
+        return ~crc;
+    }
+
+    uint32_t recordChecksum(const RecordHeader& header, const char* content) {
+        const char* fields = reinterpret_cast<const char*>(&header) + offsetof(RecordHeader, sequence);
+        uint32_t crc = crc32(0, fields, sizeof(RecordHeader) - offsetof(RecordHeader, sequence));
+        return crc32(crc, content, header.length);
+    }
+
+    std::string segmentName(uint64_t firstSequence) {
+        char name[64];
+        std::snprintf(name, sizeof(name), "segment-%020llu.log", static_cast<unsigned long long>(firstSequence));
+        return name;
+    }
+
+    // Make a created or deleted segment file survive a crash, not only its content
+    void syncDirectory(const std::string& directory) {
+        int fd = ::open(directory.c_str(), O_RDONLY | O_DIRECTORY);
+        if (fd >= 0) {
+            ::fsync(fd);
+            ::close(fd);
+        }
+    }
+
+    int64_t nowMillis() {
+        return std::chrono::duration_cast<std::chrono::milliseconds>(
+            std::chrono::system_clock::now().time_since_epoch()).count();
+    }
+}
+
+MessageJournal::MessageJournal(const JournalOptions& options, DrainFunction drain)
+    : options_(options), drain_(std::move(drain)) {
+}
+
+MessageJournal::~MessageJournal() {
+    stop();
+    for (auto& segment : segments_) {
+        closeSegment(*segment, false);
+    }
+}
+
+void MessageJournal::start() {
+    std::random_device random;
+    runId_ = (static_cast<uint64_t>(random()) << 32) | random();
+    recover();
+    syncThread_ = std::thread([this]() { runSync(); });
+    drainThread_ = std::thread([this]() { runDrain(); });
+}
+
+void MessageJournal::stop() {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        stop_ = true;
+    }
+    syncCondition_.notify_all();
+    durableCondition_.notify_all();
+    drainCondition_.notify_all();
+    if (syncThread_.joinable()) {
+        syncThread_.join();
+    }
+    if (drainThread_.joinable()) {
+        drainThread_.join();
+    }
+}
+
+std::unique_ptr<MessageJournal::Segment> MessageJournal::createSegment(uint64_t firstSequence) {
+    auto segment = std::make_unique<Segment>();
+    segment->runId = runId_;
+    segment->firstSequence = firstSequence;
+    segment->path = (std::filesystem::path(options_.directory) / segmentName(firstSequence)).string();
+    segment->size = options_.segmentBytes;
+
+    segment->fd = ::open(segment->path.c_str(), O_RDWR | O_CREAT | O_EXCL, 0644);
+    if (segment->fd < 0) {
+        throw std::runtime_error("Failed to create journal segment " + segment->path + ": " + std::strerror(errno));
+    }
+    // Reserve the blocks up front. A sparse file would only fail when a store first touches an unbacked page of
+    // the mapping, with a SIGBUS once the disk is full, after the client was told the message is durable.
+    // Here the append fails instead and the message is refused
+    int error = ::posix_fallocate(segment->fd, 0, static_cast<off_t>(segment->size));
+    if (error != 0) {
+        closeSegment(*segment, true);
+        throw std::runtime_error("Failed to allocate journal segment " + segment->path + ": " + std::strerror(error));
+    }
+    void* data = ::mmap(nullptr, segment->size, PROT_READ | PROT_WRITE, MAP_SHARED, segment->fd, 0);
+    if (data == MAP_FAILED) {
+        error = errno;
+        closeSegment(*segment, true);
+        throw std::runtime_error("Failed to map journal segment " + segment->path + ": " + std::strerror(error));
+    }
+    segment->data = static_cast<char*>(data);
+    std::memcpy(segment->data, kSegmentMagic, sizeof(kSegmentMagic));
+    std::memcpy(segment->data + sizeof(kSegmentMagic), &segment->runId, sizeof(segment->runId));
+    // The header is flushed by the sync thread together with the first records
+    segment->used = kSegmentHeaderBytes;
+    syncDirectory(options_.directory);
+    return segment;
+}
+
+std::unique_ptr<MessageJournal::Segment> MessageJournal::openSegment(const std::string& path, uint64_t firstSequence) {
+    auto segment = std::make_unique<Segment>();
+    segment->firstSequence = firstSequence;
+    segment->path = path;
+    segment->size = static_cast<size_t>(std::filesystem::file_size(path));
+
+    segment->fd = ::open(path.c_str(), O_RDWR);
+    if (segment->fd < 0) {
+        throw std::runtime_error("Failed to open journal segment " + path + ": " + std::strerror(errno));
+    }
+    if (segment->size < kSegmentHeaderBytes) {
+        // A crash between creating and allocating the file, it cannot be mapped and holds nothing,
+        // recover() removes it like any segment without records
+        segment->used = 0;
+        return segment;
+    }
+    void* data = ::mmap(nullptr, segment->size, PROT_READ | PROT_WRITE, MAP_SHARED, segment->fd, 0);
+    if (data == MAP_FAILED) {
+        int error = errno;
+        ::close(segment->fd);
+        throw std::runtime_error("Failed to map journal segment " + path + ": " + std::strerror(error));
+    }
+    segment->data = static_cast<char*>(data);
+    if (std::memcmp(segment->data, kSegmentMagic, sizeof(kSegmentMagic)) != 0) {
+        // Created but never synced before a crash, nothing in it was acknowledged
+        segment->used = 0;
+        return segment;
+    }
+    std::memcpy(&segment->runId, segment->data + sizeof(kSegmentMagic), sizeof(segment->runId));
+    segment->used = kSegmentHeaderBytes;
+    return segment;
+}
+
+void MessageJournal::closeSegment(Segment& segment, bool remove) {
+    if (segment.data != nullptr) {
+        ::munmap(segment.data, segment.size);
+        segment.data = nullptr;
+    }
+    if (segment.fd >= 0) {
+        ::close(segment.fd);
+        segment.fd = -1;
+    }
+    if (remove) {
+        std::filesystem::remove(segment.path);
+        syncDirectory(options_.directory);
+    }
+}
+
+bool MessageJournal::readRecord(const Segment& segment, size_t offset, JournalEntry& entry, size_t& recordSize) const {
+    if (offset + sizeof(RecordHeader) > segment.size) {
+        return false;
+    }
+    RecordHeader header;
+    std::memcpy(&header, segment.data + offset, sizeof(header));
+    if (header.sequence == 0 || offset + recordBytes(header.length) > segment.size) {
+        return false;
+    }
+    const char* content = segment.data + offset + sizeof(RecordHeader);
+    if (recordChecksum(header, content) != header.checksum) {
+        return false;
+    }
+
+    char id[48];
+    std::snprintf(id, sizeof(id), "%016llx-%llu",
+        static_cast<unsigned long long>(segment.runId), static_cast<unsigned long long>(header.sequence));
+    entry.id = id;
+    entry.sequence = header.sequence;
+    entry.createdAt = header.createdAt;
+    entry.roomId = header.roomId;
+    entry.senderId = header.senderId;
+    entry.content.assign(content, header.length);
+    recordSize = recordBytes(header.length);
+    return true;
+}
+
+// Rebuild the log from the segments of the previous run. Each segment is read up to its first invalid record,
+// which is where a crash interrupted the writes; the remainder of the last segment is zeroed so a record written
+// out of order before the crash cannot reappear after the new records.
+void MessageJournal::recover() {
+    std::filesystem::create_directories(options_.directory);
+
+    std::vector<std::pair<uint64_t, std::string>> files;
+    for (const auto& file : std::filesystem::directory_iterator(options_.directory)) {
+        unsigned long long firstSequence = 0;
+        std::string name = file.path().filename().string();
+        if (std::sscanf(name.c_str(), "segment-%llu.log", &firstSequence) == 1) {
+            files.emplace_back(firstSequence, file.path().string());
+        }
+    }
+    std::sort(files.begin(), files.end());
+
+    uint64_t lastSequence = 0;
+    for (const auto& [firstSequence, path] : files) {
+        auto segment = openSegment(path, firstSequence);
+        size_t offset = segment->used;
+        JournalEntry entry;
+        size_t recordSize = 0;
+        uint64_t expected = firstSequence;
+        while (segment->used != 0 && readRecord(*segment, offset, entry, recordSize) && entry.sequence == expected) {
+            segment->lastSequence = entry.sequence;
+            offset += recordSize;
+            ++expected;
+            ++undrainedRooms_[entry.roomId];
+        }
+        segment->used = segment->lastSequence == 0 ? 0 : offset;
+        segment->synced = segment->used;
+
+        if (segment->lastSequence == 0) {
+            closeSegment(*segment, true);
+            continue;
+        }
+        lastSequence = std::max(lastSequence, segment->lastSequence);
+        segments_.push_back(std::move(segment));
+    }
+
+    if (!segments_.empty()) {
+        Segment& last = *segments_.back();
+        std::memset(last.data + last.used, 0, last.size - last.used);
+        ::msync(last.data, last.size, MS_SYNC);
+        std::cout << "Recovered " << segments_.size() << " journal segments up to entry " << lastSequence << "\n";
+    }
+    nextSequence_ = lastSequence + 1;
+    durable_ = lastSequence;
+    notified_ = lastSequence;
+    drained_ = 0;
+}
+
+JournalEntry MessageJournal::append(int roomId, int senderId, const std::string& content) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    JournalEntry entry = appendRecord(roomId, senderId, content);
+
+    // Acknowledged only once the sync thread flushed it
+    syncCondition_.notify_one();
+    durableCondition_.wait(lock, [this, &entry]() { return durable_ >= entry.sequence || stop_; });
+    if (durable_ < entry.sequence) {
+        throw std::runtime_error("Journal stopped before the message was durable");
+    }
+    return entry;
+}
+
+void MessageJournal::appendAsync(int roomId, int senderId, const std::string& content, DurableCallback done) {
+    try {
+        std::lock_guard<std::mutex> lock(mutex_);
+        JournalEntry entry = appendRecord(roomId, senderId, content);
+        uint64_t sequence = entry.sequence;
+        durableWaiters_.push_back(DurableWaiter{ sequence, std::move(entry), std::move(done) });
+    }
+    catch (...) {
+        done(std::current_exception(), JournalEntry{});
+        return;
+    }
+    syncCondition_.notify_one();
+}
+
+JournalEntry MessageJournal::appendRecord(int roomId, int senderId, const std::string& content) {
+    size_t recordSize = recordBytes(content.size());
+    if (kSegmentHeaderBytes + recordSize > options_.segmentBytes) {
+        throw std::runtime_error("Message too large for the journal");
+    }
+    if (stop_) {
+        throw std::runtime_error("Journal is stopped");
+    }
+    Segment* active = segments_.empty() ? nullptr : segments_.back().get();
+    if (active == nullptr || active->runId != runId_ || active->used + recordSize > active->size) {
+        segments_.push_back(createSegment(nextSequence_));
+        active = segments_.back().get();
+    }
+
+    RecordHeader header{};
+    header.length = static_cast<uint32_t>(content.size());
+    header.sequence = nextSequence_++;
+    header.createdAt = nowMillis();
+    header.roomId = roomId;
+    header.senderId = senderId;
+    header.checksum = recordChecksum(header, content.data());
+
+    char* record = active->data + active->used;
+    std::memcpy(record, &header, sizeof(header));
+    std::memcpy(record + sizeof(header), content.data(), content.size());
+    active->used += recordSize;
+    active->lastSequence = header.sequence;
+    ++undrainedRooms_[roomId];
+
+    JournalEntry entry;
+    size_t readSize = 0;
+    readRecord(*active, active->used - recordSize, entry, readSize);
+    return entry;
+}
+
+void MessageJournal::runSync() {
+    const size_t pageSize = static_cast<size_t>(::sysconf(_SC_PAGESIZE));
+    std::unique_lock<std::mutex> lock(mutex_);
+    for (;;) {
+        syncCondition_.wait(lock, [this]() { return stop_ || durable_ + 1 < nextSequence_; });
+        if (durable_ + 1 >= nextSequence_) {
+            // Stopping with nothing left to flush
+            return;
+        }
+
+        // Everything appended so far goes out in this flush, appends made meanwhile wait for the next one
+        uint64_t target = nextSequence_ - 1;
+        struct Range { Segment* segment; size_t from; size_t to; };
+        std::vector<Range> ranges;
+        for (auto& segment : segments_) {
+            if (segment->synced < segment->used) {
+                ranges.push_back({ segment.get(), segment->synced, segment->used });
+                segment->synced = segment->used;
+            }
+        }
+        lock.unlock();
+
+        bool flushed = true;
+        for (const auto& range : ranges) {
+            size_t start = range.from / pageSize * pageSize;
+            if (::msync(range.segment->data + start, range.to - start, MS_SYNC) != 0) {
+                std::cerr << "Failed to flush journal segment " << range.segment->path << ": " << std::strerror(errno) << "\n";
+                flushed = false;
+            }
+        }
+
+        lock.lock();
+        if (!flushed) {
+            // Retry the same ranges, the appenders keep waiting
+            for (const auto& range : ranges) {
+                range.segment->synced = std::min(range.segment->synced, range.from);
+            }
+            syncCondition_.wait_for(lock, std::chrono::milliseconds(100));
+            continue;
+        }
+        durable_ = target;
+        durableCondition_.notify_all();
+
+        // Complete the asynchronous appends covered by this flush, outside the lock, then let the drain have them
+        std::vector<DurableWaiter> ready;
+        while (!durableWaiters_.empty() && durableWaiters_.front().sequence <= durable_) {
+            ready.push_back(std::move(durableWaiters_.front()));
+            durableWaiters_.pop_front();
+        }
+        if (!ready.empty()) {
+            lock.unlock();
+            for (DurableWaiter& waiter : ready) {
+                waiter.done(nullptr, std::move(waiter.entry));
+            }
+            lock.lock();
+        }
+        notified_ = target;
+        drainCondition_.notify_one();
+    }
+}
+
+void MessageJournal::runDrain() {
+    auto backoff = std::chrono::milliseconds(100);
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (!stop_) {
+        drainCondition_.wait(lock, [this]() { return stop_ || drained_ < notified_; });
+        if (stop_) {
+            break;
+        }
+
+        // Collect the next durable entries in log order
+        uint64_t limit = notified_;
+        if (drainSegment_ == nullptr) {
+            drainSegment_ = segments_.front().get();
+            drainOffset_ = kSegmentHeaderBytes;
+        }
+        Segment* batchSegment = drainSegment_;
+        size_t batchOffset = drainOffset_;
+        std::vector<JournalEntry> batch;
+        while (batch.size() < options_.drainBatch) {
+            if (drainOffset_ >= drainSegment_->used) {
+                auto it = std::find_if(segments_.begin(), segments_.end(),
+                    [this](const std::unique_ptr<Segment>& segment) { return segment.get() == drainSegment_; });
+                if (it == segments_.end() || std::next(it) == segments_.end()) {
+                    break;
+                }
+                drainSegment_ = std::next(it)->get();
+                drainOffset_ = kSegmentHeaderBytes;
+                continue;
+            }
+            JournalEntry entry;
+            size_t recordSize = 0;
+            if (!readRecord(*drainSegment_, drainOffset_, entry, recordSize) || entry.sequence > limit) {
+                break;
+            }
+            drainOffset_ += recordSize;
+            batch.push_back(std::move(entry));
+        }
+        if (batch.empty()) {
+            drained_ = limit;
+            continue;
+        }
+
+        lock.unlock();
+        bool stored = false;
+        try {
+            stored = drain_(batch);
+        }
+        catch (const std::exception& e) {
+            std::cerr << "Failed to drain the journal: " << e.what() << "\n";
+        }
+        lock.lock();
+
+        if (!stored) {
+            // Retry the same batch, the database may be down for a while
+            drainFailures_.fetch_add(1, std::memory_order_relaxed);
+            drainSegment_ = batchSegment;
+            drainOffset_ = batchOffset;
+            drainCondition_.wait_for(lock, backoff, [this]() { return stop_; });
+            backoff = std::min(backoff * 2, std::chrono::milliseconds(5000));
+            continue;
+        }
+        backoff = std::chrono::milliseconds(100);
+        drained_ = batch.back().sequence;
+        for (const JournalEntry& entry : batch) {
+            auto undrained = undrainedRooms_.find(entry.roomId);
+            if (undrained != undrainedRooms_.end() && --undrained->second == 0) {
+                undrainedRooms_.erase(undrained);
+            }
+        }
+
+        // Delete the segments whose entries are all stored, the segment being appended to is kept
+        while (segments_.size() > 1 && segments_.front()->lastSequence <= drained_) {
+            if (drainSegment_ == segments_.front().get()) {
+                drainSegment_ = segments_[1].get();
+                drainOffset_ = kSegmentHeaderBytes;
+            }
+            closeSegment(*segments_.front(), true);
+            segments_.pop_front();
+        }
+    }
+}
+
+bool MessageJournal::hasUndrained(int roomId) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return undrainedRooms_.count(roomId) != 0;
+}
+
+JournalStats MessageJournal::stats() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    JournalStats snapshot;
+    snapshot.appended = nextSequence_ - 1;
+    snapshot.durable = durable_;
+    snapshot.drained = drained_;
+    snapshot.segments = segments_.size();
+    snapshot.drainFailures = drainFailures_.load(std::memory_order_relaxed);
+    return snapshot;
+}
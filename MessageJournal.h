@@ -0,0 +1,135 @@
+#pragma once
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+#include "Models.h"
+
+#ifndef MESSAGEJOURNAL_H
+#define MESSAGEJOURNAL_H
+
+/*
+    The MessageJournal class is a local write-ahead log for chat messages, so a message can be acknowledged and
+    delivered as soon as it is on local disk instead of after a Postgres commit.
+    Entries are appended to memory-mapped segment files of a fixed size. A sync thread msyncs everything appended
+    while its previous flush was running and then wakes the appenders of those entries (group commit), so under load
+    one flush covers many messages. A drain thread hands the durable entries, in order and in
+    batches, to the drain function (the insert into Postgres) and deletes a segment once all of it is stored.
+    The drain is retried until it succeeds and must be idempotent: after a crash the entries of the remaining
+    segments are drained again. At startup the segments are scanned, the first torn or corrupt record ends the log
+    and the rest of that segment is zeroed.
+    Segments are allocated on disk when they are created, so a full disk makes the append fail rather than a later
+    write into the mapping.
+*/
+
+struct JournalOptions {
+    std::string directory = "journal";
+    size_t segmentBytes = 64 * 1024 * 1024;
+    size_t drainBatch = 256;
+};
+
+struct JournalStats {
+    uint64_t appended = 0;
+    uint64_t durable = 0;
+    uint64_t drained = 0;
+    size_t segments = 0;
+    uint64_t drainFailures = 0;
+};
+
+class MessageJournal {
+public:
+    // Returns true once every entry is stored, false to retry the same batch later
+    using DrainFunction = std::function<bool(const std::vector<JournalEntry>&)>;
+
+    MessageJournal(const JournalOptions& options, DrainFunction drain);
+    ~MessageJournal();
+    MessageJournal(const MessageJournal&) = delete;
+    MessageJournal& operator=(const MessageJournal&) = delete;
+
+    // Recover the segments left by the previous run, then start the sync and drain threads
+    void start();
+    void stop();
+
+    // Append a message and wait until it is durable on local disk
+    JournalEntry append(int roomId, int senderId, const std::string& content);
+    // Append a message without waiting, done is called on the sync thread once it is durable (error empty)
+    // or could not be appended. It must return quickly, e.g. by posting the rest of the work elsewhere.
+    // The entry is only drained once done returned
+    using DurableCallback = std::function<void(std::exception_ptr error, JournalEntry entry)>;
+    void appendAsync(int roomId, int senderId, const std::string& content, DurableCallback done);
+    // True while an entry of the room is in the journal and not stored in Postgres yet, a read of the room from
+    // the database may then miss it
+    bool hasUndrained(int roomId);
+    JournalStats stats();
+
+private:
+    struct Segment {
+        // Random per process run, makes the entry ids unique across restarts
+        uint64_t runId = 0;
+        uint64_t firstSequence = 0;
+        uint64_t lastSequence = 0;
+        std::string path;
+        int fd = -1;
+        char* data = nullptr;
+        size_t size = 0;
+        size_t used = 0;
+        size_t synced = 0;
+    };
+
+    // An appendAsync waiting for its entry to be flushed
+    struct DurableWaiter {
+        uint64_t sequence = 0;
+        JournalEntry entry;
+        DurableCallback done;
+    };
+
+    void recover();
+    // Write the record at the end of the active segment, mutex_ held
+    JournalEntry appendRecord(int roomId, int senderId, const std::string& content);
+    std::unique_ptr<Segment> createSegment(uint64_t firstSequence);
+    std::unique_ptr<Segment> openSegment(const std::string& path, uint64_t firstSequence);
+    void closeSegment(Segment& segment, bool remove);
+    // Reads the record at offset, false at the end of the log or on a torn/corrupt record
+    bool readRecord(const Segment& segment, size_t offset, JournalEntry& entry, size_t& recordSize) const;
+    void runSync();
+    void runDrain();
+
+    JournalOptions options_;
+    DrainFunction drain_;
+    uint64_t runId_ = 0;
+
+    std::mutex mutex_;
+    std::condition_variable syncCondition_;
+    std::condition_variable durableCondition_;
+    std::condition_variable drainCondition_;
+    std::deque<std::unique_ptr<Segment>> segments_;
+    // In sequence order, completed by the sync thread
+    std::deque<DurableWaiter> durableWaiters_;
+    uint64_t nextSequence_ = 1;
+    uint64_t durable_ = 0;
+    // Durable entries whose appendAsync callbacks have run, the drain does not go past it
+    uint64_t notified_ = 0;
+    uint64_t drained_ = 0;
+    // Entries appended or recovered and not drained yet, per room
+    std::unordered_map<int, size_t> undrainedRooms_;
+    bool stop_ = false;
+
+    // Read position of the drainer, only touched by the drain thread
+    Segment* drainSegment_ = nullptr;
+    size_t drainOffset_ = 0;
+
+    std::atomic<uint64_t> drainFailures_{ 0 };
+    std::thread syncThread_;
+    std::thread drainThread_;
+};
+
+#endif //MESSAGEJOURNAL_H
@@ -0,0 +1,142 @@
+#pragma once
+#include <cstdint>
+#include <memory>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#ifndef MODELS_H
+#define MODELS_H
+
+/*
+    Typed rows returned by DatabaseManager.
+    Ids and timestamps are decoded once when the row is read, timestamps are milliseconds since the Unix epoch.
+    Single-row lookups return owning structs, bulk reads return a ResultView of *View rows whose text fields
+    borrow from the query result instead of being copied into their own strings.
+*/
+
+struct User {
+    int id = 0;
+    std::string name;
+    std::string email;
+    std::string profilePicture;
+    std::string status;
+    int64_t createdAt = 0;
+};
+
+struct Room {
+    int id = 0;
+    int userId1 = 0;
+    int userId2 = 0;
+    int64_t lastMessageAt = 0;
+    int64_t createdAt = 0;
+};
+
+struct Message {
+    int64_t id = 0;
+    int roomId = 0;
+    int senderId = 0;
+    std::string content;
+    bool isRead = false;
+    int64_t createdAt = 0;
+    // Id of the journal entry it was accepted as, empty when it was stored directly
+    std::string journalId;
+};
+
+// A row of relation_user, the friendship between two users and the room they talk in
+struct FriendEdge {
+    int userId1 = 0;
+    int userId2 = 0;
+    bool isAccepted = false;
+    int roomId = 0;
+};
+
+// A message stored by the send path, with both ends resolved for delivery
+struct SentMessage {
+    User sender;
+    std::optional<User> recipient;
+    Message message;
+};
+
+// A message accepted by the local journal and acknowledged, stored in messages later by the drainer.
+// id is unique across nodes and restarts, the insert is skipped when a row with the same id exists
+struct JournalEntry {
+    std::string id;
+    uint64_t sequence = 0;
+    int64_t createdAt = 0;
+    int roomId = 0;
+    int senderId = 0;
+    std::string content;
+};
+
+// Position of a message in search results (newest first), a page starts after it
+struct MessageSearchCursor {
+    int64_t createdAtMicros = 0;
+    int64_t messageId = 0;
+};
+
+// A row of cluster_nodes (or a line of the cluster file), a server process and the address clients reach it at
+struct ClusterNode {
+    std::string id;
+    std::string address;
+};
+
+// Borrowed counterparts of User and Message, valid as long as the ResultView holding them
+struct UserView {
+    int id = 0;
+    std::string_view name;
+    std::string_view email;
+    std::string_view profilePicture;
+    std::string_view status;
+    int64_t createdAt = 0;
+
+    User toUser() const {
+        return User{ id, std::string(name), std::string(email), std::string(profilePicture), std::string(status), createdAt };
+    }
+};
+
+struct MessageView {
+    int64_t id = 0;
+    int roomId = 0;
+    int senderId = 0;
+    std::string_view content;
+    bool isRead = false;
+    int64_t createdAt = 0;
+    std::string_view journalId;
+
+    Message toMessage() const {
+        return Message{ id, roomId, senderId, std::string(content), isRead, createdAt, std::string(journalId) };
+    }
+};
+
+/*
+    The rows of a bulk read. The rows point into a buffer owned by the view (for Postgres the pqxx::result),
+    which is kept alive by a shared handle, so the result can be returned and iterated after the
+    connection went back to the pool without copying any field.
+*/
+template <typename Row>
+class ResultView {
+public:
+    ResultView() = default;
+    ResultView(std::shared_ptr<const void> owner, std::vector<Row> rows)
+        : owner_(std::move(owner)), rows_(std::move(rows)) {}
+
+    typename std::vector<Row>::const_iterator begin() const { return rows_.begin(); }
+    typename std::vector<Row>::const_iterator end() const { return rows_.end(); }
+    const Row& operator[](size_t index) const { return rows_[index]; }
+    size_t size() const { return rows_.size(); }
+    bool empty() const { return rows_.empty(); }
+
+private:
+    std::shared_ptr<const void> owner_;
+    std::vector<Row> rows_;
+};
+
+// A page of search results, next is empty on the last page
+struct MessageSearchPage {
+    ResultView<MessageView> messages;
+    std::optional<MessageSearchCursor> next;
+};
+
+#endif //MODELS_H
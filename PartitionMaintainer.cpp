@@ -0,0 +1,59 @@
+#include "PartitionMaintainer.h"
+#include "DatabaseManager.h"
+#include <iostream>
+
+/*
+    The PartitionMaintainer class creates the future monthly partitions of messages and detaches the expired ones.
+*/
+
+PartitionMaintainer::PartitionMaintainer(const PartitionMaintainerOptions& options)
+    : options_(options) {
+}
+
+PartitionMaintainer::~PartitionMaintainer() {
+    stop();
+}
+
+void PartitionMaintainer::start() {
+    stop_ = false;
+    thread_ = std::thread([this]() { run(); });
+}
+
+void PartitionMaintainer::stop() {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        stop_ = true;
+    }
+    condition_.notify_one();
+    if (thread_.joinable()) {
+        thread_.join();
+    }
+}
+
+void PartitionMaintainer::run() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (!stop_) {
+        lock.unlock();
+        maintain();
+        lock.lock();
+        condition_.wait_for(lock, options_.checkInterval, [this]() { return stop_; });
+    }
+}
+
+void PartitionMaintainer::maintain() {
+    try {
+        DatabaseManager& dbManager = DatabaseManager::getInstance();
+        if (!dbManager.ensureMessagePartitions(options_.monthsAhead)) {
+            return;
+        }
+        if (options_.retainMonths > 0) {
+            for (const auto& partition : dbManager.detachMessagePartitions(options_.retainMonths)) {
+                std::cout << "Detached message partition " << partition << "\n";
+            }
+        }
+    }
+    catch (const std::exception& e) {
+        // Retried at the next check, the partitions are created months ahead
+        std::cerr << "Message partition maintenance failed: " << e.what() << "\n";
+    }
+}
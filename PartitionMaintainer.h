@@ -0,0 +1,45 @@
+#pragma once
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+
+#ifndef PARTITIONMAINTAINER_H
+#define PARTITIONMAINTAINER_H
+
+/*
+    The PartitionMaintainer class keeps the monthly partitions of the messages table ahead of time on a background
+    thread: every checkInterval it creates the partitions up to monthsAhead months from now, so an insert never
+    lands on a month without a partition, and, when retainMonths is set, detaches the months older than that.
+    It does nothing until messages has been partitioned by migrations/040_partition_messages.sql.
+*/
+
+struct PartitionMaintainerOptions {
+    int monthsAhead = 3;
+    // 0 keeps every partition attached
+    int retainMonths = 0;
+    std::chrono::minutes checkInterval{ 360 };
+};
+
+class PartitionMaintainer {
+public:
+    explicit PartitionMaintainer(const PartitionMaintainerOptions& options);
+    ~PartitionMaintainer();
+    PartitionMaintainer(const PartitionMaintainer&) = delete;
+    PartitionMaintainer& operator=(const PartitionMaintainer&) = delete;
+
+    void start();
+    void stop();
+
+private:
+    void run();
+    void maintain();
+
+    PartitionMaintainerOptions options_;
+    std::mutex mutex_;
+    std::condition_variable condition_;
+    std::thread thread_;
+    bool stop_ = false;
+};
+
+#endif //PARTITIONMAINTAINER_H
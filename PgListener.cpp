@@ -0,0 +1,106 @@
+#include "PgListener.h"
+#include <algorithm>
+#include <chrono>
+#include <iostream>
+#include <vector>
+
+/*
+    The PgListener class dispatches Postgres NOTIFY payloads to in-process handlers on a background thread.
+*/
+
+PgListener::PgListener(std::string conninfo)
+    : conninfo_(std::move(conninfo)) {
+}
+
+PgListener::~PgListener() {
+    stop();
+}
+
+void PgListener::subscribe(const std::string& channel, Handler handler) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    subscriptions_[channel] = std::move(handler);
+    changed_ = true;
+}
+
+void PgListener::unsubscribe(const std::string& channel) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    subscriptions_.erase(channel);
+    changed_ = true;
+}
+
+void PgListener::onConnected(std::function<void()> handler) {
+    onConnected_ = std::move(handler);
+}
+
+void PgListener::start() {
+    stop_ = false;
+    thread_ = std::thread([this]() { run(); });
+}
+
+void PgListener::stop() {
+    stop_ = true;
+    if (thread_.joinable()) {
+        thread_.join();
+    }
+}
+
+PgListener::Receiver::Receiver(pqxx::connection& conn, const std::string& channel, Handler handler)
+    : pqxx::notification_receiver(conn, channel), handler_(std::move(handler)) {
+}
+
+void PgListener::Receiver::operator()(const std::string& payload, int backendPid) {
+    // A throwing handler must not take the listener connection down with it
+    try {
+        handler_(payload);
+    }
+    catch (const std::exception& e) {
+        std::cerr << "Notification handler failed on " << channel() << ": " << e.what() << "\n";
+    }
+}
+
+void PgListener::syncReceivers(pqxx::connection& conn, Receivers& receivers) {
+    std::map<std::string, Handler> subscriptions;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        changed_ = false;
+        subscriptions = subscriptions_;
+    }
+
+    // A receiver issues UNLISTEN when it is destroyed and LISTEN when it is constructed
+    for (auto it = receivers.begin(); it != receivers.end();) {
+        it = subscriptions.count(it->first) == 0 ? receivers.erase(it) : std::next(it);
+    }
+    for (auto& [channel, handler] : subscriptions) {
+        if (receivers.count(channel) == 0) {
+            receivers.emplace(channel, std::make_unique<Receiver>(conn, channel, std::move(handler)));
+        }
+    }
+}
+
+void PgListener::run() {
+    auto backoff = std::chrono::milliseconds(100);
+    while (!stop_) {
+        try {
+            pqxx::connection conn(conninfo_);
+            Receivers receivers;
+            syncReceivers(conn, receivers);
+            if (onConnected_) {
+                onConnected_();
+            }
+            backoff = std::chrono::milliseconds(100);
+
+            // Wake up every 100ms to apply subscription changes and notice stop()
+            while (!stop_) {
+                if (changed_) {
+                    syncReceivers(conn, receivers);
+                }
+                conn.await_notification(0, 100000);
+            }
+        }
+        catch (const std::exception& e) {
+            std::cerr << "Notification listener disconnected: " << e.what() << "\n";
+            std::this_thread::sleep_for(backoff);
+            backoff = std::min(backoff * 2, std::chrono::milliseconds(5000));
+        }
+    }
+}
@@ -0,0 +1,63 @@
+#pragma once
+#include <pqxx/pqxx>
+#include <atomic>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+
+#ifndef PGLISTENER_H
+#define PGLISTENER_H
+
+/*
+    The PgListener class owns one dedicated Postgres connection (outside the connection pool) that LISTENs on a set
+    of channels and dispatches every NOTIFY payload to the handler registered for its channel, on a background thread.
+    Channels can be added and removed at any time, the listener thread applies the change between two waits.
+    The connection is reopened with backoff when it drops; notifications sent while it was down are lost,
+    so the connected handler is called after every (re)connect to let subscribers resynchronise.
+*/
+
+class PgListener {
+public:
+    using Handler = std::function<void(const std::string& payload)>;
+
+    explicit PgListener(std::string conninfo);
+    ~PgListener();
+    PgListener(const PgListener&) = delete;
+    PgListener& operator=(const PgListener&) = delete;
+
+    void subscribe(const std::string& channel, Handler handler);
+    void unsubscribe(const std::string& channel);
+    // Must be set before start()
+    void onConnected(std::function<void()> handler);
+
+    void start();
+    void stop();
+
+private:
+    class Receiver : public pqxx::notification_receiver {
+    public:
+        Receiver(pqxx::connection& conn, const std::string& channel, Handler handler);
+        void operator()(const std::string& payload, int backendPid) override;
+
+    private:
+        Handler handler_;
+    };
+
+    using Receivers = std::map<std::string, std::unique_ptr<Receiver>>;
+
+    void run();
+    // LISTEN on the new channels and UNLISTEN the removed ones
+    void syncReceivers(pqxx::connection& conn, Receivers& receivers);
+
+    std::string conninfo_;
+    std::mutex mutex_;
+    std::map<std::string, Handler> subscriptions_;
+    std::atomic<bool> changed_{ false };
+    std::function<void()> onConnected_;
+    std::thread thread_;
+    std::atomic<bool> stop_{ false };
+};
+
+#endif //PGLISTENER_H
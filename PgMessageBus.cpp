@@ -0,0 +1,125 @@
+#include "PgMessageBus.h"
+#include "DatabaseManager.h"
+#include "HashRing.h"
+#include <algorithm>
+#include <functional>
+#include <iostream>
+#include <nlohmann/json.hpp>
+
+/*
+    The PgMessageBus class connects server processes through Postgres LISTEN/NOTIFY, with batched publishing.
+*/
+
+using json = nlohmann::json;
+
+namespace {
+    // Postgres rejects NOTIFY payloads of 8000 bytes or more, keep some room for the array brackets
+    const size_t kMaxPayloadBytes = 7900;
+}
+
+PgMessageBus::PgMessageBus(const std::string& conninfo, const PgMessageBusOptions& options)
+    : options_(options), listener_(conninfo) {
+    options_.buckets = std::max<size_t>(1, options_.buckets);
+    listener_.start();
+    flusher_ = std::thread([this]() { runFlusher(); });
+}
+
+PgMessageBus::~PgMessageBus() {
+    {
+        std::lock_guard<std::mutex> lock(pendingMutex_);
+        stop_ = true;
+    }
+    pendingCondition_.notify_one();
+    flusher_.join();
+    listener_.stop();
+}
+
+std::string PgMessageBus::channelFor(const std::string& email) const {
+    // Every node must pick the same bucket for a user, std::hash may differ between builds
+    return "chat_bucket_" + std::to_string(HashRing::hashLabel(email) % options_.buckets);
+}
+
+void PgMessageBus::publish(const std::string& email, const std::string& message) {
+    std::lock_guard<std::mutex> lock(pendingMutex_);
+    pending_[channelFor(email)].emplace_back(email, message);
+}
+
+void PgMessageBus::subscribe(const std::string& email) {
+    std::string channel = channelFor(email);
+    std::lock_guard<std::mutex> lock(subscriptionsMutex_);
+    if (++channelUsers_[channel] == 1) {
+        listener_.subscribe(channel, [this](const std::string& payload) { onNotification(payload); });
+    }
+}
+
+void PgMessageBus::unsubscribe(const std::string& email) {
+    std::string channel = channelFor(email);
+    std::lock_guard<std::mutex> lock(subscriptionsMutex_);
+    auto it = channelUsers_.find(channel);
+    if (it == channelUsers_.end()) {
+        return;
+    }
+    if (--it->second == 0) {
+        channelUsers_.erase(it);
+        listener_.unsubscribe(channel);
+    }
+}
+
+// A bucket carries the deliveries of every user hashed into it,
+// the delivery handler ignores the recipients this node holds no socket for
+void PgMessageBus::onNotification(const std::string& payload) {
+    json batch = json::parse(payload);
+    for (const auto& entry : batch) {
+        deliver(entry["to"].get<std::string>(), entry["message"].get<std::string>());
+    }
+}
+
+void PgMessageBus::runFlusher() {
+    std::unique_lock<std::mutex> lock(pendingMutex_);
+    while (!stop_) {
+        pendingCondition_.wait_for(lock, options_.flushInterval, [this]() { return stop_; });
+        if (pending_.empty()) {
+            continue;
+        }
+        std::unordered_map<std::string, std::vector<std::pair<std::string, std::string>>> pending;
+        pending.swap(pending_);
+        // Publishers keep queueing into the fresh map while this batch is sent
+        lock.unlock();
+        flush(pending);
+        lock.lock();
+    }
+}
+
+void PgMessageBus::flush(std::unordered_map<std::string, std::vector<std::pair<std::string, std::string>>>& pending) {
+    std::vector<std::pair<std::string, std::string>> notifications;
+    for (auto& [channel, deliveries] : pending) {
+        std::string payload = "[";
+        for (auto& [email, message] : deliveries) {
+            std::string entry = json{ { "to", email }, { "message", message } }.dump();
+            if (entry.size() + 2 > kMaxPayloadBytes) {
+                std::cerr << "Dropping a delivery too large for NOTIFY (" << entry.size() << " bytes) to " << email << "\n";
+                continue;
+            }
+            if (payload.size() + entry.size() + 1 > kMaxPayloadBytes) {
+                payload += "]";
+                notifications.emplace_back(channel, std::move(payload));
+                payload = "[";
+            }
+            if (payload.size() > 1) {
+                payload += ",";
+            }
+            payload += entry;
+        }
+        if (payload.size() > 1) {
+            payload += "]";
+            notifications.emplace_back(channel, std::move(payload));
+        }
+    }
+
+    try {
+        DatabaseManager::getInstance().notify(notifications);
+    }
+    catch (const std::exception& e) {
+        std::cerr << "Failed to publish " << notifications.size() << " notifications: " << e.what() << "\n";
+    }
+}
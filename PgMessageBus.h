@@ -0,0 +1,63 @@
+#pragma once
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+#include "MessageBus.h"
+#include "PgListener.h"
+
+#ifndef PGMESSAGEBUS_H
+#define PGMESSAGEBUS_H
+
+/*
+    The PgMessageBus class connects server processes through Postgres LISTEN/NOTIFY.
+    Users are hashed into a fixed number of bucket channels (chat_bucket_<n>); a node LISTENs only on the buckets of
+    the users it holds, so it never sees the traffic of buckets it has no user in. Published deliveries are queued
+    per bucket and flushed every flushInterval as JSON arrays of {"to", "message"}, packed up to the NOTIFY payload
+    limit, and all the channels of a flush go out in one pipelined round trip.
+    NOTIFY is fire and forget: a delivery to a node that is reconnecting is lost, the message itself is in the database.
+*/
+
+struct PgMessageBusOptions {
+    size_t buckets = 1024;
+    std::chrono::milliseconds flushInterval{ 5 };
+};
+
+class PgMessageBus : public MessageBus {
+public:
+    PgMessageBus(const std::string& conninfo, const PgMessageBusOptions& options);
+    ~PgMessageBus() override;
+    PgMessageBus(const PgMessageBus&) = delete;
+    PgMessageBus& operator=(const PgMessageBus&) = delete;
+
+    void publish(const std::string& email, const std::string& message) override;
+    void subscribe(const std::string& email) override;
+    void unsubscribe(const std::string& email) override;
+
+private:
+    std::string channelFor(const std::string& email) const;
+    void onNotification(const std::string& payload);
+    void runFlusher();
+    void flush(std::unordered_map<std::string, std::vector<std::pair<std::string, std::string>>>& pending);
+
+    PgMessageBusOptions options_;
+    PgListener listener_;
+
+    // Users held per bucket channel, the channel is listened to while the count is positive
+    std::mutex subscriptionsMutex_;
+    std::unordered_map<std::string, size_t> channelUsers_;
+
+    // Deliveries waiting for the next flush, by channel
+    std::mutex pendingMutex_;
+    std::condition_variable pendingCondition_;
+    std::unordered_map<std::string, std::vector<std::pair<std::string, std::string>>> pending_;
+    std::thread flusher_;
+    bool stop_ = false;
+};
+
+#endif //PGMESSAGEBUS_H
@@ -0,0 +1,218 @@
+#include "RecentMessageCache.h"
+#include "Utils.h"
+#include <algorithm>
+
+/*
+    The RecentMessageCache class is a singleton of per-room buffers of the newest messages, see RecentMessageCache.h.
+*/
+
+std::unique_ptr<RecentMessageCache> RecentMessageCache::instance_ = nullptr;
+std::once_flag RecentMessageCache::initInstanceFlag;
+
+namespace {
+    // Rough per-room cost of the map node, the LRU node and the deque blocks
+    const size_t kRoomOverheadBytes = 256;
+}
+
+RecentMessageCache& RecentMessageCache::getInstance() {
+    std::call_once(initInstanceFlag, []() {
+        instance_ = std::unique_ptr<RecentMessageCache>(new RecentMessageCache());
+    });
+    return *instance_;
+}
+
+RecentMessageCache::RecentMessageCache()
+    : messagesPerRoom_(std::max<size_t>(1, Utils::getEnvSize("CHAT_RECENT_MESSAGES_PER_ROOM", 100))),
+      budgetPerShard_(Utils::getEnvSize("CHAT_RECENT_MESSAGES_BYTES", 64 * 1024 * 1024) / kShardCount) {
+}
+
+size_t RecentMessageCache::messageBytes(const Message& message) {
+    return sizeof(Message) + message.content.capacity() + message.journalId.capacity();
+}
+
+RecentMessageCache::Shard& RecentMessageCache::shardFor(int roomId) {
+    return shards_[static_cast<uint32_t>(roomId) % kShardCount];
+}
+
+std::optional<ResultView<MessageView>> RecentMessageCache::find(int roomId, int64_t fromMs, int64_t toMs, size_t limit) {
+    if (!enabled_.load(std::memory_order_relaxed)) {
+        return std::nullopt;
+    }
+    auto owner = std::make_shared<std::vector<Message>>();
+    {
+        Shard& shard = shardFor(roomId);
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        auto it = shard.rooms.find(roomId);
+        if (it == shard.rooms.end()) {
+            misses_.fetch_add(1, std::memory_order_relaxed);
+            return std::nullopt;
+        }
+        RoomBuffer& buffer = it->second;
+
+        // Only the part of the buffer known to be complete can answer
+        int64_t first = std::max(fromMs, buffer.completeFrom);
+        auto byTime = [](const Message& message, int64_t time) { return message.createdAt < time; };
+        auto begin = std::lower_bound(buffer.messages.begin(), buffer.messages.end(), first, byTime);
+        auto end = std::lower_bound(begin, buffer.messages.end(), toMs, byTime);
+        size_t count = static_cast<size_t>(std::distance(begin, end));
+
+        // Complete when the window starts inside the buffer, or when the newest `limit` of the window are all in it
+        if (fromMs < buffer.completeFrom && (limit == 0 || count < limit)) {
+            misses_.fetch_add(1, std::memory_order_relaxed);
+            return std::nullopt;
+        }
+        if (limit != 0 && count > limit) {
+            begin = std::prev(end, static_cast<std::ptrdiff_t>(limit));
+        }
+        owner->assign(begin, end);
+        shard.lru.splice(shard.lru.begin(), shard.lru, buffer.lru);
+    }
+    hits_.fetch_add(1, std::memory_order_relaxed);
+
+    std::vector<MessageView> rows;
+    rows.reserve(owner->size());
+    for (const Message& message : *owner) {
+        rows.push_back(MessageView{ message.id, message.roomId, message.senderId, message.content,
+            message.isRead, message.createdAt, message.journalId });
+    }
+    return ResultView<MessageView>(owner, std::move(rows));
+}
+
+uint64_t RecentMessageCache::loadToken(int roomId) {
+    Shard& shard = shardFor(roomId);
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    return shard.appends;
+}
+
+void RecentMessageCache::fill(int roomId, int64_t fromMs, const std::vector<Message>& messages, uint64_t token) {
+    if (!enabled_.load(std::memory_order_relaxed) || budgetPerShard_ == 0) {
+        return;
+    }
+    Shard& shard = shardFor(roomId);
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    if (shard.appends != token || shard.rooms.count(roomId) != 0) {
+        return;
+    }
+
+    RoomBuffer& buffer = shard.rooms[roomId];
+    shard.lru.push_front(roomId);
+    buffer.lru = shard.lru.begin();
+    buffer.completeFrom = fromMs;
+    buffer.bytes = kRoomOverheadBytes;
+    size_t skip = messages.size() > messagesPerRoom_ ? messages.size() - messagesPerRoom_ : 0;
+    if (skip > 0) {
+        // Older messages were left out, the buffer is complete from just after the newest of them
+        buffer.completeFrom = messages[skip - 1].createdAt + 1;
+    }
+    for (size_t i = skip; i < messages.size(); ++i) {
+        buffer.messages.push_back(messages[i]);
+        buffer.bytes += messageBytes(messages[i]);
+    }
+    shard.bytes += buffer.bytes;
+    evict(shard, roomId);
+}
+
+void RecentMessageCache::append(const Message& message) {
+    Shard& shard = shardFor(message.roomId);
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    ++shard.appends;
+    auto it = shard.rooms.find(message.roomId);
+    if (it == shard.rooms.end()) {
+        return;
+    }
+    RoomBuffer& buffer = it->second;
+    size_t before = buffer.bytes;
+    insertSorted(buffer, message);
+    trim(buffer);
+    shard.bytes = shard.bytes - before + buffer.bytes;
+    shard.lru.splice(shard.lru.begin(), shard.lru, buffer.lru);
+    evict(shard, message.roomId);
+}
+
+void RecentMessageCache::resolveJournaled(const Message& stored) {
+    Shard& shard = shardFor(stored.roomId);
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    auto it = shard.rooms.find(stored.roomId);
+    if (it == shard.rooms.end()) {
+        return;
+    }
+    RoomBuffer& buffer = it->second;
+    auto byTime = [](const Message& message, int64_t time) { return message.createdAt < time; };
+    for (auto message = std::lower_bound(buffer.messages.begin(), buffer.messages.end(), stored.createdAt, byTime);
+         message != buffer.messages.end() && message->createdAt == stored.createdAt; ++message) {
+        if (message->journalId == stored.journalId) {
+            message->id = stored.id;
+            return;
+        }
+    }
+}
+
+// Send times come from different clocks (database, journal), keep the buffer ordered anyway
+void RecentMessageCache::insertSorted(RoomBuffer& buffer, const Message& message) {
+    auto position = std::upper_bound(buffer.messages.begin(), buffer.messages.end(), message.createdAt,
+        [](int64_t time, const Message& stored) { return time < stored.createdAt; });
+    buffer.messages.insert(position, message);
+    buffer.bytes += messageBytes(message);
+}
+
+// Drop the oldest messages beyond the per-room bound, the buffer is then complete from after them
+void RecentMessageCache::trim(RoomBuffer& buffer) {
+    while (buffer.messages.size() > messagesPerRoom_) {
+        const Message& oldest = buffer.messages.front();
+        buffer.completeFrom = std::max(buffer.completeFrom, oldest.createdAt + 1);
+        buffer.bytes -= messageBytes(oldest);
+        buffer.messages.pop_front();
+    }
+}
+
+// Evict the least recently used rooms while the shard is over budget, never the room just touched
+void RecentMessageCache::evict(Shard& shard, int keepRoomId) {
+    while (shard.bytes > budgetPerShard_ && !shard.lru.empty()) {
+        int roomId = shard.lru.back();
+        if (roomId == keepRoomId && shard.lru.size() == 1) {
+            break;
+        }
+        if (roomId == keepRoomId) {
+            shard.lru.splice(shard.lru.begin(), shard.lru, std::prev(shard.lru.end()));
+            continue;
+        }
+        auto it = shard.rooms.find(roomId);
+        shard.bytes -= it->second.bytes;
+        shard.rooms.erase(it);
+        shard.lru.pop_back();
+        evictions_.fetch_add(1, std::memory_order_relaxed);
+    }
+}
+
+void RecentMessageCache::erase(int roomId) {
+    Shard& shard = shardFor(roomId);
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    ++shard.appends;
+    auto it = shard.rooms.find(roomId);
+    if (it != shard.rooms.end()) {
+        shard.bytes -= it->second.bytes;
+        shard.lru.erase(it->second.lru);
+        shard.rooms.erase(it);
+    }
+}
+
+void RecentMessageCache::setEnabled(bool enabled) {
+    enabled_.store(enabled, std::memory_order_relaxed);
+}
+
+RecentMessageCacheStats RecentMessageCache::stats() {
+    RecentMessageCacheStats snapshot;
+    for (auto& shard : shards_) {
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        snapshot.rooms += shard.rooms.size();
+        snapshot.bytes += shard.bytes;
+        for (const auto& [roomId, buffer] : shard.rooms) {
+            snapshot.messages += buffer.messages.size();
+        }
+    }
+    snapshot.budgetBytes = budgetPerShard_ * kShardCount;
+    snapshot.hits = hits_.load(std::memory_order_relaxed);
+    snapshot.misses = misses_.load(std::memory_order_relaxed);
+    snapshot.evictions = evictions_.load(std::memory_order_relaxed);
+    return snapshot;
+}
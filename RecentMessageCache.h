@@ -0,0 +1,104 @@
+#pragma once
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <deque>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <unordered_map>
+#include "Models.h"
+
+#ifndef RECENTMESSAGECACHE_H
+#define RECENTMESSAGECACHE_H
+
+/*
+    The RecentMessageCache class is a singleton holding the last messages of the rooms active right now, so opening
+    a conversation (the latest page) or catching up after a reconnect (everything since a time) is served from memory.
+    Each room keeps a bounded, time-ordered buffer of its newest CHAT_RECENT_MESSAGES_PER_ROOM messages and the time
+    from which that buffer is complete; a read reaching further back falls through to the database.
+    A room is loaded by the first latest-page read that misses and then kept up to date by the send path.
+    Rooms are evicted least recently used first once the memory budget (CHAT_RECENT_MESSAGES_BYTES, split evenly
+    between the shards) is used up. Messages accepted by the journal carry their journal id, their id is 0 until the
+    drain stored them and resolveJournaled filled it in.
+*/
+
+struct RecentMessageCacheStats {
+    size_t rooms = 0;
+    size_t messages = 0;
+    size_t bytes = 0;
+    size_t budgetBytes = 0;
+    uint64_t hits = 0;
+    uint64_t misses = 0;
+    uint64_t evictions = 0;
+};
+
+class RecentMessageCache {
+public:
+    static RecentMessageCache& getInstance();
+
+    // Messages of the room created in [fromMs, toMs), only the newest `limit` when limit is not 0.
+    // nullopt when the buffer does not hold all of them
+    std::optional<ResultView<MessageView>> find(int roomId, int64_t fromMs, int64_t toMs, size_t limit);
+    // Taken before the database read whose result is passed to fill
+    uint64_t loadToken(int roomId);
+    // Install the room from the messages created since fromMs (ordered by time), read from the database.
+    // Skipped when a message was appended to the shard since loadToken, the read may have missed it.
+    // The caller must not fill a room with journaled messages not stored yet, the read misses them too
+    void fill(int roomId, int64_t fromMs, const std::vector<Message>& messages, uint64_t token);
+    // A message just sent, added when the room is cached
+    void append(const Message& message);
+    // A journaled message got its id when the journal was drained, the journal appends it here before that
+    void resolveJournaled(const Message& stored);
+    void erase(int roomId);
+    // Off unless the node is alone (no ring, local bus): a room whose users are served elsewhere does not go
+    // through this node's send path
+    void setEnabled(bool enabled);
+    RecentMessageCacheStats stats();
+
+    ~RecentMessageCache() = default;
+
+private:
+    RecentMessageCache();
+    RecentMessageCache(const RecentMessageCache&) = delete;
+    RecentMessageCache& operator=(const RecentMessageCache&) = delete;
+
+    struct RoomBuffer {
+        std::deque<Message> messages;
+        // Every message of the room created at or after this time is in messages
+        int64_t completeFrom = 0;
+        size_t bytes = 0;
+        std::list<int>::iterator lru;
+    };
+
+    struct Shard {
+        std::mutex mutex;
+        std::unordered_map<int, RoomBuffer> rooms;
+        // Most recently used first
+        std::list<int> lru;
+        size_t bytes = 0;
+        uint64_t appends = 0;
+    };
+
+    static constexpr size_t kShardCount = 64;
+
+    static size_t messageBytes(const Message& message);
+    Shard& shardFor(int roomId);
+    void insertSorted(RoomBuffer& buffer, const Message& message);
+    void trim(RoomBuffer& buffer);
+    void evict(Shard& shard, int keepRoomId);
+
+    std::array<Shard, kShardCount> shards_;
+    size_t messagesPerRoom_;
+    size_t budgetPerShard_;
+    std::atomic<bool> enabled_{ true };
+    std::atomic<uint64_t> hits_{ 0 };
+    std::atomic<uint64_t> misses_{ 0 };
+    std::atomic<uint64_t> evictions_{ 0 };
+
+    static std::unique_ptr<RecentMessageCache> instance_;
+    static std::once_flag initInstanceFlag;
+};
+
+#endif //RECENTMESSAGECACHE_H
@@ -0,0 +1,162 @@
+#include "RequestParser.h"
+#include <charconv>
+#include <simdjson.h>
+
+/*
+    The RequestParser class turns inbound REST bodies and TCP frames into typed request structs
+    with the simdjson On-Demand API.
+*/
+
+using namespace simdjson;
+
+namespace {
+    // A parser keeps its internal buffers between documents, one per thread avoids reallocating them
+    ondemand::parser& threadParser() {
+        thread_local ondemand::parser parser;
+        return parser;
+    }
+
+    // simdjson reads up to SIMDJSON_PADDING bytes past the end of the input,
+    // inputs that do not guarantee it are copied into a reusable per-thread buffer
+    padded_string_view padInput(std::string_view input) {
+        thread_local std::string buffer;
+        buffer.reserve(input.size() + SIMDJSON_PADDING);
+        buffer.assign(input.data(), input.size());
+        return padded_string_view(buffer.data(), buffer.size(), buffer.capacity());
+    }
+
+    bool readString(ondemand::value value, std::string& out) {
+        std::string_view text;
+        if (value.get_string().get(text) != SUCCESS) {
+            return false;
+        }
+        out.assign(text.data(), text.size());
+        return true;
+    }
+
+    // Ids arrive either as numbers or as numeric strings
+    template <typename T>
+    bool readId(ondemand::value value, T& out) {
+        ondemand::json_type type;
+        if (value.type().get(type) != SUCCESS) {
+            return false;
+        }
+        if (type == ondemand::json_type::number) {
+            int64_t number;
+            if (value.get_int64().get(number) != SUCCESS) {
+                return false;
+            }
+            out = static_cast<T>(number);
+            return true;
+        }
+        if (type == ondemand::json_type::string) {
+            std::string_view text;
+            if (value.get_string().get(text) != SUCCESS) {
+                return false;
+            }
+            auto [ptr, ec] = std::from_chars(text.data(), text.data() + text.size(), out);
+            return ec == std::errc() && ptr == text.data() + text.size();
+        }
+        return false;
+    }
+
+    FrameType frameTypeFromString(std::string_view type) {
+        if (type == "connect") return FrameType::Connect;
+        if (type == "disconnect") return FrameType::Disconnect;
+        if (type == "message") return FrameType::Message;
+        if (type == "typing") return FrameType::Typing;
+        if (type == "stopTyping") return FrameType::StopTyping;
+        if (type == "userStatus") return FrameType::UserStatus;
+        if (type == "messageReceipt") return FrameType::MessageReceipt;
+        return FrameType::Unknown;
+    }
+
+    // Walk the top level object once, in document order, and hand every field to the visitor.
+    // Fields the visitor does not read are skipped by the iterator without being materialised.
+    template <typename Visitor>
+    bool forEachField(padded_string_view input, Visitor&& visit) {
+        ondemand::document document;
+        if (threadParser().iterate(input).get(document) != SUCCESS) {
+            return false;
+        }
+        ondemand::object object;
+        if (document.get_object().get(object) != SUCCESS) {
+            return false;
+        }
+        for (auto field : object) {
+            std::string_view key;
+            if (field.unescaped_key().get(key) != SUCCESS) {
+                return false;
+            }
+            ondemand::value value;
+            if (field.value().get(value) != SUCCESS) {
+                return false;
+            }
+            if (!visit(key, value)) {
+                return false;
+            }
+        }
+        // Make sure there is no trailing content after the object
+        return document.at_end();
+    }
+
+    bool parseChatFrameImpl(padded_string_view input, ChatFrame& request) {
+        bool hasType = false;
+        bool ok = forEachField(input, [&](std::string_view key, ondemand::value value) {
+            if (key == "type") {
+                std::string_view type;
+                if (value.get_string().get(type) != SUCCESS) return false;
+                request.type = frameTypeFromString(type);
+                hasType = true;
+                return true;
+            }
+            if (key == "token") return readString(value, request.token);
+            if (key == "username") return readString(value, request.username);
+            if (key == "content") return readString(value, request.content);
+            if (key == "user_status") return readString(value, request.userStatus);
+            if (key == "recipient") return readId(value, request.recipientId);
+            if (key == "messageId") return readId(value, request.messageId);
+            return true;
+        });
+        return ok && hasType;
+    }
+}
+
+bool RequestParser::parseCredentials(std::string_view body, CredentialsRequest& request) {
+    bool hasEmail = false;
+    bool hasPassword = false;
+    bool ok = forEachField(padInput(body), [&](std::string_view key, ondemand::value value) {
+        if (key == "email") return hasEmail = readString(value, request.email);
+        if (key == "password") return hasPassword = readString(value, request.password);
+        return true;
+    });
+    return ok && hasEmail && hasPassword;
+}
+
+bool RequestParser::parseUserId(std::string_view body, UserIdRequest& request) {
+    bool hasUserId = false;
+    bool ok = forEachField(padInput(body), [&](std::string_view key, ondemand::value value) {
+        if (key == "user_id") return hasUserId = readId(value, request.userId);
+        return true;
+    });
+    return ok && hasUserId;
+}
+
+bool RequestParser::parseFriendPair(std::string_view body, FriendPairRequest& request) {
+    bool hasUserId = false;
+    bool hasFriendId = false;
+    bool ok = forEachField(padInput(body), [&](std::string_view key, ondemand::value value) {
+        if (key == "user_id") return hasUserId = readId(value, request.userId);
+        if (key == "friend_id") return hasFriendId = readId(value, request.friendId);
+        return true;
+    });
+    return ok && hasUserId && hasFriendId;
+}
+
+bool RequestParser::parseChatFrame(std::string_view frame, ChatFrame& request) {
+    return parseChatFrameImpl(padInput(frame), request);
+}
+
+bool RequestParser::parseChatFrame(const char* data, size_t length, size_t capacity, ChatFrame& request) {
+    return parseChatFrameImpl(padded_string_view(data, length, capacity), request);
+}
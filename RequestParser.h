@@ -0,0 +1,68 @@
+#pragma once
+#include <cstdint>
+#include <string>
+#include <string_view>
+
+#ifndef REQUESTPARSER_H
+#define REQUESTPARSER_H
+
+/*
+    The RequestParser class turns inbound REST bodies and TCP frames into typed request structs.
+    It is built on the simdjson On-Demand API: every input is parsed exactly once, in a single pass,
+    and only the fields a handler needs are materialised, everything else is skipped without being copied.
+    Ids are accepted both as JSON numbers and as numeric strings, as the clients send both.
+*/
+
+// Body of /api/login and /api/register
+struct CredentialsRequest {
+    std::string email;
+    std::string password;
+};
+
+// Body of the endpoints that only carry the current user id
+struct UserIdRequest {
+    int userId = 0;
+};
+
+// Body of /api/invite and /api/accept-invite
+struct FriendPairRequest {
+    int userId = 0;
+    int friendId = 0;
+};
+
+enum class FrameType {
+    Unknown,
+    Connect,
+    Disconnect,
+    Message,
+    Typing,
+    StopTyping,
+    UserStatus,
+    MessageReceipt
+};
+
+// A frame received on the TCP socket, fields that are absent keep their default value
+struct ChatFrame {
+    FrameType type = FrameType::Unknown;
+    std::string token;
+    std::string username;
+    std::string content;
+    std::string userStatus;
+    int recipientId = 0;
+    int64_t messageId = 0;
+};
+
+class RequestParser {
+public:
+    // Each parser returns false when the input is not valid JSON or a required field is missing
+    static bool parseCredentials(std::string_view body, CredentialsRequest& request);
+    static bool parseUserId(std::string_view body, UserIdRequest& request);
+    static bool parseFriendPair(std::string_view body, FriendPairRequest& request);
+    static bool parseChatFrame(std::string_view frame, ChatFrame& request);
+
+    // Same as parseChatFrame for a buffer that already has simdjson::SIMDJSON_PADDING bytes
+    // of readable memory after the frame, which avoids copying it
+    static bool parseChatFrame(const char* data, size_t length, size_t capacity, ChatFrame& request);
+};
+
+#endif //REQUESTPARSER_H
@@ -1,12 +1,22 @@
 #include "RestServer.h"
 #include "DatabaseManager.h"
 #include "Utils.h"
+#include "TokenValidator.h"
+#include "RequestParser.h"
+#include "UserDirectory.h"
+#include "RoomDirectory.h"
+#include "RecentMessageCache.h"
 #include <boost/beast/core.hpp>
 #include <boost/beast/http.hpp>
 #include <boost/asio.hpp>
 #include <iostream>
 #include <memory>
 #include <string>
+#include <chrono>
+#include <optional>
+#include <string_view>
+#include <algorithm>
+#include <cctype>
 #include <jwt-cpp/jwt.h>
 
 namespace beast = boost::beast;
@@ -21,6 +31,106 @@ using tcp = net::ip::tcp;
 */
 
 
+namespace {
+    // The executor a request needed rejected it, handleRequest answers 503 with Retry-After
+    void setBusy(json& response) {
+        response = json::object();
+        response["message"] = "Server is busy, please retry";
+        response["status"] = "error";
+        response["retry_after"] = 1;
+    }
+
+    // JSON shape of the typed rows, shared by the endpoints returning them
+    json userToJson(const UserView& user) {
+        json userJson;
+        userJson["user_id"] = user.id;
+        userJson["user_name"] = user.name;
+        userJson["email"] = user.email;
+        userJson["profile_picture"] = user.profilePicture;
+        userJson["status"] = user.status;
+        userJson["created_at"] = user.createdAt;
+        return userJson;
+    }
+
+    json roomToJson(const Room& room) {
+        json roomJson;
+        roomJson["room_id"] = room.id;
+        roomJson["user_id_1"] = room.userId1;
+        roomJson["user_id_2"] = room.userId2;
+        roomJson["last_message_at"] = room.lastMessageAt;
+        roomJson["created_at"] = room.createdAt;
+        return roomJson;
+    }
+
+    json messageToJson(const MessageView& message) {
+        json messageJson;
+        messageJson["message_id"] = message.id;
+        messageJson["sender_id"] = message.senderId;
+        messageJson["content"] = message.content;
+        messageJson["is_read"] = message.isRead;
+        messageJson["created_at"] = message.createdAt;
+        if (!message.journalId.empty()) {
+            messageJson["journal_id"] = message.journalId;
+        }
+        return messageJson;
+    }
+
+    json friendEdgeToJson(const FriendEdge& relation) {
+        json relationJson;
+        relationJson["user_id_1"] = relation.userId1;
+        relationJson["user_id_2"] = relation.userId2;
+        relationJson["is_accepted"] = relation.isAccepted;
+        relationJson["room_id"] = relation.roomId;
+        return relationJson;
+    }
+
+    // Decoded value of a query string parameter (name=value&...), '+' and %XX escapes included, nullopt when absent
+    std::optional<std::string> queryText(std::string_view query, std::string_view name) {
+        while (!query.empty()) {
+            size_t end = query.find('&');
+            std::string_view pair = query.substr(0, end);
+            if (pair.size() > name.size() && pair.substr(0, name.size()) == name && pair[name.size()] == '=') {
+                std::string_view raw = pair.substr(name.size() + 1);
+                std::string value;
+                value.reserve(raw.size());
+                for (size_t i = 0; i < raw.size(); ++i) {
+                    if (raw[i] == '+') {
+                        value += ' ';
+                    }
+                    else if (raw[i] == '%' && i + 2 < raw.size() && std::isxdigit(static_cast<unsigned char>(raw[i + 1]))
+                        && std::isxdigit(static_cast<unsigned char>(raw[i + 2]))) {
+                        value += static_cast<char>(std::stoi(std::string(raw.substr(i + 1, 2)), nullptr, 16));
+                        i += 2;
+                    }
+                    else {
+                        value += raw[i];
+                    }
+                }
+                return value;
+            }
+            if (end == std::string_view::npos) {
+                break;
+            }
+            query.remove_prefix(end + 1);
+        }
+        return std::nullopt;
+    }
+
+    // Integer value of a query string parameter, nullopt when absent or not a number
+    std::optional<int64_t> queryParam(std::string_view query, std::string_view name) {
+        std::optional<std::string> text = queryText(query, name);
+        if (!text) {
+            return std::nullopt;
+        }
+        try {
+            return std::stoll(*text);
+        }
+        catch (const std::exception&) {
+            return std::nullopt;
+        }
+    }
+}
+
 /*
 Function of acceptor
  Accepting Connections:
@@ -31,8 +141,9 @@ Function of acceptor
     Acceptors often support asynchronous operations, allowing the server to continue performing other tasks without being blocked while waiting for a connection.
  */
 
-RestServer::RestServer(net::io_context& ioc, tcp::endpoint endpoint, ThreadPool& threadPool)
-    : acceptor_(ioc), threadPool_(threadPool) {
+RestServer::RestServer(net::io_context& ioc, tcp::endpoint endpoint, ThreadPool& ioPool, ThreadPool& dbPool, ThreadPool& cpuPool,
+    MessageJournal* journal, CapacityController* capacity)
+    : acceptor_(ioc), ioPool_(ioPool), dbPool_(dbPool), cpuPool_(cpuPool), journal_(journal), capacity_(capacity) {
 
   	//The ec variable is used to save the error code during operations with the socket.
     beast::error_code ec;
@@ -75,15 +186,11 @@ void RestServer::doAccept() {
     // 'async_accept' is used to accept a new connection from a client.
     // When a client tries to connect to the server,
     // async_accept will accept the connection and provide a socket to communicate with the client.
-    auto socket = std::make_shared<tcp::socket>(acceptor_.get_executor());
     acceptor_.async_accept(
-        *socket,
-        [this, socket](boost::system::error_code ec) {  // Capture socket ?úng cách
+        [this](boost::system::error_code ec, tcp::socket socket) {
             if (!ec) {
-              // Enqueue the task to handle the client connection if there is no error
-                threadPool_.enqueueTask([this, socket = std::move(socket)]() mutable {
-                    handleRequest(socket);
-                    });
+                // Serve the connection in a coroutine on the reactor threads, it only suspends while waiting
+                net::co_spawn(socket.get_executor(), handleRequest(std::move(socket)), net::detached);
             }
             else {
                 std::cerr << "Failed to accept connection: " << ec.message() << std::endl;
@@ -94,180 +201,246 @@ void RestServer::doAccept() {
 }
 
 
-void RestServer::handleRequest(std::shared_ptr<tcp::socket> socket) {
+net::awaitable<void> RestServer::handleRequest(tcp::socket socket) {
     try {
         // This buffer helps to manage the size and calculate memory efficiently.
         beast::flat_buffer buffer;
         http::request<http::string_body> req;
         // Read a request from the client
-        http::read(*socket, buffer, req);
+        co_await http::async_read(socket, buffer, req, net::use_awaitable);
+
+        // The bearer token identifies the client session, reads made for it see its own writes
+        auto sessionHeader = req[http::field::authorization];
+        AsyncStorage db(dbPool_, sessionHeader.size() > 7 ? std::string(sessionHeader.substr(7)) : std::string());
 
         http::response<http::string_body> res{ http::status::ok, req.version() };
         res.set(http::field::server, "Beast");
         res.set(http::field::content_type, "application/json");
 
-        // Handle different API requests based on the request method and target
+        // Handle different API requests based on the request method and target.
+        // The coroutine runs on a reactor thread, handlers made of database calls hop to the db executor
+        // and the others hop for their blocking parts only
+        json response;
+        bool found = true;
         if (req.method() == http::verb::post && req.target() == "/api/login") {
             // Handle login
-            json response = handleLogin(req);
-            res.body() = response.dump();
+            response = co_await handleLogin(req, db);
         }
         else if (req.method() == http::verb::post && req.target() == "/api/register") {
             // Handle register
-            json response = handleRegister(req);
-            res.body() = response.dump();
+            response = co_await handleRegister(req, db);
         }
         else if (req.method() == http::verb::post && req.target() == "/api/logout") {
             // Handle logout
-            json response = handleLogout(req);
-            res.body() = response.dump();
+            response = co_await runHandlerOnDbPool(db, [&]() { return handleLogout(req); });
         }
         else if (req.method() == http::verb::post && req.target() == "/api/invite") {
             // Handle invite friend
-            json response = handleInviteFriend(req);
-            res.body() = response.dump();
+            response = co_await runHandlerOnDbPool(db, [&]() { return handleInviteFriend(req); });
         }
         else if (req.method() == http::verb::post && req.target() == "/api/accept-invite") {
-            // Handle invite friend
-            json response = handleInviteFriend(req);
-            res.body() = response.dump();
+            // Handle accept invite friend
+            response = co_await runHandlerOnDbPool(db, [&]() { return handleAcceptInviteFriend(req); });
         }
         else if (req.method() == http::verb::get && req.target() == "/api/users") {
             // Handle get users
-            json response = handleGetUsers(req);
-            res.body() = response.dump();
+            response = co_await runHandlerOnDbPool(db, [&]() { return handleGetUsers(req); });
         }
         else if (req.method() == http::verb::get && req.target() == "/api/rooms") {
             // Handle get rooms
-            json response = handleGetRooms(req);
-            res.body() = response.dump();
+            response = co_await runHandlerOnDbPool(db, [&]() { return handleGetRooms(req); });
         }
         else if (req.method() == http::verb::get && req.target().starts_with("/api/messages/")) {
             // Handle get messages
-            std::string roomId = req.target().substr(std::string("/api/messages/").length());
-            json response = handleGetMessages(req, roomId);
-            res.body() = response.dump();
+            // /api/messages/{roomId}?from=<ms>&to=<ms>&limit=<n>
+            std::string_view target(req.target().data(), req.target().size());
+            target.remove_prefix(std::string_view("/api/messages/").size());
+            size_t queryStart = target.find('?');
+            std::string roomId(target.substr(0, queryStart));
+            std::string query(queryStart == std::string_view::npos ? std::string_view() : target.substr(queryStart + 1));
+            response = co_await handleGetMessages(req, db, roomId, query);
+        }
+        else if (req.method() == http::verb::get
+            && (req.target() == "/api/search" || req.target().starts_with("/api/search?"))) {
+            // Handle message search
+            // /api/search?q=<text>&cursor=<cursor>&limit=<n>
+            std::string_view target(req.target().data(), req.target().size());
+            size_t queryStart = target.find('?');
+            std::string query(queryStart == std::string_view::npos ? std::string_view() : target.substr(queryStart + 1));
+            response = co_await runHandlerOnDbPool(db, [&]() { return handleSearchMessages(req, query); });
+        }
+        else if (req.method() == http::verb::get && req.target() == "/api/metrics") {
+            // Handle metrics
+            response = handleGetMetrics();
         }
         else {
+            found = false;
             res.result(http::status::not_found);
             res.body() = "Not Found";
         }
 
+        if (found) {
+            if (response.contains("retry_after")) {
+                // The executor the request needed is saturated, ask the client to back off instead of queueing
+                res.result(http::status::service_unavailable);
+                res.set(http::field::retry_after, "1");
+            }
+            res.body() = response.dump();
+        }
+
         // Prepare the response payload
         // Write the response to the client
         res.prepare_payload();
-        http::write(*socket, res);
+        co_await http::async_write(socket, res, net::use_awaitable);
     }
     catch (std::exception& e) {
         std::cerr << "Exception in thread: " << e.what() << "\n";
     }
 }
 
+// Verified tokens are cached by TokenValidator, so this is a lookup on the hot path
 bool RestServer::isTokenValid(const std::string& token, std::string& email) {
-    try {
-        auto decoded = jwt::decode(token);
-        auto verifier = jwt::verify()
-            .allow_algorithm(jwt::algorithm::hs256{ "secret" })
-            .with_issuer("auth0");
+    return TokenValidator::getInstance().validate(token, email);
+}
 
-        verifier.verify(decoded);
-        email = decoded.get_payload_claim("email").as_string();
-        return true;
-    }
-    catch (const std::exception& e) {
-        std::cerr << "Token validation failed: " << e.what() << "\n";
-        return false;
+// Hop to the db executor and run the whole handler there, inside the request's session scope.
+// When the db executor's queue is full the handler does not run and the response is the busy error (503).
+// The coroutine is suspended meanwhile and resumes on the request's executor, where an exception thrown by the
+// handler is rethrown.
+net::awaitable<json> RestServer::runHandlerOnDbPool(AsyncStorage& db, std::function<json()> handler) {
+    json response;
+    if (!co_await db.tryRun([&](Storage&) { response = handler(); })) {
+        setBusy(response);
     }
+    co_return response;
 }
 
-json RestServer::handleLogin(const http::request<http::string_body>& req) {
+net::awaitable<json> RestServer::handleLogin(const http::request<http::string_body>& req, AsyncStorage& db) {
     json response;
     try {
-        // Parse the request body
-        json requestBody = json::parse(req.body());
-
-        // Extract email and password
-        std::string email = requestBody.at("email").get<std::string>();
-        std::string password = requestBody.at("password").get<std::string>();
+        // Parse the request body once, extracting email and password
+        CredentialsRequest request;
+        if (!RequestParser::parseCredentials(req.body(), request)) {
+            response["message"] = "Invalid request";
+            response["status"] = "error";
+            co_return response;
+        }
+        const std::string& email = request.email;
+        const std::string& password = request.password;
 
-        // Get the singleton instance of DatabaseManager
-        DatabaseManager& dbManager = DatabaseManager::getInstance();
 
-        // Check if the email exists in the database
-        if (!dbManager.emailExists(email)) {
+        // An unknown email has no stored hash, it is rejected like a wrong password
+        std::string storedHash;
+        if (!co_await db.tryRun([&](Storage& storage) { storedHash = storage.getPasswordHash(email); })) {
+            setBusy(response);
+            co_return response;
+        }
+        if (storedHash.empty()) {
             response["message"] = "Invalid email or password";
             response["status"] = "error";
+            co_return response;
         }
-        else {
-            // Check the password (you can use a library like bcrypt for this)
-            std::string storedHash = dbManager.getPasswordHash(email);
-            if (Utils::checkPassword(password, storedHash)) {
-                // Generate a token
-                std::string token = Utils::generateToken(email);
-
-                // Update user status to 'online'
-                dbManager.updateUserStatus(email, "online");
-                response["message"] = "Login successful";
-                response["status"] = "success";
-                response["token"] = token;
+
+        // Verify the password against the stored Argon2id hash on the CPU pool
+        bool passwordMatches = false;
+        std::string upgradedHash;
+        bool accepted = co_await tryRunOn(cpuPool_, [&]() {
+            passwordMatches = Utils::checkPassword(password, storedHash);
+            // Upgrade hashes stored before Argon2id was enabled while the password is at hand
+            if (passwordMatches && Utils::needsRehash(storedHash)) {
+                upgradedHash = Utils::hashPassword(password);
             }
-            else {
-                response["message"] = "Invalid email or password";
-                response["status"] = "error";
+        });
+
+        if (!accepted) {
+            setBusy(response);
+        }
+        else if (passwordMatches) {
+            // Update user status to 'online' (and store the upgraded hash) in one round trip
+            if (!co_await db.tryRun([&](Storage& storage) { storage.recordLogin(email, upgradedHash); })) {
+                setBusy(response);
+                co_return response;
             }
+
+            // Generate a token
+            std::string token = Utils::generateToken(email);
+            response["message"] = "Login successful";
+            response["status"] = "success";
+            response["token"] = token;
+        }
+        else {
+            response["message"] = "Invalid email or password";
+            response["status"] = "error";
         }
     }
     catch (const std::exception& e) {
         response["message"] = "Invalid request";
         response["status"] = "error";
     }
-    return response;
+    co_return response;
 }
 
-json RestServer::handleRegister(const http::request<http::string_body>& req) {
+net::awaitable<json> RestServer::handleRegister(const http::request<http::string_body>& req, AsyncStorage& db) {
     json response;
     try {
-        // Parse the request body
-        json requestBody = json::parse(req.body());
-
-        // Extract email and password
-        std::string email = requestBody.at("email").get<std::string>();
-        std::string password = requestBody.at("password").get<std::string>();
-
-        // Hash the password (you can use a library like bcrypt for this)
-        std::string passwordHash = Utils::hashPassword(password.c_str());
+        // Parse the request body once, extracting email and password
+        CredentialsRequest request;
+        if (!RequestParser::parseCredentials(req.body(), request)) {
+            response["message"] = "Invalid request";
+            response["status"] = "error";
+            co_return response;
+        }
+        const std::string& email = request.email;
+        const std::string& password = request.password;
 
-        // Get the singleton instance of DatabaseManager
-        DatabaseManager& dbManager = DatabaseManager::getInstance();
 
         // Check if the email already exists in the database
-        if (dbManager.emailExists(email)) {
+        bool exists = false;
+        if (!co_await db.tryRun([&](Storage& storage) { exists = storage.emailExists(email); })) {
+            setBusy(response);
+            co_return response;
+        }
+        if (exists) {
             response["message"] = "Email already exists";
             response["status"] = "error";
+            co_return response;
         }
-        else {
-            // Register the new user
-            if (dbManager.registerUser(email, passwordHash)) {
-                std::string token = Utils::generateToken(email);
 
-                // Update user status to 'online'
-                dbManager.updateUserStatus(email, "online");
-                response["message"] = "Registration successful";
-                response["status"] = "success";
-                response["token"] = token;
+        // Hash the password with Argon2id on the CPU pool
+        std::string passwordHash;
+        if (!co_await tryRunOn(cpuPool_, [&]() { passwordHash = Utils::hashPassword(password); })) {
+            setBusy(response);
+            co_return response;
+        }
+
+        // Register the new user and update its status to 'online'
+        bool registered = false;
+        if (!co_await db.tryRun([&](Storage& storage) {
+                registered = storage.registerUser(email, passwordHash);
+                if (registered) {
+                    storage.updateUserStatus(email, "online");
+                }
+            })) {
+            setBusy(response);
+            co_return response;
+        }
+        if (registered) {
+            std::string token = Utils::generateToken(email);
+            response["message"] = "Registration successful";
+            response["status"] = "success";
+            response["token"] = token;
 
-            }
-            else {
-                response["message"] = "Registration failed";
-                response["status"] = "error";
-            }
+        }
+        else {
+            response["message"] = "Registration failed";
+            response["status"] = "error";
         }
     }
     catch (const std::exception& e) {
         response["message"] = "Invalid request";
         response["status"] = "error";
     }
-    return response;
+    co_return response;
 }
 
 json RestServer::handleLogout(const http::request<http::string_body>& req) {
@@ -281,18 +454,22 @@ json RestServer::handleLogout(const http::request<http::string_body>& req) {
             return response;
         }
 
-        std::string token = authHeader.substr(7); // Remove "Bearer " prefix
+        std::string token(authHeader.substr(7)); // Remove "Bearer " prefix
+        std::string email;
+        if (!isTokenValid(token, email)) {
+            response["message"] = "Invalid token";
+            response["status"] = "error";
+            return response;
+        }
 
-        // Get the singleton instance of DatabaseManager
-        DatabaseManager& dbManager = DatabaseManager::getInstance();
+        // Get the configured storage backend
+        Storage& storage = Storage::getInstance();
 
-        // Invalidate the token
-        if (dbManager.invalidateToken(token)) {
-            // Extract email from token
-            auto decoded = jwt::decode(token);
-            std::string email = decoded.get_payload_claim("email").as_string();
+        // Invalidate the token, persist it for the next startup and reject it in memory right away
+        if (storage.invalidateToken(token)) {
+            TokenValidator::getInstance().revoke(token);
             // Update user status to 'offline'
-            dbManager.updateUserStatus(email, "offline");
+            storage.updateUserStatus(email, "offline");
             response["message"] = "Logout successful";
             response["status"] = "success";
         }
@@ -319,7 +496,7 @@ json RestServer::handleGetUsers(const http::request<http::string_body>& req) {
             return response;
         }
 
-        std::string token = authHeader.substr(7); // Remove "Bearer " prefix
+        std::string token(authHeader.substr(7)); // Remove "Bearer " prefix
         std::string email;
         if (!isTokenValid(token, email)) {
             response["message"] = "Invalid token";
@@ -327,16 +504,22 @@ json RestServer::handleGetUsers(const http::request<http::string_body>& req) {
             return response;
         }
 
-        // Get the singleton instance of DatabaseManager
-        DatabaseManager& dbManager = DatabaseManager::getInstance();
+        // Get the configured storage backend
+        Storage& storage = Storage::getInstance();
 
-        // Retrieve list of users
-        std::vector<std::string> user = dbManager.getUserByEmail(email);
-        response["username"] = user[0];
-        response["email"] = user[1];
-        response["profile_picture"] = user[2];
-        response["status"] = user[3];
-        response["created_at"] = user[4];
+        // Retrieve the current user
+        std::optional<User> user = storage.getUserByEmail(email);
+        if (!user) {
+            response["message"] = "User not found";
+            response["status"] = "error";
+            return response;
+        }
+        response["user_id"] = user->id;
+        response["username"] = user->name;
+        response["email"] = user->email;
+        response["profile_picture"] = user->profilePicture;
+        response["status"] = user->status;
+        response["created_at"] = user->createdAt;
 
     }
     catch (const std::exception& e) {
@@ -360,7 +543,7 @@ json RestServer::handleGetRooms(const http::request<http::string_body>& req) {
             return response;
         }
 
-        std::string token = authHeader.substr(7); // Remove "Bearer " prefix
+        std::string token(authHeader.substr(7)); // Remove "Bearer " prefix
         std::string email;
         if (!isTokenValid(token, email)) {
             response["message"] = "Invalid token";
@@ -368,20 +551,21 @@ json RestServer::handleGetRooms(const http::request<http::string_body>& req) {
             return response;
         }
 
-        // Get the singleton instance of DatabaseManager
-        DatabaseManager& dbManager = DatabaseManager::getInstance();
+        // Get the configured storage backend
+        Storage& storage = Storage::getInstance();
 
-        std::string userId = json::parse(req.body())["user_id"];
+        UserIdRequest request;
+        if (!RequestParser::parseUserId(req.body(), request)) {
+            response["message"] = "Invalid request";
+            response["status"] = "error";
+            return response;
+        }
 
         // Retrieve list of chat rooms
-        std::vector<std::vector<std::string>> rooms = dbManager.getRoomsByUserId(std::stoi(userId));
+        std::vector<Room> rooms = storage.getRoomsByUserId(request.userId);
         response["rooms"] = json::array();
         for (const auto& room : rooms) {
-            json roomJson;
-            roomJson["room_id"] = room[0];
-            roomJson["room_name"] = room[1];
-            roomJson["created_at"] = room[2];
-            response["rooms"].push_back(roomJson);
+            response["rooms"].push_back(roomToJson(room));
         }
         response["status"] = "success";
     }
@@ -393,7 +577,8 @@ json RestServer::handleGetRooms(const http::request<http::string_body>& req) {
     return response;
 }
 
-json RestServer::handleGetMessages(const http::request<http::string_body>& req, const std::string& roomId) {
+net::awaitable<json> RestServer::handleGetMessages(const http::request<http::string_body>& req, AsyncStorage& db,
+    const std::string& roomId, const std::string& query) {
   // Retrieve message history for the specified room
   // Return JSON response
   json response;
@@ -403,48 +588,150 @@ json RestServer::handleGetMessages(const http::request<http::string_body>& req,
         if (authHeader.empty()) {
             response["message"] = "Authorization header missing";
             response["status"] = "error";
-            return response;
+            co_return response;
         }
 
-        std::string token = authHeader.substr(7); // Remove "Bearer " prefix
+        std::string token(authHeader.substr(7)); // Remove "Bearer " prefix
         std::string email;
         if (!isTokenValid(token, email)) {
             response["message"] = "Invalid token";
             response["status"] = "error";
-            return response;
+            co_return response;
         }
 
+        // The history is read by time window so the database only touches the partitions of that window,
+        // the default is the last 30 days and older pages are fetched by moving `to` back.
+        // limit keeps only the newest messages of the window (the latest page)
+        int64_t now = std::chrono::duration_cast<std::chrono::milliseconds>(
+            std::chrono::system_clock::now().time_since_epoch()).count();
+        std::optional<int64_t> toParam = queryParam(query, "to");
+        int64_t to = toParam.value_or(now);
+        int64_t from = queryParam(query, "from").value_or(to - int64_t{ 30 } * 24 * 60 * 60 * 1000);
+        size_t limit = static_cast<size_t>(std::max<int64_t>(0, queryParam(query, "limit").value_or(0)));
+
+        // The latest page and reconnect catch-up (`from` only) of an active room are served from memory
+        int roomIdValue = std::stoi(roomId);
+        RecentMessageCache& recentMessages = RecentMessageCache::getInstance();
+        std::optional<ResultView<MessageView>> cached = recentMessages.find(roomIdValue, from, to, limit);
+        ResultView<MessageView> messages;
+        if (cached) {
+            messages = std::move(*cached);
+        }
+        else {
+            // Checked before the read: an entry journaled before the token and drained after this check is already
+            // in Postgres when the read runs, one journaled after the token is appended and invalidates the fill
+            uint64_t token = recentMessages.loadToken(roomIdValue);
+            bool complete = journal_ == nullptr || !journal_->hasUndrained(roomIdValue);
+            if (!co_await db.tryRun([&](Storage& storage) { messages = storage.getMessages(roomIdValue, from, to); })) {
+                setBusy(response);
+                co_return response;
+            }
+            if (!toParam && complete) {
+                // Reaches up to now, so the room can be kept up to date from here by the send path
+                std::vector<Message> loaded;
+                loaded.reserve(messages.size());
+                for (const auto& message : messages) {
+                    loaded.push_back(message.toMessage());
+                }
+                recentMessages.fill(roomIdValue, from, loaded, token);
+            }
+        }
+        response["from"] = from;
+        response["to"] = to;
 
-		// Get the singleton instance of DatabaseManager
-		DatabaseManager& dbManager = DatabaseManager::getInstance();
-
-        std::vector<std::vector<std::string>> messages = dbManager.getMessages(std::stoi(roomId));
+        // Retrieve message history for the specified room
+        response["messages"] = json::array();
+        size_t first = limit != 0 && messages.size() > limit ? messages.size() - limit : 0;
+		for (size_t i = first; i < messages.size(); ++i) {
+			response["messages"].push_back(messageToJson(messages[i]));
+		}
 
-		for (const auto& message : messages) {
-			json messageJson;
-			messageJson["message_id"] = message[0];
-			messageJson["sender_id"] = message[1];
-			messageJson["content"] = message[2];
-			messageJson["is_read"] = message[3];
-			messageJson["created_at"] = message[4];
-			response["messages"].push_back(messageJson);
+		std::optional<Room> room;
+		if (!co_await db.tryRun([&](Storage& storage) { room = storage.getRoomById(roomIdValue); })) {
+			setBusy(response);
+			co_return response;
 		}
+		if (room) {
+			response["room"] = roomToJson(*room);
+		}
+        response["status"] = "success";
+    }
+    catch (const std::exception& e) {
+        response["message"] = "Failed to retrieve messages";
+        response["status"] = "error";
+    }
 
-		std::vector<std::string> room = dbManager.getRoomById(std::stoi(roomId));
-		json roomJson;
-		roomJson["room_id"] = room[0];
-		roomJson["user_id_1"] = room[1];
-        roomJson["user_id_2"] = room[2];
-		roomJson["last_message_at"] = room[3];
-        roomJson["created_at"] = room[4];
+    co_return response;
+}
 
-        // Retrieve message history for the specified room
+// Search the messages of the rooms the user belongs to, newest first.
+// A full page comes with next_cursor, passed back as cursor to get the following page
+json RestServer::handleSearchMessages(const http::request<http::string_body>& req, const std::string& query) {
+    json response;
+    try {
+        // Extract the token from the request headers
+        auto authHeader = req[http::field::authorization];
+        if (authHeader.empty()) {
+            response["message"] = "Authorization header missing";
+            response["status"] = "error";
+            return response;
+        }
+
+        std::string token(authHeader.substr(7)); // Remove "Bearer " prefix
+        std::string email;
+        if (!isTokenValid(token, email)) {
+            response["message"] = "Invalid token";
+            response["status"] = "error";
+            return response;
+        }
+
+        std::string text = queryText(query, "q").value_or("");
+        if (text.find_first_not_of(' ') == std::string::npos) {
+            response["message"] = "Missing search text";
+            response["status"] = "error";
+            return response;
+        }
+        size_t limit = static_cast<size_t>(std::clamp<int64_t>(queryParam(query, "limit").value_or(20), 1, 100));
+
+        // The cursor is "<created_at in microseconds>_<message id>" of the last message of the previous page
+        std::optional<MessageSearchCursor> after;
+        std::optional<std::string> cursor = queryText(query, "cursor");
+        if (cursor) {
+            size_t separator = cursor->find('_');
+            try {
+                if (separator == std::string::npos) {
+                    throw std::invalid_argument("missing separator");
+                }
+                after = MessageSearchCursor{ std::stoll(cursor->substr(0, separator)), std::stoll(cursor->substr(separator + 1)) };
+            }
+            catch (const std::exception&) {
+                response["message"] = "Invalid cursor";
+                response["status"] = "error";
+                return response;
+            }
+        }
+
+        // Get the configured storage backend
+        Storage& storage = Storage::getInstance();
+        std::optional<User> user = storage.getUserByEmail(email);
+        if (!user) {
+            response["message"] = "User not found";
+            response["status"] = "error";
+            return response;
+        }
+
+        MessageSearchPage page = storage.searchMessages(user->id, text, after, limit);
         response["messages"] = json::array();
-		response["room"] = roomJson;
+        for (const auto& message : page.messages) {
+            response["messages"].push_back(messageToJson(message));
+        }
+        if (page.next) {
+            response["next_cursor"] = std::to_string(page.next->createdAtMicros) + "_" + std::to_string(page.next->messageId);
+        }
         response["status"] = "success";
     }
     catch (const std::exception& e) {
-        response["message"] = "Failed to retrieve messages";
+        response["message"] = "Failed to search messages";
         response["status"] = "error";
     }
 
@@ -462,7 +749,7 @@ json RestServer::handleInviteFriend(const http::request<http::string_body>& req)
             return response;
         }
 
-        std::string token = authHeader.substr(7); // Remove "Bearer " prefix
+        std::string token(authHeader.substr(7)); // Remove "Bearer " prefix
         std::string email;
         if (!isTokenValid(token, email)) {
             response["message"] = "Invalid token";
@@ -470,20 +757,21 @@ json RestServer::handleInviteFriend(const http::request<http::string_body>& req)
             return response;
         }
 
-		std::string friendId = json::parse(req.body())["friend_id"];
-		std::string userId = json::parse(req.body())["user_id"];
-
-		// Get the singleton instance of DatabaseManager
-		DatabaseManager& dbManager = DatabaseManager::getInstance();
+		// Parse the body once for both ids
+		FriendPairRequest request;
+		if (!RequestParser::parseFriendPair(req.body(), request)) {
+		    response["message"] = "Invalid request";
+		    response["status"] = "error";
+		    return response;
+		}
 
-		std::vector<std::string> result = dbManager.updateFriendRequest(std::stoi(userId), std::stoi(friendId));
+		// Get the configured storage backend
+		Storage& storage = Storage::getInstance();
 
-		for (const auto& row : result) {
-			json friendRequest;
-			friendRequest["user_id_1"] = row[0];
-			friendRequest["user_id_2"] = row[1];
-			friendRequest["is_accepted"] = row[2];
-			response["friend_requests"].push_back(friendRequest);
+		std::optional<FriendEdge> result = storage.updateFriendRequest(request.userId, request.friendId);
+		response["friend_requests"] = json::array();
+		if (result) {
+		    response["friend_requests"].push_back(friendEdgeToJson(*result));
 		}
 
 
@@ -514,7 +802,7 @@ json RestServer::handleGetFriend(const http::request<http::string_body>& req) {
             return response;
         }
 
-        std::string token = authHeader.substr(7); // Remove "Bearer " prefix
+        std::string token(authHeader.substr(7)); // Remove "Bearer " prefix
         std::string email;
         if (!isTokenValid(token, email)) {
             response["message"] = "Invalid token";
@@ -522,21 +810,21 @@ json RestServer::handleGetFriend(const http::request<http::string_body>& req) {
             return response;
         }
 
-		// Get the singleton instance of DatabaseManager
-		DatabaseManager& dbManager = DatabaseManager::getInstance();
+		// Get the configured storage backend
+		Storage& storage = Storage::getInstance();
 
-		std::string userId = json::parse(req.body())["user_id"];
+		UserIdRequest request;
+		if (!RequestParser::parseUserId(req.body(), request)) {
+		    response["message"] = "Invalid request";
+		    response["status"] = "error";
+		    return response;
+		}
 
-        std::vector<std::vector<std::string>> result = dbManager.getFriends(std::stoi(userId));
+        ResultView<UserView> result = storage.getFriends(request.userId);
 
-		for (const auto& row : result) {
-			json friend_;
-            friend_["user_name"] = row[0];
-            friend_["email"] = row[1];
-            friend_["profile_picture"] = row[2];
-            friend_["status"] = row[3];
-            friend_["created_at"] = row[4];
-			response["friends"].push_back(friend_);
+		response["friends"] = json::array();
+		for (const auto& friend_ : result) {
+			response["friends"].push_back(userToJson(friend_));
 		}
 		response["status"] = "success";
 
@@ -562,25 +850,26 @@ json RestServer::handleGetPendingInvitedFriend(const http::request<http::string_
 			response["status"] = "error";
 			return response;
 		}
-		std::string token = authHeader.substr(7); // Remove "Bearer " prefix
+		std::string token(authHeader.substr(7)); // Remove "Bearer " prefix
 		std::string email;
 		if (!isTokenValid(token, email)) {
 			response["message"] = "Invalid token";
 			response["status"] = "error";
 			return response;
 		}
-		// Get the singleton instance of DatabaseManager
-		DatabaseManager& dbManager = DatabaseManager::getInstance();
-		std::string userId = json::parse(req.body())["user_id"];
-		std::vector<std::vector<std::string>> result = dbManager.getFriendRequestPending(std::stoi(userId));
-		for (const auto& row : result) {
-			json friend_;
-			friend_["user_name"] = row[0];
-			friend_["email"] = row[1];
-			friend_["profile_picture"] = row[2];
-			friend_["status"] = row[3];
-			friend_["created_at"] = row[4];
-			response["friends"].push_back(friend_);
+		// Get the configured storage backend
+		Storage& storage = Storage::getInstance();
+		UserIdRequest request;
+		if (!RequestParser::parseUserId(req.body(), request)) {
+		    response["message"] = "Invalid request";
+		    response["status"] = "error";
+		    return response;
+		}
+		ResultView<UserView> result = storage.getFriendRequestPending(request.userId);
+
+		response["friends"] = json::array();
+		for (const auto& friend_ : result) {
+			response["friends"].push_back(userToJson(friend_));
 		}
 		response["status"] = "success";
 	}
@@ -603,25 +892,26 @@ json RestServer::handleGetFriendIniviteRequest(const http::request<http::string_
 			response["status"] = "error";
 			return response;
 		}
-		std::string token = authHeader.substr(7); // Remove "Bearer " prefix
+		std::string token(authHeader.substr(7)); // Remove "Bearer " prefix
 		std::string email;
 		if (!isTokenValid(token, email)) {
 			response["message"] = "Invalid token";
 			response["status"] = "error";
 			return response;
 		}
-		// Get the singleton instance of DatabaseManager
-		DatabaseManager& dbManager = DatabaseManager::getInstance();
-		std::string userId = json::parse(req.body())["user_id"];
-		std::vector<std::vector<std::string>> result = dbManager.getFriendRequests(std::stoi(userId));
-		for (const auto& row : result) {
-			json friend_;
-			friend_["user_name"] = row[0];
-			friend_["email"] = row[1];
-			friend_["profile_picture"] = row[2];
-			friend_["status"] = row[3];
-			friend_["created_at"] = row[4];
-			response["friends"].push_back(friend_);
+		// Get the configured storage backend
+		Storage& storage = Storage::getInstance();
+		UserIdRequest request;
+		if (!RequestParser::parseUserId(req.body(), request)) {
+		    response["message"] = "Invalid request";
+		    response["status"] = "error";
+		    return response;
+		}
+		ResultView<UserView> result = storage.getFriendRequests(request.userId);
+
+		response["friends"] = json::array();
+		for (const auto& friend_ : result) {
+			response["friends"].push_back(userToJson(friend_));
 		}
 		response["status"] = "success";
 	}
@@ -633,7 +923,7 @@ json RestServer::handleGetFriendIniviteRequest(const http::request<http::string_
 };
 
 
-bool RestServer::handleAcceptInviteFriend(const http::request<http::string_body>& req) {
+json RestServer::handleAcceptInviteFriend(const http::request<http::string_body>& req) {
 	json response;
 	try {
 		// Extract the token from the request headers
@@ -643,27 +933,28 @@ bool RestServer::handleAcceptInviteFriend(const http::request<http::string_body>
 			response["status"] = "error";
 			return response;
 		}
-		std::string token = authHeader.substr(7); // Remove "Bearer " prefix
+		std::string token(authHeader.substr(7)); // Remove "Bearer " prefix
 		std::string email;
 		if (!isTokenValid(token, email)) {
 			response["message"] = "Invalid token";
 			response["status"] = "error";
 			return response;
 		}
-        std::string friendId = json::parse(req.body())["friend_id"];
-        std::string userId = json::parse(req.body())["user_id"];
-
-        // Get the singleton instance of DatabaseManager
-        DatabaseManager& dbManager = DatabaseManager::getInstance();
+        // Parse the body once for both ids
+        FriendPairRequest request;
+        if (!RequestParser::parseFriendPair(req.body(), request)) {
+            response["message"] = "Invalid request";
+            response["status"] = "error";
+            return response;
+        }
 
-        std::vector<std::string> result = dbManager.updateFriendRequest(std::stoi(userId), std::stoi(friendId));
+        // Get the configured storage backend
+        Storage& storage = Storage::getInstance();
 
-        for (const auto& row : result) {
-            json friendRequest;
-            friendRequest["user_id_1"] = row[0];
-            friendRequest["user_id_2"] = row[1];
-            friendRequest["is_accepted"] = row[2];
-            response["friend_requests"].push_back(friendRequest);
+        std::optional<FriendEdge> result = storage.updateFriendRequest(request.userId, request.friendId);
+        response["friend_requests"] = json::array();
+        if (result) {
+            response["friend_requests"].push_back(friendEdgeToJson(*result));
         }
 
 
@@ -680,6 +971,133 @@ bool RestServer::handleAcceptInviteFriend(const http::request<http::string_body>
     return response;
 }
 
+// Runtime statistics for monitoring
+json RestServer::handleGetMetrics() {
+    json response;
+    try {
+        Storage& storage = Storage::getInstance();
+        response["storage"] = storage.backendName();
+        // The connection pools only exist with the Postgres backend
+        if (storage.backendName() == "postgres") {
+            PoolStats pool = DatabaseManager::getInstance().getPoolStats();
+            json poolJson;
+            poolJson["size"] = pool.size;
+            poolJson["max_size"] = pool.maxSize;
+            poolJson["idle"] = pool.idle;
+            poolJson["in_use"] = pool.inUse;
+            poolJson["waiting"] = pool.waiting;
+            poolJson["utilization"] = pool.maxSize == 0 ? 0.0 : static_cast<double>(pool.inUse) / pool.maxSize;
+            poolJson["acquired"] = pool.acquired;
+            poolJson["thread_cache_hits"] = pool.threadCacheHits;
+            poolJson["timeouts"] = pool.timeouts;
+            poolJson["replaced"] = pool.replaced;
+            poolJson["avg_wait_us"] = pool.acquired == 0 ? 0 : pool.totalWaitMicros / pool.acquired;
+            poolJson["max_wait_us"] = pool.maxWaitMicros;
+            response["db_pool"] = poolJson;
+
+            json replicas = json::array();
+            for (const PoolStats& replica : DatabaseManager::getInstance().getReplicaPoolStats()) {
+                json replicaJson;
+                replicaJson["size"] = replica.size;
+                replicaJson["in_use"] = replica.inUse;
+                replicaJson["waiting"] = replica.waiting;
+                replicaJson["acquired"] = replica.acquired;
+                replicaJson["timeouts"] = replica.timeouts;
+                replicas.push_back(replicaJson);
+            }
+            response["db_replicas"] = replicas;
+        }
+
+        UserDirectoryStats directory = UserDirectory::getInstance().stats();
+        json directoryJson;
+        directoryJson["size"] = directory.size;
+        directoryJson["capacity"] = directory.capacity;
+        directoryJson["hits"] = directory.hits;
+        directoryJson["misses"] = directory.misses;
+        directoryJson["evictions"] = directory.evictions;
+        directoryJson["invalidations"] = directory.invalidations;
+        response["user_directory"] = directoryJson;
+
+        RoomDirectoryStats rooms = RoomDirectory::getInstance().stats();
+        json roomsJson;
+        roomsJson["size"] = rooms.size;
+        roomsJson["hits"] = rooms.hits;
+        roomsJson["misses"] = rooms.misses;
+        response["room_directory"] = roomsJson;
+
+        RecentMessageCacheStats recent = RecentMessageCache::getInstance().stats();
+        json recentJson;
+        recentJson["rooms"] = recent.rooms;
+        recentJson["messages"] = recent.messages;
+        recentJson["bytes"] = recent.bytes;
+        recentJson["budget_bytes"] = recent.budgetBytes;
+        recentJson["hits"] = recent.hits;
+        recentJson["misses"] = recent.misses;
+        recentJson["hit_ratio"] = recent.hits + recent.misses == 0 ? 0.0
+            : static_cast<double>(recent.hits) / (recent.hits + recent.misses);
+        recentJson["evictions"] = recent.evictions;
+        response["recent_messages"] = recentJson;
+
+        json executors = json::object();
+        for (ThreadPool* pool : { &ioPool_, &dbPool_, &cpuPool_ }) {
+            ThreadPoolStats executor = pool->stats();
+            json executorJson;
+            executorJson["threads"] = executor.threads;
+            executorJson["max_threads"] = executor.maxThreads;
+            executorJson["max_queue"] = executor.maxQueueSize;
+            executorJson["queued"] = executor.queued;
+            executorJson["running"] = executor.running;
+            executorJson["submitted"] = executor.submitted;
+            executorJson["rejected"] = executor.rejected;
+            executorJson["completed"] = executor.completed;
+            executorJson["failed"] = executor.failed;
+            executorJson["avg_queue_wait_us"] = executor.completed == 0 ? 0 : executor.totalQueueWaitMicros / executor.completed;
+            executorJson["max_queue_wait_us"] = executor.maxQueueWaitMicros;
+            executorJson["avg_run_us"] = executor.completed == 0 ? 0 : executor.totalRunMicros / executor.completed;
+            executors[executor.name] = executorJson;
+        }
+        response["executors"] = executors;
+
+        if (capacity_ != nullptr) {
+            CapacityStats capacity = capacity_->stats();
+            json capacityJson;
+            json resources = json::object();
+            for (const CapacityResourceStats& resource : capacity.resources) {
+                json resourceJson;
+                resourceJson["size"] = resource.size;
+                resourceJson["min"] = resource.minSize;
+                resourceJson["max"] = resource.maxSize;
+                resourceJson["queue_wait_us"] = resource.queueWaitMicros;
+                resourceJson["acquire_wait_us"] = resource.acquireWaitMicros;
+                resourceJson["utilization"] = resource.utilization;
+                resourceJson["grows"] = resource.grows;
+                resourceJson["shrinks"] = resource.shrinks;
+                resources[resource.name] = resourceJson;
+            }
+            capacityJson["resources"] = resources;
+            json decisions = json::array();
+            for (const CapacityDecision& decision : capacity.decisions) {
+                json decisionJson;
+                decisionJson["resource"] = decision.resource;
+                decisionJson["from"] = decision.from;
+                decisionJson["to"] = decision.to;
+                decisionJson["reason"] = decision.reason;
+                decisionJson["at_ms"] = std::chrono::duration_cast<std::chrono::milliseconds>(
+                    decision.at.time_since_epoch()).count();
+                decisions.push_back(decisionJson);
+            }
+            capacityJson["decisions"] = decisions;
+            response["capacity"] = capacityJson;
+        }
+        response["status"] = "success";
+    }
+    catch (const std::exception& e) {
+        response["message"] = "Failed to retrieve metrics";
+        response["status"] = "error";
+    }
+    return response;
+}
+
 void RestServer::fail(beast::error_code ec, char const* what) {
     std::cerr << what << ": " << ec.message() << "\n";
 }
\ No newline at end of file
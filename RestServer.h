@@ -3,6 +3,9 @@
 #include <boost/beast/http.hpp>
 #include <boost/asio.hpp>
 #include "ThreadPool.h"
+#include "AsyncStorage.h"
+#include "CapacityController.h"
+#include "MessageJournal.h"
 #include <nlohmann/json.hpp> // For JSON handling
 #include <jwt-cpp/jwt.h> // For JWT handling
 
@@ -21,29 +24,43 @@ using json = nlohmann::json;
 
 class RestServer {
 public:
-    RestServer(net::io_context& ioc, tcp::endpoint endpoint, ThreadPool& threadPool);
+    // Requests are coroutines on the reactor threads. Database calls hop to dbPool (sized to the connection pool)
+    // and CPU-heavy work such as password hashing to cpuPool, so a slow database or a burst of logins cannot starve
+    // the other requests. ioPool and the capacity controller, when there is one, are only reported in the metrics.
+    // With a journal, a room whose messages are not all drained to Postgres yet is not loaded into the recent messages
+    RestServer(net::io_context& ioc, tcp::endpoint endpoint, ThreadPool& ioPool, ThreadPool& dbPool, ThreadPool& cpuPool,
+        MessageJournal* journal = nullptr, CapacityController* capacity = nullptr);
 
 private:
     void doAccept();
-    void handleRequest(std::shared_ptr<tcp::socket> socket);
+    net::awaitable<void> handleRequest(tcp::socket socket);
     void fail(beast::error_code ec, char const* what);
 
-    json handleLogin(const http::request<http::string_body>& req);
-    json handleRegister(const http::request<http::string_body>& req);
+    net::awaitable<json> handleLogin(const http::request<http::string_body>& req, AsyncStorage& db);
+    net::awaitable<json> handleRegister(const http::request<http::string_body>& req, AsyncStorage& db);
     json handleLogout(const http::request<http::string_body>& req);
     json handleGetUsers(const http::request<http::string_body>& req);
     json handleGetRooms(const http::request<http::string_body>& req);
-    json handleGetMessages(const http::request<http::string_body>& req, const std::string& roomId);
+    net::awaitable<json> handleGetMessages(const http::request<http::string_body>& req, AsyncStorage& db,
+        const std::string& roomId, const std::string& query);
+    json handleSearchMessages(const http::request<http::string_body>& req, const std::string& query);
     json handleInviteFriend(const http::request<http::string_body>& req);
     json handleGetFriend(const http::request<http::string_body>& req);
     json handleGetPendingInvitedFriend(const http::request<http::string_body>& req);
     json handleGetFriendIniviteRequest(const http::request<http::string_body>& req);
-    bool handleAcceptInviteFriend(const http::request<http::string_body>& req);
+    json handleAcceptInviteFriend(const http::request<http::string_body>& req);
+    json handleGetMetrics();
 
     bool isTokenValid(const std::string& token, std::string& email);
+    // Run a whole handler on the db executor, a busy response when its queue is full
+    net::awaitable<json> runHandlerOnDbPool(AsyncStorage& db, std::function<json()> handler);
 
     tcp::acceptor acceptor_;
-    ThreadPool& threadPool_;
+    ThreadPool& ioPool_;
+    ThreadPool& dbPool_;
+    ThreadPool& cpuPool_;
+    MessageJournal* journal_;
+    CapacityController* capacity_;
 };
 
 
@@ -0,0 +1,75 @@
+#include "RoomDirectory.h"
+#include "Utils.h"
+#include <algorithm>
+
+/*
+    The RoomDirectory class is a singleton map from a normalized pair of users to their 1:1 room id.
+*/
+
+std::unique_ptr<RoomDirectory> RoomDirectory::instance_ = nullptr;
+std::once_flag RoomDirectory::initInstanceFlag;
+
+RoomDirectory& RoomDirectory::getInstance() {
+    std::call_once(initInstanceFlag, []() {
+        instance_ = std::unique_ptr<RoomDirectory>(new RoomDirectory());
+    });
+    return *instance_;
+}
+
+RoomDirectory::RoomDirectory()
+    : maxRoomsPerShard_(Utils::getEnvSize("CHAT_ROOM_CACHE_SIZE", 262144) / kShardCount + 1) {
+}
+
+// (min, max) packed in one integer, the same key whichever user sends
+uint64_t RoomDirectory::pairKey(int userId1, int userId2) {
+    auto low = static_cast<uint32_t>(std::min(userId1, userId2));
+    auto high = static_cast<uint32_t>(std::max(userId1, userId2));
+    return (static_cast<uint64_t>(low) << 32) | high;
+}
+
+RoomDirectory::Shard& RoomDirectory::shardFor(uint64_t key) {
+    // Mix both halves so pairs sharing a user spread over the shards
+    return shards_[((key >> 32) ^ (key * 0x9E3779B97F4A7C15ull >> 40)) % kShardCount];
+}
+
+std::optional<int> RoomDirectory::find(int userId1, int userId2) {
+    uint64_t key = pairKey(userId1, userId2);
+    Shard& shard = shardFor(key);
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    auto it = shard.rooms.find(key);
+    if (it == shard.rooms.end()) {
+        misses_.fetch_add(1, std::memory_order_relaxed);
+        return std::nullopt;
+    }
+    hits_.fetch_add(1, std::memory_order_relaxed);
+    return it->second;
+}
+
+void RoomDirectory::insert(int userId1, int userId2, int roomId) {
+    uint64_t key = pairKey(userId1, userId2);
+    Shard& shard = shardFor(key);
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    if (shard.rooms.size() >= maxRoomsPerShard_ && shard.rooms.count(key) == 0) {
+        // Full, drop an arbitrary pair, it is loaded again on its next miss
+        shard.rooms.erase(shard.rooms.begin());
+    }
+    shard.rooms[key] = roomId;
+}
+
+void RoomDirectory::erase(int userId1, int userId2) {
+    uint64_t key = pairKey(userId1, userId2);
+    Shard& shard = shardFor(key);
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    shard.rooms.erase(key);
+}
+
+RoomDirectoryStats RoomDirectory::stats() {
+    RoomDirectoryStats snapshot;
+    for (auto& shard : shards_) {
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        snapshot.size += shard.rooms.size();
+    }
+    snapshot.hits = hits_.load(std::memory_order_relaxed);
+    snapshot.misses = misses_.load(std::memory_order_relaxed);
+    return snapshot;
+}
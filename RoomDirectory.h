@@ -0,0 +1,61 @@
+#pragma once
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <unordered_map>
+
+#ifndef ROOMDIRECTORY_H
+#define ROOMDIRECTORY_H
+
+/*
+    The RoomDirectory class is a singleton map from a pair of users to their 1:1 room id.
+    The pair is normalized to (min id, max id) so both directions share one entry. Membership of a pair almost never
+    changes once the room exists, so entries are filled on the first miss and by updateFriendRequest, and are only
+    dropped when the shard is full or a write against the room fails.
+*/
+
+struct RoomDirectoryStats {
+    size_t size = 0;
+    uint64_t hits = 0;
+    uint64_t misses = 0;
+};
+
+class RoomDirectory {
+public:
+    static RoomDirectory& getInstance();
+
+    std::optional<int> find(int userId1, int userId2);
+    void insert(int userId1, int userId2, int roomId);
+    void erase(int userId1, int userId2);
+    RoomDirectoryStats stats();
+
+    ~RoomDirectory() = default;
+
+private:
+    RoomDirectory();
+    RoomDirectory(const RoomDirectory&) = delete;
+    RoomDirectory& operator=(const RoomDirectory&) = delete;
+
+    struct Shard {
+        std::mutex mutex;
+        std::unordered_map<uint64_t, int> rooms;
+    };
+
+    static constexpr size_t kShardCount = 16;
+
+    static uint64_t pairKey(int userId1, int userId2);
+    Shard& shardFor(uint64_t key);
+
+    std::array<Shard, kShardCount> shards_;
+    size_t maxRoomsPerShard_;
+    std::atomic<uint64_t> hits_{ 0 };
+    std::atomic<uint64_t> misses_{ 0 };
+
+    static std::unique_ptr<RoomDirectory> instance_;
+    static std::once_flag initInstanceFlag;
+};
+
+#endif //ROOMDIRECTORY_H
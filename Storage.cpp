@@ -0,0 +1,30 @@
+#include "Storage.h"
+#include "DatabaseManager.h"
+#include "MemoryStorage.h"
+#include "Utils.h"
+#include <iostream>
+
+/*
+    Selection of the storage backend. The Postgres backend is the DatabaseManager singleton itself,
+    which is only created (and connected) when it is selected.
+*/
+
+Storage* Storage::instance_ = nullptr;
+std::unique_ptr<Storage> Storage::memoryInstance_ = nullptr;
+std::once_flag Storage::initInstanceFlag;
+
+Storage& Storage::getInstance() {
+    std::call_once(initInstanceFlag, []() {
+        std::string backend = Utils::getEnv("CHAT_STORAGE", "postgres");
+        if (backend == "memory") {
+            memoryInstance_ = std::make_unique<MemoryStorage>();
+            instance_ = memoryInstance_.get();
+            return;
+        }
+        if (backend != "postgres") {
+            std::cerr << "Unknown CHAT_STORAGE " << backend << ", using postgres\n";
+        }
+        instance_ = &DatabaseManager::getInstance();
+    });
+    return *instance_;
+}
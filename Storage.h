@@ -0,0 +1,74 @@
+#pragma once
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <vector>
+#include "Models.h"
+
+#ifndef STORAGE_H
+#define STORAGE_H
+
+/*
+    The Storage class is the interface of the data operations the servers use: users, credentials, friendships,
+    rooms and messages. DatabaseManager implements it over Postgres, MemoryStorage keeps everything in process
+    memory so the network and fan-out layers can be load-tested and profiled without a database.
+    The backend is chosen once at startup with CHAT_STORAGE (postgres or memory), postgres by default.
+    Postgres-specific operations (raw queries, pipelines, NOTIFY, partitions, pool statistics) stay on DatabaseManager.
+*/
+
+class Storage {
+public:
+    // The backend selected by CHAT_STORAGE
+    static Storage& getInstance();
+    virtual ~Storage() = default;
+
+    // "postgres" or "memory"
+    virtual std::string backendName() const = 0;
+
+    virtual ResultView<UserView> getUsers() = 0;
+    virtual std::optional<User> getUserByEmail(const std::string& email) = 0;
+    virtual std::optional<User> getUserById(int userId) = 0;
+    virtual bool emailExists(const std::string& email) = 0;
+    virtual bool registerUser(const std::string& email, const std::string& passwordHash) = 0;
+    virtual std::string getPasswordHash(const std::string& email) = 0;
+    virtual bool updatePasswordHash(const std::string& email, const std::string& passwordHash) = 0;
+    // Mark a user online after a successful login and store the upgraded hash if there is one
+    virtual bool recordLogin(const std::string& email, const std::string& upgradedPasswordHash) = 0;
+    virtual bool updateUserStatus(const std::string& email, const std::string& status) = 0;
+    virtual bool invalidateToken(const std::string& token) = 0;
+    virtual std::vector<std::string> getRevokedTokens() = 0;
+
+    virtual std::optional<FriendEdge> updateFriendRequest(const int userId, const int friendId) = 0;
+    virtual ResultView<UserView> getFriendRequests(const int userId) = 0;
+    virtual ResultView<UserView> getFriends(const int userId) = 0;
+    virtual ResultView<UserView> getFriendRequestPending(const int userId) = 0;
+
+    virtual std::vector<Room> getRoomsByUserId(int userId) = 0;
+    virtual std::optional<Room> getRoomById(int roomId) = 0;
+    virtual std::optional<Room> getRoomByUserIds(int userId1, int userId2) = 0;
+    virtual std::optional<int> getRoomIdByUserIds(int userId1, int userId2) = 0;
+    virtual bool updateLastMessageAt(int roomId) = 0;
+
+    // Messages of the room created in [fromMs, toMs), epoch milliseconds
+    virtual ResultView<MessageView> getMessages(int roomId, int64_t fromMs, int64_t toMs) = 0;
+    virtual bool saveMessage(int roomId, int senderId, const std::string& content) = 0;
+    // Store a message in the room of the two users and bump the room's last message time
+    virtual std::optional<Message> sendMessage(int senderId, int recipientId, const std::string& content) = 0;
+    // Resolve sender and recipient and store the message
+    virtual std::optional<SentMessage> sendMessage(const std::string& senderEmail, int recipientId, const std::string& content) = 0;
+    // Insert the entries drained from the MessageJournal, skipping the ones already stored (by journal id).
+    // stored gets the messages inserted by this call, with their id and journal id
+    virtual bool storeJournaledMessages(const std::vector<JournalEntry>& entries, std::vector<Message>& stored) = 0;
+    virtual bool updateMessageStatus(int messageId, int userId, const std::string& status) = 0;
+    // Messages of the user's rooms matching the search text, newest first, starting after `after`
+    virtual MessageSearchPage searchMessages(int userId, const std::string& text,
+        const std::optional<MessageSearchCursor>& after, size_t limit) = 0;
+
+private:
+    static Storage* instance_;
+    static std::unique_ptr<Storage> memoryInstance_;
+    static std::once_flag initInstanceFlag;
+};
+
+#endif //STORAGE_H
@@ -0,0 +1,118 @@
+#pragma once
+#include <cstddef>
+#include <memory>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+#ifndef TASK_H
+#define TASK_H
+
+/*
+    The Task class is the unit of work of ThreadPool: a move-only, type-erased void() callable.
+    Unlike std::function it accepts move-only captures (promises, unique_ptrs, sockets), and it stores callables of up
+    to kInlineSize bytes (a `this`, a couple of shared_ptrs and a std::function fit) inline, so wrapping our lambdas
+    does not allocate. Larger or over-aligned callables, or ones that may throw when moved, are put on the heap.
+*/
+
+class Task {
+public:
+    static constexpr size_t kInlineSize = 64;
+
+    Task() noexcept = default;
+
+    template <typename F, typename Callable = std::decay_t<F>,
+        typename = std::enable_if_t<!std::is_same_v<Callable, Task> && std::is_invocable_v<Callable&>>>
+    Task(F&& function) {
+        if constexpr (fitsInline<Callable>()) {
+            ::new (static_cast<void*>(&storage_)) Callable(std::forward<F>(function));
+            operations_ = &inlineOperations<Callable>;
+        }
+        else {
+            ::new (static_cast<void*>(&storage_)) Callable*(new Callable(std::forward<F>(function)));
+            operations_ = &heapOperations<Callable>;
+        }
+    }
+
+    Task(Task&& other) noexcept {
+        moveFrom(other);
+    }
+
+    Task& operator=(Task&& other) noexcept {
+        if (this != &other) {
+            reset();
+            moveFrom(other);
+        }
+        return *this;
+    }
+
+    Task(const Task&) = delete;
+    Task& operator=(const Task&) = delete;
+
+    ~Task() {
+        reset();
+    }
+
+    void operator()() {
+        operations_->invoke(&storage_);
+    }
+
+    explicit operator bool() const noexcept {
+        return operations_ != nullptr;
+    }
+
+    // Destroy the callable (and what it captured) now, the task is empty afterwards
+    void reset() noexcept {
+        if (operations_ != nullptr) {
+            operations_->destroy(&storage_);
+            operations_ = nullptr;
+        }
+    }
+
+private:
+    struct Operations {
+        void (*invoke)(void* storage);
+        // Move the callable from source to destination storage and destroy the source
+        void (*relocate)(void* destination, void* source) noexcept;
+        void (*destroy)(void* storage) noexcept;
+    };
+
+    template <typename Callable>
+    static constexpr bool fitsInline() {
+        return sizeof(Callable) <= kInlineSize && alignof(Callable) <= alignof(std::max_align_t)
+            && std::is_nothrow_move_constructible_v<Callable>;
+    }
+
+    template <typename Callable>
+    static constexpr Operations inlineOperations = {
+        [](void* storage) { (*static_cast<Callable*>(storage))(); },
+        [](void* destination, void* source) noexcept {
+            auto* callable = static_cast<Callable*>(source);
+            ::new (destination) Callable(std::move(*callable));
+            callable->~Callable();
+        },
+        [](void* storage) noexcept { static_cast<Callable*>(storage)->~Callable(); },
+    };
+
+    template <typename Callable>
+    static constexpr Operations heapOperations = {
+        [](void* storage) { (**static_cast<Callable**>(storage))(); },
+        [](void* destination, void* source) noexcept {
+            ::new (destination) Callable*(*static_cast<Callable**>(source));
+        },
+        [](void* storage) noexcept { delete *static_cast<Callable**>(storage); },
+    };
+
+    void moveFrom(Task& other) noexcept {
+        if (other.operations_ != nullptr) {
+            other.operations_->relocate(&storage_, &other.storage_);
+            operations_ = other.operations_;
+            other.operations_ = nullptr;
+        }
+    }
+
+    alignas(std::max_align_t) std::byte storage_[kInlineSize];
+    const Operations* operations_ = nullptr;
+};
+
+#endif //TASK_H
@@ -0,0 +1,114 @@
+#pragma once
+#include <atomic>
+#include <cstdint>
+#include <exception>
+#include <memory>
+#include <optional>
+#include <utility>
+
+#ifndef TASKFUTURE_H
+#define TASKFUTURE_H
+
+/*
+    Results of the tasks submitted to a ThreadPool.
+    A TaskResult holds either the value returned by the task or the exception it threw; get() returns the value or
+    rethrows the exception. A TaskFuture is the consumer side of one submitted task: a shared state with the result
+    and a ready flag the consumer waits on with std::atomic::wait, no mutex nor condition variable.
+*/
+
+template <typename T>
+class TaskResult {
+public:
+    explicit TaskResult(T value) : value_(std::move(value)) {}
+    explicit TaskResult(std::exception_ptr error) : error_(std::move(error)) {}
+
+    bool ok() const { return !error_; }
+    const std::exception_ptr& error() const { return error_; }
+
+    // The value, or the task's exception rethrown
+    T get() {
+        if (error_) {
+            std::rethrow_exception(error_);
+        }
+        return std::move(*value_);
+    }
+
+private:
+    std::optional<T> value_;
+    std::exception_ptr error_;
+};
+
+template <>
+class TaskResult<void> {
+public:
+    TaskResult() = default;
+    explicit TaskResult(std::exception_ptr error) : error_(std::move(error)) {}
+
+    bool ok() const { return !error_; }
+    const std::exception_ptr& error() const { return error_; }
+
+    void get() {
+        if (error_) {
+            std::rethrow_exception(error_);
+        }
+    }
+
+private:
+    std::exception_ptr error_;
+};
+
+// Run a callable and capture what it returned or threw
+template <typename R, typename F>
+TaskResult<R> runCapturingResult(F& function) {
+    try {
+        if constexpr (std::is_void_v<R>) {
+            function();
+            return TaskResult<void>();
+        }
+        else {
+            return TaskResult<R>(function());
+        }
+    }
+    catch (...) {
+        return TaskResult<R>(std::current_exception());
+    }
+}
+
+template <typename T>
+class TaskFuture {
+public:
+    struct State {
+        std::atomic<uint32_t> ready{ 0 };
+        std::optional<TaskResult<T>> result;
+
+        void complete(TaskResult<T> value) {
+            result.emplace(std::move(value));
+            ready.store(1, std::memory_order_release);
+            ready.notify_all();
+        }
+    };
+
+    TaskFuture() = default;
+    explicit TaskFuture(std::shared_ptr<State> state) : state_(std::move(state)) {}
+
+    bool valid() const { return state_ != nullptr; }
+    bool ready() const { return state_->ready.load(std::memory_order_acquire) != 0; }
+
+    void wait() const {
+        while (state_->ready.load(std::memory_order_acquire) == 0) {
+            state_->ready.wait(0, std::memory_order_acquire);
+        }
+    }
+
+    // Wait for the task, then return its value or rethrow its exception. Once only
+    T get() {
+        wait();
+        std::shared_ptr<State> state = std::move(state_);
+        return state->result->get();
+    }
+
+private:
+    std::shared_ptr<State> state_;
+};
+
+#endif //TASKFUTURE_H
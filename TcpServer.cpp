@@ -1,9 +1,14 @@
 #include "TcpServer.h"
+#include <algorithm>
 #include <boost/asio.hpp>
+#include <iterator>
 #include <iostream>
 #include <memory>
-#include <jwt-cpp/jwt.h>
 #include "DatabaseManager.h"
+#include "TokenValidator.h"
+#include "RecentMessageCache.h"
+#include "RoomDirectory.h"
+#include "UserDirectory.h"
 
 /*
     The TcpServer class is responsible for handling TCP/IP connections.
@@ -13,10 +18,14 @@
 
 
 // Constructor to initialize the acceptor and socket
-TcpServer::TcpServer(boost::asio::io_context& io_context, short port, ThreadPool& threadPool)
-    : acceptor_(io_context, tcp::endpoint(tcp::v4(), port)), threadPool_(threadPool) {
-   	// Create a new socket
-    socket_ = std::make_shared<tcp::socket>(io_context);
+TcpServer::TcpServer(boost::asio::io_context& io_context, short port, ThreadPool& ioPool, ThreadPool& dbPool, MessageBus& messageBus,
+    const HashRing& ring, MessageJournal* journal)
+    : acceptor_(io_context, tcp::endpoint(tcp::v4(), port)), ioPool_(ioPool), dbPool_(dbPool), messageBus_(messageBus), ring_(ring),
+      journal_(journal) {
+    // Deliveries published by other nodes for the users held here, never published again
+    messageBus_.setDeliveryHandler([this](const std::string& email, const std::string& message) {
+        deliverLocally(email, std::make_shared<const std::string>(message));
+    });
     // Start accepting incoming connections
     doAccept();
 }
@@ -25,64 +34,69 @@ void TcpServer::doAccept() {
     // 'async_accept' is used to accept a new connection from a client.
     // When a client tries to connect to the server,
     // async_accept will accept the connection and provide a socket to communicate with the client.
-    acceptor_.async_accept(*socket_,
-        [this](boost::system::error_code ec) {
+    acceptor_.async_accept(
+        [this](boost::system::error_code ec, tcp::socket socket) {
             if (!ec) {
-                // Enqueue the task to handle the client connection if there is no error
-                threadPool_.enqueueTask([this]() mutable {
-                    handleClient(socket_);
-                    });
+                // The session reads its frames on its strand and processes them on the io executor
+                auto session = std::make_shared<ClientSession>(std::move(socket));
+                session->start([this](const std::shared_ptr<ClientSession>& session, const char* data, size_t length,
+                        size_t capacity) {
+                    return handleFrame(session, data, length, capacity);
+                }, [this](const std::shared_ptr<ClientSession>& session) {
+                    removeSession(session);
+                });
             }
             // Continue to accept new connections
             doAccept();
         });
 }
 
-void TcpServer::handleClient(std::shared_ptr<tcp::socket> socket) {
-    try {
-        for (;;) {
-         	 // Read data from the socket
-            char data[1024];
-            boost::system::error_code error;
-            size_t length = socket->read_some(boost::asio::buffer(data), error);
-            if (error == boost::asio::error::eof) break; // Connection closed cleanly by peer.
-            else if (error) throw boost::system::system_error(error); // Some other error.
-
-            // Process the received message
-            std::string message(data, length);
-            processMessage(message, socket);
-        }
-    }
-    catch (std::exception& e) {
-        std::cerr << "Exception in thread: " << e.what() << "\n";
+net::awaitable<void> TcpServer::handleFrame(std::shared_ptr<ClientSession> session, const char* data, size_t length,
+    size_t capacity) {
+    // Parse the received frame once, in place thanks to the padding of the session buffer, then process it
+    ChatFrame frame;
+    if (!RequestParser::parseChatFrame(data, length, capacity, frame)) {
+        std::cerr << "Failed to process message: invalid frame\n";
+        co_return;
     }
+    co_await processMessage(frame, session);
 }
 
-void TcpServer::processMessage(const std::string& message, std::shared_ptr<tcp::socket> socket) {
+net::awaitable<void> TcpServer::processMessage(const ChatFrame& frame, std::shared_ptr<ClientSession> session) {
     try {
-        json jsonMessage = json::parse(message);
-        std::string type = jsonMessage["type"];
-
-        if (type == "connect") {
-            handleConnect(jsonMessage, socket);
-        }
-        else if (type == "disconnect") {
-            handleDisconnect(jsonMessage, socket);
-        }
-        else if (type == "message") {
-            handleMessage(jsonMessage, socket);
-        }
-        else if (type == "typing") {
-            handleTyping(jsonMessage, socket);
-        }
-        else if (type == "stopTyping") {
-            handleStopTyping(jsonMessage, socket);
-        }
-        else if (type == "userStatus") {
-            handleUserStatus(jsonMessage, socket);
-        }
-        else if (type == "messageReceipt") {
-            handleMessageReceipt(jsonMessage, socket);
+        // The frame token identifies the client session, reads made for it see its own writes.
+        // This runs on the session's strand, the handlers that wait on the database or the directories hop
+        AsyncStorage db(dbPool_, frame.token);
+        switch (frame.type) {
+        case FrameType::Connect:
+            // The home node lookup and the bus subscription may wait on the database
+            if (!co_await db.tryRun([&](Storage&) { handleConnect(frame, session); })) {
+                sendBusy(session);
+            }
+            break;
+        case FrameType::Disconnect:
+            // Never shed, the connected clients would be left with a dead socket
+            co_await db.run([&](Storage&) { handleDisconnect(frame, session); });
+            break;
+        case FrameType::Message:
+            co_await handleMessage(frame, session, db);
+            break;
+        case FrameType::Typing:
+            co_await handleTyping(frame, session, db);
+            break;
+        case FrameType::StopTyping:
+            co_await handleStopTyping(frame, session, db);
+            break;
+        case FrameType::UserStatus:
+            if (!co_await db.tryRun([&](Storage&) { handleUserStatus(frame, session); })) {
+                sendBusy(session);
+            }
+            break;
+        case FrameType::MessageReceipt:
+            handleMessageReceipt(frame, session);
+            break;
+        case FrameType::Unknown:
+            break;
         }
     }
     catch (const std::exception& e) {
@@ -90,271 +104,425 @@ void TcpServer::processMessage(const std::string& message, std::shared_ptr<tcp::
     }
 }
 
-void TcpServer::handleConnect(const json& message, std::shared_ptr<tcp::socket> socket) {
+void TcpServer::sendBusy(const std::shared_ptr<ClientSession>& session) {
+    json busy;
+    busy["type"] = "error";
+    busy["message"] = "Server is busy, please retry";
+    busy["retry_after"] = 1;
+    session->send(std::make_shared<const std::string>(busy.dump()));
+}
+
+void TcpServer::sendNotStored(const std::shared_ptr<ClientSession>& session) {
+    json refused;
+    refused["type"] = "error";
+    refused["message"] = "Message could not be stored, please retry";
+    session->send(std::make_shared<const std::string>(refused.dump()));
+}
+
+void TcpServer::handleConnect(const ChatFrame& frame, std::shared_ptr<ClientSession> session) {
     try {
-        std::string token = message["token"];
         std::string email;
-        if (!isTokenValid(token, email)) {
+        if (!isTokenValid(frame.token, email)) {
             std::cerr << "Invalid token. Closing connection.\n";
-            socket->close();
+            session->close();
             return;
         }
 
+        // A user is served by its home node, send the client there instead of splitting its sockets across nodes
+        if (ring_.enabled()) {
+            std::optional<User> user = Storage::getInstance().getUserByEmail(email);
+            if (user && !ring_.isLocal(user->id)) {
+                const ClusterNode& home = ring_.homeOf(user->id);
+                json redirect;
+                redirect["type"] = "redirect";
+                redirect["node"] = home.id;
+                redirect["address"] = home.address;
+                session->send(std::make_shared<const std::string>(redirect.dump()));
+                session->close();
+                return;
+            }
+        }
+
         // Add client to the list of connected clients
         {
             std::lock_guard<std::mutex> lock(clientsMutex_);
-            clients_[email].push_back(socket);
+            auto& sockets = clients_[email];
+            // This node now holds the user, receive the deliveries other nodes publish for it. Under the lock, so a
+            // concurrent close of the last socket cannot unsubscribe before this subscribes
+            if (sockets.empty()) {
+                messageBus_.subscribe(email);
+            }
+            sockets.push_back(session);
+            sessionEmails_[session.get()] = email;
+        }
+        // The socket may have dropped while connecting, after its close handler found nothing to remove
+        if (!session->isOpen()) {
+            removeSession(session);
+            return;
         }
 
         // Handle client connection
-        std::cout << "Client connected: " << message["username"] << "\n";
+        std::cout << "Client connected: " << frame.username << "\n";
     }
     catch (const std::exception& e) {
         std::cerr << "Failed to handle connect: " << e.what() << "\n";
-        socket->close();
+        session->close();
     }
 }
 
-void TcpServer::handleDisconnect(const json& message, std::shared_ptr<tcp::socket> socket) {
+void TcpServer::handleDisconnect(const ChatFrame& frame, std::shared_ptr<ClientSession> session) {
     std::string email;
-    if (!isTokenValid(message["token"], email)) {
+    if (!isTokenValid(frame.token, email)) {
         std::cerr << "Invalid token. Closing connection.\n";
-        socket->close();
+        session->close();
         return;
     }
 
     // Handle client disconnection
-    std::cout << "Client disconnected: " << message["username"] << "\n";
-
-    // Remove client from the list of connected clients
-    {
-        std::lock_guard<std::mutex> lock(clientsMutex_);
-        auto& sockets = clients_[email];
-        sockets.erase(std::remove(sockets.begin(), sockets.end(), socket), sockets.end());
-        if (sockets.empty()) {
-            clients_.erase(email);
-
-
-            DatabaseManager& dbManager = DatabaseManager::getInstance();
-
-			std::vector<std::string> user = dbManager.getUserByEmail(email);
-			std::string userId = user[0];
-
-
-			json userStatusMessage;
-			userStatusMessage["type"] = "userStatus";
-			userStatusMessage["user_id"] = userId;
-			userStatusMessage["user_status"] = "offline";
-
-            dbManager.updateUserStatus(email, message["user_status"]);
+    std::cout << "Client disconnected: " << frame.username << "\n";
 
-            std::vector<std::string> user = dbManager.getUserByEmail(email);
-            std::string userId = user[0];
+    // Remove client from the list of connected clients.
+    // The user went offline once the last socket is gone, tell the friends.
+    // This runs outside clientsMutex_ since sendMessageToMultipleClients takes it again.
+    if (removeSession(session)) {
+        Storage& storage = Storage::getInstance();
+        storage.updateUserStatus(email, "offline");
 
+        std::optional<User> user = storage.getUserByEmail(email);
+        if (!user) {
+            return;
+        }
 
-            // Get the user's friends
-            std::vector<std::vector<std::string>> friends = dbManager.getFriends(std::stoi(userId));
-
-            std::vector<std::string> friendEmails;
-
-            for (auto& friend_ : friends) {
-                friendEmails.push_back(friend_[2]);
-            }
+        json userStatusMessage;
+        userStatusMessage["type"] = "userStatus";
+        userStatusMessage["user_id"] = user->id;
+        userStatusMessage["user_status"] = "offline";
 
-            // Broadcast the user status update to all clients
-            sendMessageToMultipleClients(friendEmails, userStatusMessage.dump());
+        // Get the user's friends
+        std::vector<std::string> friendEmails;
+        for (const auto& friend_ : storage.getFriends(user->id)) {
+            friendEmails.emplace_back(friend_.email);
         }
+
+        // Broadcast the user status update to all clients
+        sendMessageToMultipleClients(friendEmails, userStatusMessage.dump());
     }
 }
 
-void TcpServer::handleMessage(const json& message, std::shared_ptr<tcp::socket> socket) {
-    std::string token = message["token"];
+net::awaitable<void> TcpServer::handleMessage(const ChatFrame& frame, std::shared_ptr<ClientSession> session, AsyncStorage& db) {
     std::string email;
-    if (!isTokenValid(token, email)) {
+    if (!isTokenValid(frame.token, email)) {
         std::cerr << "Invalid token. Closing connection.\n";
-        socket->close();
-        return;
+        session->close();
+        co_return;
     }
 
     // Handle message sending/receiving
-    DatabaseManager& dbManager = DatabaseManager::getInstance();
-    std::vector<std::string> user = dbManager.getUserByEmail(email);
-    std::string userId = user[0];
-    std::string recipientId = message["recipient"];
-    std::vector<std::string> room = dbManager.getRoomByUserIds(std::stoi(userId), std::stoi(recipientId));
-    std::string roomId = room[0];
+    // Sender, recipient and room come from the in-memory directories, storing the message is the only round trip
+    json ack;
+    ack["type"] = "ack";
+    json outbound;
+    std::optional<User> recipient;
+
+    if (journal_ != nullptr) {
+        // Acknowledged once on local disk, the journal stores it in Postgres in the background.
+        // The directories are read on the io executor, so with warm directories this path is not shed with the
+        // database, then the coroutine is suspended until the journal flushed the message
+        std::optional<User> sender;
+        std::optional<int> roomId;
+        if (!co_await tryRunOn(ioPool_, [&]() {
+                UserDirectory& users = UserDirectory::getInstance();
+                sender = users.findByEmail(email);
+                roomId = sender ? RoomDirectory::getInstance().find(sender->id, frame.recipientId) : std::nullopt;
+                recipient = users.findById(frame.recipientId);
+            })) {
+            sendBusy(session);
+            co_return;
+        }
+        // A miss loads from the database on the db executor, so a slow database never holds the io threads
+        if (!sender || !roomId || !recipient) {
+            if (!co_await db.tryRun([&](Storage& storage) {
+                    if (!sender) {
+                        sender = storage.getUserByEmail(email);
+                    }
+                    if (sender && !roomId) {
+                        roomId = storage.getRoomIdByUserIds(sender->id, frame.recipientId);
+                    }
+                    if (!recipient) {
+                        recipient = storage.getUserById(frame.recipientId);
+                    }
+                })) {
+                sendBusy(session);
+                co_return;
+            }
+        }
+        if (!roomId) {
+            std::cerr << "Failed to resolve the room of the message.\n";
+            sendNotStored(session);
+            co_return;
+        }
+        JournalEntry entry;
+        try {
+            entry = co_await appendToJournal(*roomId, sender->id, frame.content);
+        }
+        catch (const std::exception& e) {
+            // Not acknowledged, e.g. the disk is full; the client can send it again
+            std::cerr << "Failed to journal the message: " << e.what() << "\n";
+            sendNotStored(session);
+            co_return;
+        }
+
+        ack["journal_id"] = entry.id;
+        ack["room_id"] = entry.roomId;
+        ack["created_at"] = entry.createdAt;
+        outbound["sender_id"] = sender->id;
+        outbound["room_id"] = entry.roomId;
+        outbound["journal_id"] = entry.id;
+        outbound["created_at"] = entry.createdAt;
+    }
+    else {
+        // Storing the message directly waits on the database
+        std::optional<SentMessage> sent;
+        if (!co_await db.tryRun([&](Storage& storage) { sent = storage.sendMessage(email, frame.recipientId, frame.content); })) {
+            sendBusy(session);
+            co_return;
+        }
+        if (!sent) {
+            std::cerr << "Failed to save message to the database.\n";
+            sendNotStored(session);
+            co_return;
+        }
+        recipient = std::move(sent->recipient);
+        RecentMessageCache::getInstance().append(sent->message);
+
+        ack["message_id"] = sent->message.id;
+        ack["room_id"] = sent->message.roomId;
+        ack["created_at"] = sent->message.createdAt;
+        outbound["sender_id"] = sent->sender.id;
+        outbound["room_id"] = sent->message.roomId;
+        outbound["message_id"] = sent->message.id;
+        outbound["created_at"] = sent->message.createdAt;
+    }
 
-    bool rs = dbManager.saveMessage(std::stoi(roomId), std::stoi(userId), message["content"]);
+    // Tell the sender its message is safe, then send it to the clients in the same room.
+    // The sender's token is never forwarded
+    session->send(std::make_shared<const std::string>(ack.dump()));
 
-    if (!rs) {
-        std::cerr << "Failed to save message to the database.\n";
-        return;
+    outbound["type"] = "message";
+    outbound["sender"] = email;
+    outbound["recipient"] = frame.recipientId;
+    outbound["content"] = frame.content;
+    if (recipient) {
+        sendMessageToClient(recipient->email, outbound.dump());
     }
+}
 
-    // Send the message to the clients in the same room
-    std::string recipientEmail = dbManager.getUserById(std::stoi(recipientId))[2];
-    sendMessageToClient(recipientEmail, message.dump());
+net::awaitable<bool> TcpServer::tryFindUser(int userId, AsyncStorage& db, std::optional<User>& user) {
+    if (!co_await tryRunOn(ioPool_, [&]() { user = UserDirectory::getInstance().findById(userId); })) {
+        co_return false;
+    }
+    if (user) {
+        co_return true;
+    }
+    co_return co_await db.tryRun([&](Storage& storage) { user = storage.getUserById(userId); });
 }
 
-void TcpServer::handleTyping(const json& message, std::shared_ptr<tcp::socket> socket) {
-    std::string token = message["token"];
+net::awaitable<JournalEntry> TcpServer::appendToJournal(int roomId, int senderId, const std::string& content) {
+    co_return co_await net::async_initiate<const net::use_awaitable_t<>&, void(std::exception_ptr, JournalEntry)>(
+        [this, roomId, senderId, &content](auto handler) {
+            // Shared since the journal's callback is a std::function, which must be copyable
+            auto pending = std::make_shared<decltype(handler)>(std::move(handler));
+            journal_->appendAsync(roomId, senderId, content, [pending](std::exception_ptr error, JournalEntry entry) {
+                // Called on the journal's sync thread. The cached copy is added here, before the drain may store
+                // the message and hand its id to the cache, then the coroutine resumes on its own executor
+                if (!error) {
+                    RecentMessageCache::getInstance().append(
+                        Message{ 0, entry.roomId, entry.senderId, entry.content, false, entry.createdAt, entry.id });
+                }
+                auto executor = net::get_associated_executor(*pending);
+                net::post(executor, [pending, error, entry = std::move(entry)]() mutable {
+                    std::move(*pending)(error, std::move(entry));
+                });
+            });
+        },
+        net::use_awaitable);
+}
+
+net::awaitable<void> TcpServer::handleTyping(const ChatFrame& frame, std::shared_ptr<ClientSession> session, AsyncStorage& db) {
     std::string email;
-    if (!isTokenValid(token, email)) {
+    if (!isTokenValid(frame.token, email)) {
         std::cerr << "Invalid token. Closing connection.\n";
-        socket->close();
-        return;
+        session->close();
+        co_return;
     }
 
-    std::string recipientId = message["recipient"];
+    // Handle typing status, disposable: dropped when the lookup of the recipient is shed
+    std::optional<User> recipient;
+    if (!co_await tryFindUser(frame.recipientId, db, recipient) || !recipient) {
+        co_return;
+    }
 
-    // Handle typing status
-    DatabaseManager& dbManager = DatabaseManager::getInstance();
-    std::string recipientEmail = dbManager.getUserById(std::stoi(recipientId))[2];
+    json outbound;
+    outbound["type"] = "typing";
+    outbound["sender"] = email;
+    outbound["recipient"] = frame.recipientId;
 
     // Send the typing status to the clients in the same room
-    sendMessageToClient(recipientEmail, message.dump());
+    sendMessageToClient(recipient->email, outbound.dump());
 }
 
-void TcpServer::handleStopTyping(const json& message, std::shared_ptr<tcp::socket> socket) {
-    std::string token = message["token"];
+net::awaitable<void> TcpServer::handleStopTyping(const ChatFrame& frame, std::shared_ptr<ClientSession> session, AsyncStorage& db) {
     std::string email;
-    if (!isTokenValid(token, email)) {
+    if (!isTokenValid(frame.token, email)) {
         std::cerr << "Invalid token. Closing connection.\n";
-        socket->close();
-        return;
+        session->close();
+        co_return;
     }
 
-    std::string recipientId = message["recipient"];
+    // Handle typing status, disposable: dropped when the lookup of the recipient is shed
+    std::optional<User> recipient;
+    if (!co_await tryFindUser(frame.recipientId, db, recipient) || !recipient) {
+        co_return;
+    }
 
-    // Handle typing status
-    DatabaseManager& dbManager = DatabaseManager::getInstance();
-    std::string recipientEmail = dbManager.getUserById(std::stoi(recipientId))[2];
+    json outbound;
+    outbound["type"] = "stopTyping";
+    outbound["sender"] = email;
+    outbound["recipient"] = frame.recipientId;
 
     // Send the typing status to the clients in the same room
-    sendMessageToClient(recipientEmail, message.dump());
+    sendMessageToClient(recipient->email, outbound.dump());
 }
 
-void TcpServer::handleUserStatus(const json& message, std::shared_ptr<tcp::socket> socket) {
-    std::string token = message["token"];
+void TcpServer::handleUserStatus(const ChatFrame& frame, std::shared_ptr<ClientSession> session) {
     std::string email;
-    if (!isTokenValid(token, email)) {
+    if (!isTokenValid(frame.token, email)) {
         std::cerr << "Invalid token. Closing connection.\n";
-        socket->close();
+        session->close();
         return;
     }
 
     // Handle user status update
-	DatabaseManager& dbManager = DatabaseManager::getInstance();
-	dbManager.updateUserStatus(email, message["user_status"]);
-
-	std::vector<std::string> user = dbManager.getUserByEmail(email);
-	std::string userId = user[0];
+	Storage& storage = Storage::getInstance();
+	storage.updateUserStatus(email, frame.userStatus);
 
+	std::optional<User> user = storage.getUserByEmail(email);
+	if (!user) {
+		return;
+	}
 
 	// Get the user's friends
-	std::vector<std::vector<std::string>> friends = dbManager.getFriends(std::stoi(userId));
-
 	std::vector<std::string> friendEmails;
-
-	for (auto& friend_ : friends) {
-		friendEmails.push_back(friend_[2]);
+	for (const auto& friend_ : storage.getFriends(user->id)) {
+		friendEmails.emplace_back(friend_.email);
 	}
 
+	json userStatusMessage;
+	userStatusMessage["type"] = "userStatus";
+	userStatusMessage["user_id"] = user->id;
+	userStatusMessage["user_status"] = frame.userStatus;
+
     // Broadcast the user status update to all clients
-	sendMessageToMultipleClients(friendEmails, message.dump());
+	sendMessageToMultipleClients(friendEmails, userStatusMessage.dump());
 }
 
-void TcpServer::handleMessageReceipt(const json& message, std::shared_ptr<tcp::socket> socket) {
-    std::string token = message["token"];
+void TcpServer::handleMessageReceipt(const ChatFrame& frame, std::shared_ptr<ClientSession> session) {
     std::string email;
-    if (!isTokenValid(token, email)) {
+    if (!isTokenValid(frame.token, email)) {
         std::cerr << "Invalid token. Closing connection.\n";
-        socket->close();
+        session->close();
         return;
     }
 
     // Handle message receipt confirmation
-    std::cout << "Message receipt from " << message["username"] << " for message ID: " << message["messageId"] << "\n";
+    std::cout << "Message receipt from " << frame.username << " for message ID: " << frame.messageId << "\n";
 }
 
 // Check if the token is valid
 // After authentication using the RESTful API methods,
 // each time the client sends a request to the socket,
 // it needs to check the token to ensure that the client has been authenticated.
-bool TcpServer::isTokenValid(const std::string& token) {
-    try {
-        auto decoded = jwt::decode(token);
-        auto verifier = jwt::verify()
-            .allow_algorithm(jwt::algorithm::hs256{ "secret" })
-            .with_issuer("auth0");
-
-        verifier.verify(decoded);
-        email = decoded.get_payload_claim("email").as_string();
-        return true;
-    }
-    catch (const std::exception& e) {
-        std::cerr << "Token validation failed: " << e.what() << "\n";
-        return false;
+// Verified tokens are cached by TokenValidator, so only the first frame pays for the HMAC.
+bool TcpServer::isTokenValid(const std::string& token, std::string& email) {
+    return TokenValidator::getInstance().validate(token, email);
+}
+
+bool TcpServer::removeSession(const std::shared_ptr<ClientSession>& session) {
+    std::string email;
+    {
+        std::lock_guard<std::mutex> lock(clientsMutex_);
+        auto registered = sessionEmails_.find(session.get());
+        if (registered == sessionEmails_.end()) {
+            return false;
+        }
+        email = std::move(registered->second);
+        sessionEmails_.erase(registered);
+        auto it = clients_.find(email);
+        if (it == clients_.end()) {
+            return false;
+        }
+        auto& sockets = it->second;
+        sockets.erase(std::remove(sockets.begin(), sockets.end(), session), sockets.end());
+        if (!sockets.empty()) {
+            return false;
+        }
+        clients_.erase(it);
+        // The last socket of the user is gone, stop listening for its deliveries
+        messageBus_.unsubscribe(email);
     }
+    return true;
 }
 
-void TcpServer::sendMessageToClient(const std::string& email, const std::string& message) {
+bool TcpServer::deliverLocally(const std::string& email, const std::shared_ptr<const std::string>& payload) {
     std::lock_guard<std::mutex> lock(clientsMutex_);
     auto it = clients_.find(email);
-    if (it != clients_.end()) {
-        for (const auto& socket : it->second) {
-            boost::asio::async_write(*socket, boost::asio::buffer(message),
-                [](boost::system::error_code ec, std::size_t /*length*/) {
-                    if (ec) {
-                        std::cerr << "Failed to send message: " << ec.message() << "\n";
-                    }
-                });
+    if (it == clients_.end()) {
+        return false;
+    }
+    bool delivered = false;
+    for (const auto& session : it->second) {
+        // A socket that dropped without a disconnect frame may still be listed, it does not count
+        if (!session->isOpen()) {
+            continue;
         }
+        // Queued on the session, which writes its payloads one at a time in order
+        session->send(payload);
+        delivered = true;
+    }
+    return delivered;
+}
+
+// A user without a socket on this node may be connected to another one, hand the message to the bus
+void TcpServer::sendMessageToClient(const std::string& email, const std::string& message) {
+    auto payload = std::make_shared<const std::string>(message);
+    if (!deliverLocally(email, payload)) {
+        messageBus_.publish(email, message);
     }
 }
 
 void TcpServer::sendMessageToMultipleClients(const std::vector<std::string>& emails, const std::string& message) {
-    std::lock_guard<std::mutex> lock(clientsMutex_);
+    auto payload = std::make_shared<const std::string>(message);
     for (const auto& email : emails) {
-        auto it = clients_.find(email);
-        if (it != clients_.end()) {
-            for (const auto& socket : it->second) {
-                boost::asio::async_write(*socket, boost::asio::buffer(message),
-                    [](boost::system::error_code ec, std::size_t /*length*/) {
-                        if (ec) {
-                            std::cerr << "Failed to send message: " << ec.message() << "\n";
-                        }
-                    });
-            }
+        if (!deliverLocally(email, payload)) {
+            messageBus_.publish(email, message);
         }
     }
 }
 
 void TcpServer::broadcastMessage(const std::string& message) {
-    std::vector<std::shared_ptr<tcp::socket>> clients_copy;
+    auto payload = std::make_shared<const std::string>(message);
+    std::vector<std::shared_ptr<ClientSession>> clients_copy;
 
     {
         std::lock_guard<std::mutex> lock(clientsMutex_);
-        for (const auto& client : clients_) {
-            clients_copy.insert(clients_copy.end(), client.second.begin(), client.second.end());
+        // Closed sessions are skipped, their close handler removes them and unsubscribes the user
+        for (const auto& [email, sessions] : clients_) {
+            std::copy_if(sessions.begin(), sessions.end(), std::back_inserter(clients_copy),
+                [](const std::shared_ptr<ClientSession>& session) { return session->isOpen(); });
         }
     }
 
     for (const auto& client : clients_copy) {
-        boost::asio::async_write(*client, boost::asio::buffer(message),
-            [this, client](boost::system::error_code ec, std::size_t /*length*/) {
-                if (ec) {
-                    std::cerr << "Failed to send message to client: " << ec.message() << "\n";
-
-                    std::lock_guard<std::mutex> lock(clientsMutex_);
-                    for (auto& [email, sockets] : clients_) {
-                        sockets.erase(std::remove(sockets.begin(), sockets.end(), client), sockets.end());
-                        if (sockets.empty()) {
-                            clients_.erase(email);
-                        }
-                    }
-                }
-            });
+        client->send(payload);
     }
 }
-
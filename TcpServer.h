@@ -5,6 +5,12 @@
 #include <mutex>
 #include <nlohmann/json.hpp>
 #include "ThreadPool.h"
+#include "RequestParser.h"
+#include "MessageBus.h"
+#include "HashRing.h"
+#include "MessageJournal.h"
+#include "ClientSession.h"
+#include "AsyncStorage.h"
 
 
 using json = nlohmann::json;
@@ -13,17 +19,21 @@ using tcp = net::ip::tcp;
 
 class TcpServer {
 public:
-    TcpServer(boost::asio::io_context& io_context, short port, ThreadPool& threadPool);
+    // Sessions are coroutines on the reactor threads, frames that wait on the database hop to dbPool and the
+    // directory lookups of the journaled send path and typing notifications to ioPool (a miss goes on to dbPool)
+    TcpServer(boost::asio::io_context& io_context, short port, ThreadPool& ioPool, ThreadPool& dbPool, MessageBus& messageBus,
+        const HashRing& ring, MessageJournal* journal = nullptr);
     void doAccept();
-    void handleClient(std::shared_ptr<tcp::socket> socket);
-    void processMessage(const std::string& message, std::shared_ptr<tcp::socket> socket);
-    void handleConnect(const json& message, std::shared_ptr<tcp::socket> socket);
-    void handleDisconnect(const json& message, std::shared_ptr<tcp::socket> socket);
-    void handleMessage(const json& message, std::shared_ptr<tcp::socket> socket);
-    void handleTyping(const json& message, std::shared_ptr<tcp::socket> socket);
-    void handleStopTyping(const json& message, std::shared_ptr<tcp::socket> socket);
-    void handleUserStatus(const json& message, std::shared_ptr<tcp::socket> socket);
-    void handleMessageReceipt(const json& message, std::shared_ptr<tcp::socket> socket);
+    // Parse a frame read by the session and process it, awaited on the session's strand one frame at a time
+    net::awaitable<void> handleFrame(std::shared_ptr<ClientSession> session, const char* data, size_t length, size_t capacity);
+    net::awaitable<void> processMessage(const ChatFrame& frame, std::shared_ptr<ClientSession> session);
+    void handleConnect(const ChatFrame& frame, std::shared_ptr<ClientSession> session);
+    void handleDisconnect(const ChatFrame& frame, std::shared_ptr<ClientSession> session);
+    net::awaitable<void> handleMessage(const ChatFrame& frame, std::shared_ptr<ClientSession> session, AsyncStorage& db);
+    net::awaitable<void> handleTyping(const ChatFrame& frame, std::shared_ptr<ClientSession> session, AsyncStorage& db);
+    net::awaitable<void> handleStopTyping(const ChatFrame& frame, std::shared_ptr<ClientSession> session, AsyncStorage& db);
+    void handleUserStatus(const ChatFrame& frame, std::shared_ptr<ClientSession> session);
+    void handleMessageReceipt(const ChatFrame& frame, std::shared_ptr<ClientSession> session);
     bool isTokenValid(const std::string& token, std::string& email);
 
     // New methods to send messages
@@ -32,12 +42,35 @@ public:
     void broadcastMessage(const std::string& message);
 
 private:
+    // Forget a session that disconnected or whose socket closed, true when it was the user's last socket on this
+    // node (the user is then unsubscribed from the bus)
+    bool removeSession(const std::shared_ptr<ClientSession>& session);
+    // Write to the open sockets this node holds for the user, false when it holds none
+    bool deliverLocally(const std::string& email, const std::shared_ptr<const std::string>& payload);
+    // Look the user up in the directory on ioPool, a miss loads it on dbPool so it is shed with the database.
+    // False when either executor refused the lookup
+    net::awaitable<bool> tryFindUser(int userId, AsyncStorage& db, std::optional<User>& user);
+    // Append to the journal, suspended until the entry is durable. The entry is added to the recent messages then
+    net::awaitable<JournalEntry> appendToJournal(int roomId, int senderId, const std::string& content);
+    // Tell the client a frame was refused because the server is saturated
+    void sendBusy(const std::shared_ptr<ClientSession>& session);
+    // Tell the client its message was not stored, so it is not left waiting for an ack
+    void sendNotStored(const std::shared_ptr<ClientSession>& session);
+
     tcp::acceptor acceptor_;
-    std::shared_ptr<tcp::socket> socket_;
-    ThreadPool& threadPool_;
+    ThreadPool& ioPool_;
+    ThreadPool& dbPool_;
+    // Deliveries for users connected to another node go through the bus
+    MessageBus& messageBus_;
+    // Home node of every user, a client connecting elsewhere is redirected
+    const HashRing& ring_;
+    // When set, messages are acknowledged once journaled and stored in Postgres in the background
+    MessageJournal* journal_;
 
     // Store connected clients
 
-    std::unordered_map<std::string, std::vector<std::shared_ptr<tcp::socket>>> clients_;
+    std::unordered_map<std::string, std::vector<std::shared_ptr<ClientSession>>> clients_;
+    // User of each registered session, what the close handler removes it by
+    std::unordered_map<const ClientSession*, std::string> sessionEmails_;
     std::mutex clientsMutex_;
 };
@@ -1,68 +1,389 @@
+#include <vector>
+#include <algorithm>
+#include <exception>
+#include <iostream>
+
 #include "ThreadPool.h"
 
 /*
     The ThreadPool class is responsible for managing a pool of worker threads.
     It allows tasks to be enqueued and executed by the worker threads.
-    The ThreadPool class uses the std::thread, std::mutex, and std::condition_variable classes to manage the worker threads.
+    Each worker runs workerThread: it looks for a task in its own deque, the injection queue and the other workers'
+    deques, spins for a short while when there is none, then parks until a producer wakes it.
+    The TaskSlots travel from the producer to whichever worker runs them, so each thread keeps a cache of free slots
+    and trades full batches with the others through a shared list: producers and workers mostly meet there once
+    per kSlotBatch tasks, and slots are only allocated until the caches cover the tasks in flight.
 */
 
-ThreadPool::ThreadPool(size_t numThreads) : stop(false) {
-  // Create list of worker threads
-  // Each thread will execute the workerThread function
-    for (size_t i = 0; i < numThreads; ++i) {
-        workers.emplace_back(&ThreadPool::workerThread, this);
+namespace {
+    // Rounds of searching for work before parking. New work usually shows up within microseconds under load,
+    // a futex sleep and wakeup costs more than that
+    const int kSpinRounds = 64;
+
+    // The pool and worker index of the current thread, so a task enqueued from a worker stays on its deque
+    thread_local const void* currentPool = nullptr;
+    thread_local size_t currentWorker = 0;
+
+    // Victim selection, xorshift seeded per thread
+    thread_local uint64_t randomState = 0;
+
+    // Free Task slots move between the per-thread caches and the shared list in batches of this size
+    const size_t kSlotBatch = 64;
+
+    // Full batches of free slots, and the emptied batch vectors kept for reuse so trading does not allocate either
+    class TaskSlots {
+    public:
+        ~TaskSlots() {
+            for (std::vector<TaskSlot*>& batch : batches_) {
+                for (TaskSlot* slot : batch) {
+                    delete slot;
+                }
+            }
+        }
+
+        // Hand a full batch over and get an empty vector back
+        std::vector<TaskSlot*> put(std::vector<TaskSlot*> batch) {
+            std::lock_guard<std::mutex> lock(mutex_);
+            batches_.push_back(std::move(batch));
+            return takeSpare();
+        }
+
+        // Swap an empty vector for a full batch, false when there is none
+        bool take(std::vector<TaskSlot*>& slots) {
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (batches_.empty()) {
+                return false;
+            }
+            spares_.push_back(std::move(slots));
+            slots = std::move(batches_.back());
+            batches_.pop_back();
+            return true;
+        }
+
+    private:
+        std::vector<TaskSlot*> takeSpare() {
+            if (spares_.empty()) {
+                return {};
+            }
+            std::vector<TaskSlot*> spare = std::move(spares_.back());
+            spares_.pop_back();
+            spare.clear();
+            return spare;
+        }
+
+        std::mutex mutex_;
+        std::vector<std::vector<TaskSlot*>> batches_;
+        std::vector<std::vector<TaskSlot*>> spares_;
+    };
+
+    TaskSlots sharedSlots;
+
+    // The free slots of the current thread, handed back to the shared list when the thread exits
+    struct SlotCache {
+        std::vector<TaskSlot*> slots;
+
+        ~SlotCache() {
+            if (!slots.empty()) {
+                sharedSlots.put(std::move(slots));
+            }
+        }
+    };
+
+    thread_local SlotCache slotCache;
+    // An empty vector the next batch handed back by this thread is copied into
+    thread_local std::vector<TaskSlot*> spareBatch;
+
+    TaskSlot* acquireSlot(Task task) {
+        std::vector<TaskSlot*>& slots = slotCache.slots;
+        if (slots.empty()) {
+            sharedSlots.take(slots);
+        }
+        if (slots.empty()) {
+            return new TaskSlot{ std::move(task), {} };
+        }
+        TaskSlot* slot = slots.back();
+        slots.pop_back();
+        slot->task = std::move(task);
+        return slot;
+    }
+
+    void releaseSlot(TaskSlot* slot) {
+        // Release the captures now rather than when the slot is reused
+        slot->task.reset();
+        std::vector<TaskSlot*>& slots = slotCache.slots;
+        slots.push_back(slot);
+        if (slots.size() >= 2 * kSlotBatch) {
+            std::vector<TaskSlot*> batch = std::move(spareBatch);
+            batch.assign(slots.end() - kSlotBatch, slots.end());
+            slots.resize(slots.size() - kSlotBatch);
+            spareBatch = sharedSlots.put(std::move(batch));
+        }
+    }
+
+    uint64_t nextRandom() {
+        if (randomState == 0) {
+            randomState = std::hash<std::thread::id>{}(std::this_thread::get_id()) | 1;
+        }
+        randomState ^= randomState << 13;
+        randomState ^= randomState >> 7;
+        randomState ^= randomState << 17;
+        return randomState;
     }
 }
 
+ThreadPool::ThreadPool(std::string name, size_t numThreads, size_t maxQueueSize, size_t maxThreads)
+    : name(std::move(name)), maxQueueSize(maxQueueSize), maxSpinners(std::max(1u, std::thread::hardware_concurrency() / 2)) {
+    // Every deque exists before any worker starts stealing from it, including the ones of the workers resize() may add
+    numThreads = std::max<size_t>(1, numThreads);
+    for (size_t i = 0; i < std::max(numThreads, maxThreads); ++i) {
+        workers.push_back(std::make_unique<Worker>());
+    }
+    resize(numThreads);
+}
+
 ThreadPool::~ThreadPool() {
-    {
-      	// Lock the mutex before setting stop to true to prevent data
-        std::unique_lock<std::mutex> lock(queueMutex);
-        // Set stop to true to signal to all worker threads to stop, stop to accept new tasks
-        stop = true;
-    }
-    // Wake up all the threads waiting on the condition.
-    // When these threads are awakened,
-    // they will check the condition they are waiting on
-    // (for example: checking the value of the stop variable)
-    condition.notify_all();
-    for (std::thread& worker : workers) {
-      	// Wait for all worker threads to finish before free its
-        worker.join();
+    // Signal all worker threads to stop once the pending tasks are taken, and wake the parked ones
+    stop.store(true, std::memory_order_seq_cst);
+    wakeups.fetch_add(1, std::memory_order_seq_cst);
+    wakeups.notify_all();
+    std::lock_guard<std::mutex> lock(resizeMutex);
+    for (auto& worker : workers) {
+      	// Wait for all worker threads to finish before free its, retired ones included
+        if (worker->thread.joinable()) {
+            worker->thread.join();
+        }
+    }
+    // Tasks enqueued after the workers left are dropped
+    while (TaskSlot* slot = injectionQueue.pop()) {
+        releaseSlot(slot);
+    }
+    for (TaskSlot* slot : overflow) {
+        releaseSlot(slot);
     }
 }
 
-void ThreadPool::enqueueTask(std::function<void()> task) {
-    {
-       // Mutex is used to protect access to the task queue to prevent race conditions,
-       // ensuring that only one thread can access the queue at a time.
-       // and avoid the case of multiple threads accessing the queue at the same time then they get the same task
-        std::unique_lock<std::mutex> lock(queueMutex);
+size_t ThreadPool::resize(size_t numThreads) {
+    std::lock_guard<std::mutex> lock(resizeMutex);
+    numThreads = std::clamp<size_t>(numThreads, 1, workers.size());
+    size_t active = activeThreads.load(std::memory_order_relaxed);
+
+    // Thieves visit the new deques from now on, before their workers start stealing themselves
+    if (numThreads > startedWorkers.load(std::memory_order_relaxed)) {
+        startedWorkers.store(numThreads, std::memory_order_release);
+    }
+  // Create the worker threads of the new slots, a slot whose worker retired earlier is joined first
+  // (it may still be running the last tasks of its deque)
+    for (size_t i = active; i < numThreads; ++i) {
+        Worker& worker = *workers[i];
+        if (worker.thread.joinable()) {
+            worker.thread.join();
+        }
+        worker.retire.store(false, std::memory_order_relaxed);
+        worker.thread = std::thread(&ThreadPool::workerThread, this, i);
+    }
 
-        // Add the task to the queue
-        tasks.push(std::move(task));
+    if (numThreads < active) {
+        for (size_t i = numThreads; i < active; ++i) {
+            workers[i]->retire.store(true, std::memory_order_seq_cst);
+        }
+        // Parked workers re-check their retire flag when the wakeup counter moves
+        wakeups.fetch_add(1, std::memory_order_seq_cst);
+        wakeups.notify_all();
     }
-    // Notify one of the waiting threads that there is a new task to be executed
-    condition.notify_one();
+    activeThreads.store(numThreads, std::memory_order_relaxed);
+    return numThreads;
+}
+
+void ThreadPool::enqueueTask(Task task) {
+    pending.fetch_add(1, std::memory_order_relaxed);
+    submitted.fetch_add(1, std::memory_order_relaxed);
+    push(acquireSlot(std::move(task)));
+}
+
+bool ThreadPool::tryEnqueueTask(Task task) {
+    // The queue is full, the caller has to shed the work (e.g. answer "busy") instead of piling it up
+    size_t count = pending.load(std::memory_order_relaxed);
+    size_t limit = maxQueueSize.load(std::memory_order_relaxed);
+    do {
+        if (limit != 0 && count >= limit) {
+            rejected.fetch_add(1, std::memory_order_relaxed);
+            return false;
+        }
+    } while (!pending.compare_exchange_weak(count, count + 1, std::memory_order_relaxed));
+    submitted.fetch_add(1, std::memory_order_relaxed);
+    push(acquireSlot(std::move(task)));
+    return true;
+}
+
+size_t ThreadPool::queueSize() {
+    return pending.load(std::memory_order_relaxed);
+}
+
+ThreadPoolStats ThreadPool::stats() {
+    ThreadPoolStats stats;
+    stats.name = name;
+    stats.threads = activeThreads.load(std::memory_order_relaxed);
+    stats.maxThreads = workers.size();
+    stats.maxQueueSize = maxQueueSize.load(std::memory_order_relaxed);
+    stats.queued = pending.load(std::memory_order_relaxed);
+    stats.running = running.load(std::memory_order_relaxed);
+    stats.submitted = submitted.load(std::memory_order_relaxed);
+    stats.rejected = rejected.load(std::memory_order_relaxed);
+    stats.completed = completed.load(std::memory_order_relaxed);
+    stats.failed = failed.load(std::memory_order_relaxed);
+    stats.totalQueueWaitMicros = totalQueueWaitMicros.load(std::memory_order_relaxed);
+    stats.maxQueueWaitMicros = maxQueueWaitMicros.load(std::memory_order_relaxed);
+    stats.totalRunMicros = totalRunMicros.load(std::memory_order_relaxed);
+    return stats;
+}
+
+bool ThreadPool::isWorkerThread() const {
+    return currentPool == this;
+}
+
+void ThreadPool::push(TaskSlot* slot) {
+    slot->enqueuedAt = std::chrono::steady_clock::now();
+    if (currentPool == this) {
+        workers[currentWorker]->deque.push(slot);
+    }
+    else if (!injectionQueue.push(slot)) {
+        std::lock_guard<std::mutex> lock(overflowMutex);
+        overflow.push_back(slot);
+        overflowCount.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    // Pairs with the fence of a worker about to park: either it sees this task or this sees it as a sleeper.
+    // Without sleepers no wakeup is needed, the spinning workers will find the task
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (sleepers.load(std::memory_order_relaxed) > 0) {
+        wakeups.fetch_add(1, std::memory_order_release);
+        wakeups.notify_one();
+    }
+}
+
+TaskSlot* ThreadPool::findTask(size_t self) {
+    if (TaskSlot* slot = workers[self]->deque.pop()) {
+        return slot;
+    }
+    if (TaskSlot* slot = injectionQueue.pop()) {
+        return slot;
+    }
+    if (overflowCount.load(std::memory_order_relaxed) != 0) {
+        std::lock_guard<std::mutex> lock(overflowMutex);
+        if (!overflow.empty()) {
+            TaskSlot* slot = overflow.front();
+            overflow.pop_front();
+            overflowCount.fetch_sub(1, std::memory_order_relaxed);
+            return slot;
+        }
+    }
+    return stealTask(self);
+}
+
+// Visit every other worker once, starting at a random one so the thieves do not all hit the same victim
+TaskSlot* ThreadPool::stealTask(size_t self) {
+    // Retired workers included, their deques may still hold tasks
+    size_t count = startedWorkers.load(std::memory_order_acquire);
+    size_t start = static_cast<size_t>(nextRandom() % count);
+    for (size_t i = 0; i < count; ++i) {
+        size_t victim = (start + i) % count;
+        if (victim == self) {
+            continue;
+        }
+        if (TaskSlot* slot = workers[victim]->deque.steal()) {
+            return slot;
+        }
+    }
+    return nullptr;
 }
 
 // Each thread will execute this function
-void ThreadPool::workerThread() {
+void ThreadPool::workerThread(size_t index) {
+    currentPool = this;
+    currentWorker = index;
+
     // This loop allows the thread to continue running continuously, waiting for new tasks to execute.
     while (true) {
-        std::function<void()> task;
-        {
-            // Lock the mutex to access the task queue
-            std::unique_lock<std::mutex> lock(queueMutex);
-            // Wait until there is a task to execute or the thread pool is stopped
-            condition.wait(lock, [this] { return stop || !tasks.empty(); });
-            // If the thread pool is stopped and there are no tasks to execute, the thread will exit
-            if (stop && tasks.empty()) return;
-            // Get the next task from the queue
-            task = std::move(tasks.front());
-            tasks.pop();
+        if (workers[index]->retire.load(std::memory_order_acquire)) {
+            drainWorker(index);
+            return;
+        }
+
+        TaskSlot* task = findTask(index);
+        if (task == nullptr) {
+            if (spinners.fetch_add(1, std::memory_order_relaxed) < maxSpinners) {
+                for (int spin = 0; task == nullptr && spin < kSpinRounds; ++spin) {
+                    std::this_thread::yield();
+                    task = findTask(index);
+                }
+            }
+            spinners.fetch_sub(1, std::memory_order_relaxed);
+        }
+
+        if (task == nullptr) {
+            // Park. The wakeup counter is read first, so a wakeup sent after the last search below makes wait
+            // return immediately instead of being lost
+            uint32_t epoch = wakeups.load(std::memory_order_acquire);
+            sleepers.fetch_add(1, std::memory_order_seq_cst);
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            task = findTask(index);
+            if (task == nullptr) {
+                // If the thread pool is stopped and there are no tasks to execute, the thread will exit
+                if (stop.load(std::memory_order_acquire) && pending.load(std::memory_order_acquire) == 0) {
+                    sleepers.fetch_sub(1, std::memory_order_relaxed);
+                    return;
+                }
+                if (!workers[index]->retire.load(std::memory_order_seq_cst)) {
+                    wakeups.wait(epoch, std::memory_order_acquire);
+                }
+            }
+            sleepers.fetch_sub(1, std::memory_order_relaxed);
+            if (task == nullptr) {
+                continue;
+            }
         }
+
         // Execute the task
-        task();
+        pending.fetch_sub(1, std::memory_order_relaxed);
+        runTask(task);
+        releaseSlot(task);
+    }
+}
+
+// Tasks the retiring worker's own tasks push while it drains land on the same deque and are run here too,
+// the other workers may steal from it meanwhile
+void ThreadPool::drainWorker(size_t index) {
+    while (TaskSlot* task = workers[index]->deque.pop()) {
+        pending.fetch_sub(1, std::memory_order_relaxed);
+        runTask(task);
+        releaseSlot(task);
+    }
+}
+
+void ThreadPool::runTask(TaskSlot* slot) {
+    auto startedAt = std::chrono::steady_clock::now();
+    uint64_t waitMicros = static_cast<uint64_t>(
+        std::chrono::duration_cast<std::chrono::microseconds>(startedAt - slot->enqueuedAt).count());
+    totalQueueWaitMicros.fetch_add(waitMicros, std::memory_order_relaxed);
+    uint64_t maxWait = maxQueueWaitMicros.load(std::memory_order_relaxed);
+    while (waitMicros > maxWait
+        && !maxQueueWaitMicros.compare_exchange_weak(maxWait, waitMicros, std::memory_order_relaxed)) {
     }
-}
\ No newline at end of file
+
+    running.fetch_add(1, std::memory_order_relaxed);
+    try {
+        slot->task();
+    }
+    catch (const std::exception& e) {
+        failed.fetch_add(1, std::memory_order_relaxed);
+        std::cerr << "Task failed in pool " << name << ": " << e.what() << std::endl;
+    }
+    catch (...) {
+        failed.fetch_add(1, std::memory_order_relaxed);
+        std::cerr << "Task failed in pool " << name << " with an unknown exception" << std::endl;
+    }
+    running.fetch_sub(1, std::memory_order_relaxed);
+    completed.fetch_add(1, std::memory_order_relaxed);
+    totalRunMicros.fetch_add(static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::steady_clock::now() - startedAt).count()), std::memory_order_relaxed);
+}
@@ -1,9 +1,20 @@
 #pragma once
-#include <queue>
-#include <thread>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <deque>
+#include <memory>
 #include <mutex>
-#include <condition_variable>
-#include <functional>
+#include <optional>
+#include <string>
+#include <thread>
+#include <type_traits>
+#include <utility>
+#include <vector>
+#include "WorkStealingDeque.h"
+#include "InjectionQueue.h"
+#include "Task.h"
+#include "TaskFuture.h"
 
 #ifndef THREADPOOL_H
 #define THREADPOOL_H
@@ -11,26 +22,171 @@
 /*
     The ThreadPool class is responsible for managing a pool of worker threads.
     It allows tasks to be enqueued and executed by the worker threads.
-    The ThreadPool class uses the std::thread, std::mutex, and std::condition_variable classes to manage the worker threads.
+    Scheduling is work stealing: each worker owns a lock-free deque, a task enqueued by a worker goes to its own deque
+    and a task enqueued from outside the pool goes through the lock-free injection queue. An idle worker takes from
+    its deque, then the injection queue, then steals from other workers starting at a random victim. Up to half the
+    cores' worth of idle workers spin a little before parking on a futex (std::atomic::wait), the others park at once;
+    producers only pay for a wakeup when a worker is parked.
+    Tasks are move-only Task objects kept in slots recycled through per-thread caches, so enqueueing a lambda that
+    fits the Task's inline storage does not allocate. An exception thrown by a task is logged and the worker carries
+    on; submit() hands it (or the returned value) to the caller through a TaskFuture or a continuation instead.
+
+    The server runs one pool per class of work, named executors: db for calls that block on the database, cpu for
+    hashing and io for the other blocking work of the chat path. Handlers hop explicitly (tryRun, or tryRunOn from
+    a coroutine), each pool has its own size and queue bound, so a saturated class is rejected at its own queue
+    instead of taking the threads of the others.
+
+    The number of workers can change while the pool runs, between 1 and the maxThreads given to the constructor:
+    every worker's deque is created up front, resize() starts threads on the idle slots or asks the last workers to
+    retire, and a retiring worker runs what is left on its own deque before it exits. The CapacityController resizes
+    the db and io executors from their queue wait.
 */
 
+// Counters of one pool since it started, queue wait is from enqueue to a worker taking the task
+struct ThreadPoolStats {
+    std::string name;
+    size_t threads = 0;
+    size_t maxThreads = 0;
+    size_t maxQueueSize = 0;
+    size_t queued = 0;
+    size_t running = 0;
+    uint64_t submitted = 0;
+    uint64_t rejected = 0;
+    uint64_t completed = 0;
+    uint64_t failed = 0;
+    uint64_t totalQueueWaitMicros = 0;
+    uint64_t maxQueueWaitMicros = 0;
+    uint64_t totalRunMicros = 0;
+};
+
+// A queued task and when it was enqueued
+struct TaskSlot {
+    Task task;
+    std::chrono::steady_clock::time_point enqueuedAt;
+};
+
 class ThreadPool {
 public:
-    ThreadPool(size_t numThreads);
+    // maxQueueSize bounds the number of pending tasks accepted by tryEnqueueTask, 0 means unbounded.
+    // maxThreads is how far resize() can grow the pool, 0 keeps it at numThreads
+    ThreadPool(std::string name, size_t numThreads, size_t maxQueueSize = 0, size_t maxThreads = 0);
     ~ThreadPool();
-    void enqueueTask(std::function<void()> task);
+    void enqueueTask(Task task);
+    // Admission control: reject the task instead of queueing it when the queue is already full
+    bool tryEnqueueTask(Task task);
+    size_t queueSize();
+    const std::string& getName() const { return name; }
+    ThreadPoolStats stats();
+    // True on the pool's own worker threads
+    bool isWorkerThread() const;
+    size_t threadCount() const { return activeThreads.load(std::memory_order_relaxed); }
+    size_t maxThreadCount() const { return workers.size(); }
+    // Start or retire workers so numThreads of them run, clamped to [1, maxThreadCount()], returns the new count.
+    // Shrinking does not wait for the retired workers, growing back onto their slots does
+    size_t resize(size_t numThreads);
+    // Change the bound of tryEnqueueTask, e.g. to keep it proportional to the threads after a resize
+    void setMaxQueueSize(size_t size) { maxQueueSize.store(size, std::memory_order_relaxed); }
+
+    // Run function on the pool, the future gets what it returns or throws
+    template <typename F, typename R = std::invoke_result_t<std::decay_t<F>&>>
+    TaskFuture<R> submit(F&& function) {
+        auto state = std::make_shared<typename TaskFuture<R>::State>();
+        enqueueTask(bindResult<R>(std::forward<F>(function), state));
+        return TaskFuture<R>(std::move(state));
+    }
+
+    // Run function on the pool, then continuation(TaskResult<R>&&) on the same worker
+    template <typename F, typename C, typename R = std::invoke_result_t<std::decay_t<F>&>>
+    void submit(F&& function, C&& continuation) {
+        enqueueTask([function = std::forward<F>(function), continuation = std::forward<C>(continuation)]() mutable {
+            continuation(runCapturingResult<R>(function));
+        });
+    }
+
+    // Hop: run function on the pool and wait for it, rethrowing what it threw. False when the queue is full,
+    // runs inline when already on one of the pool's workers
+    template <typename F>
+    bool tryRun(F&& function) {
+        if (isWorkerThread()) {
+            function();
+            return true;
+        }
+        std::optional<TaskFuture<void>> result = trySubmit([&function]() { function(); });
+        if (!result) {
+            return false;
+        }
+        result->get();
+        return true;
+    }
+
+    // submit() with the admission control of tryEnqueueTask, empty when the queue is full
+    template <typename F, typename R = std::invoke_result_t<std::decay_t<F>&>>
+    std::optional<TaskFuture<R>> trySubmit(F&& function) {
+        auto state = std::make_shared<typename TaskFuture<R>::State>();
+        if (!tryEnqueueTask(bindResult<R>(std::forward<F>(function), state))) {
+            return std::nullopt;
+        }
+        return TaskFuture<R>(std::move(state));
+    }
 
 private:
-    std::vector<std::thread> workers;
-    std::queue<std::function<void()>> tasks;
-    std::mutex queueMutex;
-    std::condition_variable condition;
-    bool stop;
+    struct Worker {
+        WorkStealingDeque<TaskSlot> deque;
+        std::thread thread;
+        // Set by resize() to make the worker drain its deque and exit
+        std::atomic<bool> retire{ false };
+    };
 
-    void workerThread();
-};
+    // One per slot up to maxThreads, the first activeThreads have a running thread
+    std::vector<std::unique_ptr<Worker>> workers;
+    std::atomic<size_t> activeThreads{ 0 };
+    // Slots that ever had a thread, the only deques thieves have to visit
+    std::atomic<size_t> startedWorkers{ 0 };
+    std::mutex resizeMutex;
+    InjectionQueue<TaskSlot> injectionQueue;
+    // Tasks that did not fit in the injection queue, only looked at while overflowCount is not 0
+    std::mutex overflowMutex;
+    std::deque<TaskSlot*> overflow;
+    std::atomic<size_t> overflowCount{ 0 };
+
+    // Tasks enqueued and not yet taken by a worker
+    std::atomic<size_t> pending{ 0 };
+    // Bumped to wake parked workers, which wait for it to change
+    std::atomic<uint32_t> wakeups{ 0 };
+    std::atomic<size_t> sleepers{ 0 };
+    // Workers spinning for work, bounded by maxSpinners so a large idle pool does not burn every core scanning
+    std::atomic<size_t> spinners{ 0 };
+    std::atomic<bool> stop{ false };
 
+    std::atomic<size_t> running{ 0 };
+    std::atomic<uint64_t> submitted{ 0 };
+    std::atomic<uint64_t> rejected{ 0 };
+    std::atomic<uint64_t> completed{ 0 };
+    std::atomic<uint64_t> failed{ 0 };
+    std::atomic<uint64_t> totalQueueWaitMicros{ 0 };
+    std::atomic<uint64_t> maxQueueWaitMicros{ 0 };
+    std::atomic<uint64_t> totalRunMicros{ 0 };
+
+    std::string name;
+    std::atomic<size_t> maxQueueSize;
+    size_t maxSpinners;
+
+    template <typename R, typename F>
+    static auto bindResult(F&& function, std::shared_ptr<typename TaskFuture<R>::State> state) {
+        return [function = std::forward<F>(function), state = std::move(state)]() mutable {
+            state->complete(runCapturingResult<R>(function));
+        };
+    }
+
+    void push(TaskSlot* slot);
+    TaskSlot* findTask(size_t self);
+    TaskSlot* stealTask(size_t self);
+    void runTask(TaskSlot* slot);
+    void workerThread(size_t index);
+    // Run the tasks left on a retiring worker's deque
+    void drainWorker(size_t index);
+};
 
 
-#endif //THREADPOOL_H#include <vector>
 
+#endif //THREADPOOL_H
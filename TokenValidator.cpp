@@ -0,0 +1,182 @@
+#include "TokenValidator.h"
+#include "Utils.h"
+#include <algorithm>
+#include <iostream>
+#include <openssl/evp.h>
+
+/*
+    The TokenValidator class is a singleton that checks the JWT sent with every authenticated request.
+    Verified claims are cached by token digest, revoked tokens are kept in memory.
+*/
+
+std::unique_ptr<TokenValidator> TokenValidator::instance_ = nullptr;
+std::once_flag TokenValidator::initInstanceFlag;
+
+namespace {
+    // Sent by the trigger on token_blacklist, see kSchemaStatements in DatabaseManager.cpp
+    const char* kTokensRevokedChannel = "tokens_revoked";
+}
+
+TokenValidator& TokenValidator::getInstance() {
+    std::call_once(initInstanceFlag, []() {
+        instance_ = std::unique_ptr<TokenValidator>(new TokenValidator());
+    });
+    return *instance_;
+}
+
+TokenValidator::TokenValidator()
+    : verifier_(jwt::verify()
+        .allow_algorithm(jwt::algorithm::hs256{ "secret" })
+        .with_issuer("auth0")),
+      maxTokensPerShard_(Utils::getEnvSize("CHAT_TOKEN_CACHE_SIZE", 65536) / kShardCount + 1) {
+}
+
+// The cache and the revocation set are keyed by the SHA-256 of the token,
+// a collision resistant digest so a forged token can never alias a verified one
+std::string TokenValidator::digest(const std::string& token) {
+    unsigned char md[EVP_MAX_MD_SIZE];
+    unsigned int length = 0;
+    if (EVP_Digest(token.data(), token.size(), md, &length, EVP_sha256(), nullptr) != 1) {
+        throw std::runtime_error("Failed to digest token");
+    }
+    return std::string(reinterpret_cast<const char*>(md), length);
+}
+
+std::chrono::system_clock::time_point TokenValidator::expiryOf(const std::string& token) {
+    try {
+        auto decoded = jwt::decode(token);
+        if (decoded.has_expires_at()) {
+            return decoded.get_expires_at();
+        }
+    }
+    catch (const std::exception&) {
+        // Not a JWT we can read, kept for good
+    }
+    return std::chrono::system_clock::time_point::max();
+}
+
+TokenValidator::Shard& TokenValidator::shardFor(const std::string& digest) {
+    // The digest is uniformly distributed, its first byte is enough to pick a shard
+    return shards_[static_cast<unsigned char>(digest[0]) % kShardCount];
+}
+
+bool TokenValidator::isRevoked(const std::string& digest) {
+    std::shared_lock<std::shared_mutex> lock(revokedMutex_);
+    return revoked_.count(digest) != 0;
+}
+
+bool TokenValidator::validate(const std::string& token, std::string& email) {
+    try {
+        std::string key = digest(token);
+
+        // A revoked token is rejected before the cache is consulted
+        if (isRevoked(key)) {
+            std::cerr << "Token validation failed: token has been revoked\n";
+            return false;
+        }
+
+        auto now = std::chrono::system_clock::now();
+        Shard& shard = shardFor(key);
+        {
+            std::lock_guard<std::mutex> lock(shard.mutex);
+            auto it = shard.tokens.find(key);
+            if (it != shard.tokens.end()) {
+                if (it->second.expiresAt > now) {
+                    email = it->second.email;
+                    return true;
+                }
+                // Expired, fall through to the full verification which reports the error
+                shard.tokens.erase(it);
+            }
+        }
+
+        // Cache miss: decode and verify the signature once
+        auto decoded = jwt::decode(token);
+        verifier_.verify(decoded);
+        email = decoded.get_payload_claim("email").as_string();
+
+        // Tokens without an expiry are verified every time rather than cached forever
+        if (!decoded.has_expires_at()) {
+            return true;
+        }
+
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        if (shard.tokens.size() >= maxTokensPerShard_) {
+            // Drop expired tokens first, then an arbitrary one if the shard is still full
+            for (auto it = shard.tokens.begin(); it != shard.tokens.end();) {
+                it = it->second.expiresAt <= now ? shard.tokens.erase(it) : std::next(it);
+            }
+            if (shard.tokens.size() >= maxTokensPerShard_) {
+                shard.tokens.erase(shard.tokens.begin());
+            }
+        }
+        shard.tokens[key] = CachedToken{ email, decoded.get_expires_at() };
+        return true;
+    }
+    catch (const std::exception& e) {
+        std::cerr << "Token validation failed: " << e.what() << "\n";
+        return false;
+    }
+}
+
+void TokenValidator::addRevoked(std::string digest, std::chrono::system_clock::time_point expiresAt) {
+    revoked_[std::move(digest)] = expiresAt;
+    if (revoked_.size() < sweepRevokedAt_) {
+        return;
+    }
+    auto now = std::chrono::system_clock::now();
+    for (auto it = revoked_.begin(); it != revoked_.end();) {
+        it = it->second <= now ? revoked_.erase(it) : std::next(it);
+    }
+    sweepRevokedAt_ = std::max<size_t>(1024, 2 * revoked_.size());
+}
+
+// Revoke a token in memory, the caller persists it in token_blacklist (whose trigger tells the other nodes)
+void TokenValidator::revoke(const std::string& token) {
+    std::string key = digest(token);
+    auto expiresAt = expiryOf(token);
+    {
+        std::unique_lock<std::shared_mutex> lock(revokedMutex_);
+        addRevoked(key, expiresAt);
+    }
+
+    Shard& shard = shardFor(key);
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    shard.tokens.erase(key);
+}
+
+// Seed the revocation set with the tokens stored in token_blacklist, the expired ones are skipped
+void TokenValidator::loadRevokedTokens(const std::vector<std::string>& tokens) {
+    auto now = std::chrono::system_clock::now();
+    std::vector<std::pair<std::string, std::chrono::system_clock::time_point>> keys;
+    keys.reserve(tokens.size());
+    for (const auto& token : tokens) {
+        auto expiresAt = expiryOf(token);
+        if (expiresAt > now) {
+            keys.emplace_back(digest(token), expiresAt);
+        }
+    }
+
+    std::unique_lock<std::shared_mutex> lock(revokedMutex_);
+    for (auto& [key, expiresAt] : keys) {
+        addRevoked(std::move(key), expiresAt);
+    }
+}
+
+void TokenValidator::startRevocationListener(const std::string& conninfo,
+    std::function<std::vector<std::string>()> loadRevoked) {
+    listener_ = std::make_unique<PgListener>(conninfo);
+    listener_->subscribe(kTokensRevokedChannel, [this](const std::string& token) {
+        revoke(token);
+    });
+    // A logout on another node while the LISTEN was down was missed, read the table again
+    listener_->onConnected([this, loadRevoked = std::move(loadRevoked)]() {
+        try {
+            loadRevokedTokens(loadRevoked());
+        }
+        catch (const std::exception& e) {
+            std::cerr << "Failed to reload the revoked tokens: " << e.what() << "\n";
+        }
+    });
+    listener_->start();
+}
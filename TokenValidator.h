@@ -0,0 +1,81 @@
+#pragma once
+#include <array>
+#include <chrono>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include <jwt-cpp/jwt.h>
+#include "PgListener.h"
+
+#ifndef TOKENVALIDATOR_H
+#define TOKENVALIDATOR_H
+
+/*
+    The TokenValidator class is a singleton that checks the JWT sent with every authenticated request.
+    A token is decoded and its HMAC verified only the first time it is seen, the verified claims are then
+    kept in a bounded, sharded cache keyed by the SHA-256 digest of the token until the token expires.
+    Revoked tokens (logout) are kept in an in-memory set seeded from the token_blacklist table at startup,
+    so checking a token on a hot endpoint costs a hash and two lookups. With several nodes, a trigger on
+    token_blacklist sends NOTIFY tokens_revoked with the token, so a logout on one node revokes it on all of them;
+    the set is reloaded when the listener (re)connects, since notifications sent while it was down are lost.
+    A revoked token is forgotten once it expired, it is rejected for its expiry from then on.
+*/
+
+class TokenValidator {
+public:
+    static TokenValidator& getInstance();
+
+    bool validate(const std::string& token, std::string& email);
+    void revoke(const std::string& token);
+    void loadRevokedTokens(const std::vector<std::string>& tokens);
+    // Follow the revocations made by the other nodes, loadRevoked reads token_blacklist after every (re)connect
+    void startRevocationListener(const std::string& conninfo, std::function<std::vector<std::string>()> loadRevoked);
+
+    ~TokenValidator() = default;
+
+private:
+    TokenValidator();
+    TokenValidator(const TokenValidator&) = delete;
+    TokenValidator& operator=(const TokenValidator&) = delete;
+
+    struct CachedToken {
+        std::string email;
+        std::chrono::system_clock::time_point expiresAt;
+    };
+
+    struct Shard {
+        std::mutex mutex;
+        std::unordered_map<std::string, CachedToken> tokens;
+    };
+
+    static constexpr size_t kShardCount = 16;
+
+    static std::string digest(const std::string& token);
+    // exp of the token without verifying it, never for a token without one
+    static std::chrono::system_clock::time_point expiryOf(const std::string& token);
+    Shard& shardFor(const std::string& digest);
+    bool isRevoked(const std::string& digest);
+    // Add to revoked_ and drop the expired entries once it doubled since the last sweep, revokedMutex_ held
+    void addRevoked(std::string digest, std::chrono::system_clock::time_point expiresAt);
+
+    // Built once, verify() is const and safe to share between threads
+    decltype(jwt::verify()) verifier_;
+
+    std::array<Shard, kShardCount> shards_;
+    size_t maxTokensPerShard_;
+
+    std::shared_mutex revokedMutex_;
+    // Digest of each revoked token and when it expires
+    std::unordered_map<std::string, std::chrono::system_clock::time_point> revoked_;
+    size_t sweepRevokedAt_ = 1024;
+    std::unique_ptr<PgListener> listener_;
+
+    static std::unique_ptr<TokenValidator> instance_;
+    static std::once_flag initInstanceFlag;
+};
+
+#endif //TOKENVALIDATOR_H
@@ -0,0 +1,194 @@
+#include "UserDirectory.h"
+#include "Utils.h"
+#include <iostream>
+#include <vector>
+
+/*
+    The UserDirectory class is a singleton in-memory directory of users, loaded lazily and invalidated through
+    LISTEN/NOTIFY. Lookups take one shard mutex (two for an email) and never touch the connection pool.
+*/
+
+std::unique_ptr<UserDirectory> UserDirectory::instance_ = nullptr;
+std::once_flag UserDirectory::initInstanceFlag;
+
+namespace {
+    const char* kUsersChangedChannel = "users_changed";
+}
+
+UserDirectory& UserDirectory::getInstance() {
+    std::call_once(initInstanceFlag, []() {
+        instance_ = std::unique_ptr<UserDirectory>(new UserDirectory());
+    });
+    return *instance_;
+}
+
+UserDirectory::UserDirectory()
+    : maxUsersPerShard_(Utils::getEnvSize("CHAT_USER_CACHE_SIZE", 100000) / kShardCount + 1) {
+}
+
+UserDirectory::UserShard& UserDirectory::shardFor(int userId) {
+    return userShards_[static_cast<size_t>(userId) % kShardCount];
+}
+
+UserDirectory::EmailShard& UserDirectory::shardFor(const std::string& email) {
+    return emailShards_[std::hash<std::string>{}(email) % kShardCount];
+}
+
+std::optional<User> UserDirectory::findById(int userId) {
+    UserShard& shard = shardFor(userId);
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    auto it = shard.index.find(userId);
+    if (it == shard.index.end()) {
+        misses_.fetch_add(1, std::memory_order_relaxed);
+        return std::nullopt;
+    }
+    // Move to the front, the least recently used user is evicted first
+    shard.lru.splice(shard.lru.begin(), shard.lru, it->second);
+    hits_.fetch_add(1, std::memory_order_relaxed);
+    return *it->second;
+}
+
+std::optional<User> UserDirectory::findByEmail(const std::string& email) {
+    int userId;
+    {
+        EmailShard& shard = shardFor(email);
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        auto it = shard.ids.find(email);
+        if (it == shard.ids.end()) {
+            misses_.fetch_add(1, std::memory_order_relaxed);
+            return std::nullopt;
+        }
+        userId = it->second;
+    }
+
+    // The email may have been given to another user since the mapping was stored
+    std::optional<User> user = findById(userId);
+    if (user && user->email != email) {
+        return std::nullopt;
+    }
+    return user;
+}
+
+void UserDirectory::insert(const User& user, uint64_t loadedAtEpoch) {
+    std::vector<User> evicted;
+    {
+        UserShard& shard = shardFor(user.id);
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        // Checked under the shard lock: an invalidation either bumped the epoch before this check,
+        // or it takes the lock after the insert and removes the entry again
+        if (epoch_.load() != loadedAtEpoch) {
+            return;
+        }
+        auto it = shard.index.find(user.id);
+        if (it != shard.index.end()) {
+            *it->second = user;
+            shard.lru.splice(shard.lru.begin(), shard.lru, it->second);
+        }
+        else {
+            shard.lru.push_front(user);
+            shard.index[user.id] = shard.lru.begin();
+            while (shard.lru.size() > maxUsersPerShard_) {
+                evicted.push_back(std::move(shard.lru.back()));
+                shard.index.erase(evicted.back().id);
+                shard.lru.pop_back();
+            }
+        }
+    }
+
+    {
+        EmailShard& shard = shardFor(user.email);
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        shard.ids[user.email] = user.id;
+    }
+    for (const auto& old : evicted) {
+        eraseEmail(old.email, old.id);
+    }
+    evictions_.fetch_add(evicted.size(), std::memory_order_relaxed);
+}
+
+// Drop the mapping unless the email already points to another user
+void UserDirectory::eraseEmail(const std::string& email, int userId) {
+    EmailShard& shard = shardFor(email);
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    auto it = shard.ids.find(email);
+    if (it != shard.ids.end() && it->second == userId) {
+        shard.ids.erase(it);
+    }
+}
+
+void UserDirectory::invalidate(int userId) {
+    epoch_.fetch_add(1);
+    invalidations_.fetch_add(1, std::memory_order_relaxed);
+
+    std::optional<std::string> email;
+    {
+        UserShard& shard = shardFor(userId);
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        auto it = shard.index.find(userId);
+        if (it == shard.index.end()) {
+            return;
+        }
+        email = std::move(it->second->email);
+        shard.lru.erase(it->second);
+        shard.index.erase(it);
+    }
+    eraseEmail(*email, userId);
+}
+
+void UserDirectory::invalidateEmail(const std::string& email) {
+    std::optional<int> userId;
+    {
+        EmailShard& shard = shardFor(email);
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        auto it = shard.ids.find(email);
+        if (it != shard.ids.end()) {
+            userId = it->second;
+        }
+    }
+    if (userId) {
+        invalidate(*userId);
+    }
+    else {
+        // Not cached, but a lookup may be loading it right now
+        epoch_.fetch_add(1);
+    }
+}
+
+void UserDirectory::clear() {
+    epoch_.fetch_add(1);
+    for (auto& shard : userShards_) {
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        shard.lru.clear();
+        shard.index.clear();
+    }
+    for (auto& shard : emailShards_) {
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        shard.ids.clear();
+    }
+}
+
+void UserDirectory::startInvalidationListener(const std::string& conninfo) {
+    listener_ = std::make_unique<PgListener>(conninfo);
+    listener_->subscribe(kUsersChangedChannel, [this](const std::string& payload) {
+        invalidate(std::stoi(payload));
+    });
+    // Anything cached before the LISTEN was in place may have missed its notification
+    listener_->onConnected([this]() {
+        clear();
+    });
+    listener_->start();
+}
+
+UserDirectoryStats UserDirectory::stats() {
+    UserDirectoryStats snapshot;
+    for (auto& shard : userShards_) {
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        snapshot.size += shard.lru.size();
+    }
+    snapshot.capacity = maxUsersPerShard_ * kShardCount;
+    snapshot.hits = hits_.load(std::memory_order_relaxed);
+    snapshot.misses = misses_.load(std::memory_order_relaxed);
+    snapshot.evictions = evictions_.load(std::memory_order_relaxed);
+    snapshot.invalidations = invalidations_.load(std::memory_order_relaxed);
+    return snapshot;
+}
@@ -0,0 +1,95 @@
+#pragma once
+#include <array>
+#include <atomic>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <unordered_map>
+#include "Models.h"
+#include "PgListener.h"
+
+#ifndef USERDIRECTORY_H
+#define USERDIRECTORY_H
+
+/*
+    The UserDirectory class is a singleton in-memory directory of users (id <-> email <-> profile) in front of the
+    users table, so translating between emails and ids on every frame and request does not take a pooled connection.
+    Entries are loaded lazily by DatabaseManager, bounded per shard with LRU eviction, and invalidated by a trigger
+    on users that sends NOTIFY users_changed with the user id; the whole directory is dropped when the listener
+    (re)connects, since notifications sent while it was disconnected are lost.
+*/
+
+struct UserDirectoryStats {
+    size_t size = 0;
+    size_t capacity = 0;
+    uint64_t hits = 0;
+    uint64_t misses = 0;
+    uint64_t evictions = 0;
+    uint64_t invalidations = 0;
+};
+
+class UserDirectory {
+public:
+    static UserDirectory& getInstance();
+
+    std::optional<User> findById(int userId);
+    std::optional<User> findByEmail(const std::string& email);
+
+    // Read epoch() before loading a user and pass it to insert(): an invalidation that happened
+    // while the row was being read makes the insert a no-op, so a stale row is never cached
+    uint64_t epoch() const { return epoch_.load(); }
+    void insert(const User& user, uint64_t loadedAtEpoch);
+
+    void invalidate(int userId);
+    void invalidateEmail(const std::string& email);
+    void clear();
+
+    // Listen for the notifications of the users_changed trigger (installed by DatabaseManager::ensureSchema)
+    void startInvalidationListener(const std::string& conninfo);
+    UserDirectoryStats stats();
+
+    ~UserDirectory() = default;
+
+private:
+    UserDirectory();
+    UserDirectory(const UserDirectory&) = delete;
+    UserDirectory& operator=(const UserDirectory&) = delete;
+
+    // Users by id, most recently used at the front
+    struct UserShard {
+        std::mutex mutex;
+        std::list<User> lru;
+        std::unordered_map<int, std::list<User>::iterator> index;
+    };
+
+    // email -> id, an entry may outlive its user and is checked against the user on lookup
+    struct EmailShard {
+        std::mutex mutex;
+        std::unordered_map<std::string, int> ids;
+    };
+
+    static constexpr size_t kShardCount = 16;
+
+    UserShard& shardFor(int userId);
+    EmailShard& shardFor(const std::string& email);
+    void eraseEmail(const std::string& email, int userId);
+
+    std::array<UserShard, kShardCount> userShards_;
+    std::array<EmailShard, kShardCount> emailShards_;
+    size_t maxUsersPerShard_;
+
+    std::atomic<uint64_t> epoch_{ 0 };
+    std::atomic<uint64_t> hits_{ 0 };
+    std::atomic<uint64_t> misses_{ 0 };
+    std::atomic<uint64_t> evictions_{ 0 };
+    std::atomic<uint64_t> invalidations_{ 0 };
+
+    std::unique_ptr<PgListener> listener_;
+
+    static std::unique_ptr<UserDirectory> instance_;
+    static std::once_flag initInstanceFlag;
+};
+
+#endif //USERDIRECTORY_H
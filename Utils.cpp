@@ -2,13 +2,75 @@
 #include <argon2.h>
 #include <stdexcept>
 #include <chrono>
+#include <cstdlib>
+#include <random>
+#include <vector>
+
+namespace {
+    // Set once at startup from main, before any worker thread hashes a password
+    PasswordHashParams passwordHashParams;
+
+    constexpr size_t kSaltLength = 16;
+    constexpr size_t kHashLength = 32;
+    constexpr char kArgon2idPrefix[] = "$argon2id$";
+}
 
 std::string Utils::hashPassword(const std::string& password) {
-    return password;
+    std::string salt = generateSalt(kSaltLength);
+
+    // The encoded form carries the algorithm, the cost parameters and the salt,
+    // so a hash stays verifiable after the configured cost changes
+    size_t encodedLength = argon2_encodedlen(passwordHashParams.timeCost, passwordHashParams.memoryCostKiB,
+        passwordHashParams.parallelism, kSaltLength, kHashLength, Argon2_id);
+    std::vector<char> encoded(encodedLength);
+
+    int rc = argon2id_hash_encoded(passwordHashParams.timeCost, passwordHashParams.memoryCostKiB,
+        passwordHashParams.parallelism, password.data(), password.size(), salt.data(), salt.size(),
+        kHashLength, encoded.data(), encoded.size());
+    if (rc != ARGON2_OK) {
+        throw std::runtime_error(std::string("Password hashing failed: ") + argon2_error_message(rc));
+    }
+    return std::string(encoded.data());
 }
 
 bool Utils::checkPassword(const std::string& password, const std::string& hash) {
-    return true;
+    if (hash.empty()) {
+        return false;
+    }
+
+    // Accounts registered before hashing was enabled still hold the plain password,
+    // compare those in constant time so the caller can upgrade them with needsRehash
+    if (needsRehash(hash)) {
+        if (password.size() != hash.size()) {
+            return false;
+        }
+        unsigned char diff = 0;
+        for (size_t i = 0; i < hash.size(); ++i) {
+            diff |= static_cast<unsigned char>(password[i] ^ hash[i]);
+        }
+        return diff == 0;
+    }
+
+    return argon2id_verify(hash.c_str(), password.data(), password.size()) == ARGON2_OK;
+}
+
+bool Utils::needsRehash(const std::string& hash) {
+    return hash.rfind(kArgon2idPrefix, 0) != 0;
+}
+
+void Utils::setPasswordHashParams(const PasswordHashParams& params) {
+    passwordHashParams = params;
+}
+
+std::string Utils::generateSalt(size_t length) {
+    // random_device reads from the OS entropy source
+    std::random_device rd;
+    std::uniform_int_distribution<int> byte(0, 255);
+    std::string salt(length, '\0');
+    for (auto& c : salt) {
+        c = static_cast<char>(byte(rd));
+    }
+    return salt;
 }
 
 std::string Utils::generateToken(const std::string& email) {
@@ -19,4 +81,22 @@ std::string Utils::generateToken(const std::string& email) {
         .set_expires_at(std::chrono::system_clock::now() + std::chrono::hours{ 24 })
         .sign(jwt::algorithm::hs256{ "secret" });
     return token;
-}
\ No newline at end of file
+}
+
+std::string Utils::getEnv(const char* name, const std::string& defaultValue) {
+    const char* value = std::getenv(name);
+    return value != nullptr && *value != '\0' ? std::string(value) : defaultValue;
+}
+
+size_t Utils::getEnvSize(const char* name, size_t defaultValue) {
+    const char* value = std::getenv(name);
+    if (value == nullptr || *value == '\0') {
+        return defaultValue;
+    }
+    try {
+        return static_cast<size_t>(std::stoull(value));
+    }
+    catch (const std::exception&) {
+        return defaultValue;
+    }
+}
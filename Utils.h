@@ -1,17 +1,30 @@
 #pragma once
 #include <string>
+#include <cstdint>
 #include <jwt-cpp/jwt.h>
 
 #ifndef UTILS_H
 #define UTILS_H
 
+// Argon2id cost parameters, the defaults follow the OWASP recommendation (19 MiB, 2 iterations, 1 lane)
+struct PasswordHashParams {
+    uint32_t timeCost = 2;
+    uint32_t memoryCostKiB = 19 * 1024;
+    uint32_t parallelism = 1;
+};
 
 class Utils {
 public:
     static std::string hashPassword(const std::string& password);
     static bool checkPassword(const std::string& password, const std::string& hash);
+    static bool needsRehash(const std::string& hash);
+    static void setPasswordHashParams(const PasswordHashParams& params);
     static std::string generateToken(const std::string& email);
     static std::string generateSalt(size_t length);
+
+    // Read a setting from the environment, falling back to the default when it is not set
+    static std::string getEnv(const char* name, const std::string& defaultValue);
+    static size_t getEnvSize(const char* name, size_t defaultValue);
 };
 
 
@@ -0,0 +1,122 @@
+#pragma once
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+#ifndef WORKSTEALINGDEQUE_H
+#define WORKSTEALINGDEQUE_H
+
+/*
+    The WorkStealingDeque class is the lock-free deque of one ThreadPool worker (Chase-Lev, with the memory orderings
+    of Le et al., "Correct and Efficient Work-Stealing for Weak Memory Models").
+    Only the owning worker pushes and pops, at the bottom (LIFO, the task it just produced is still warm in its cache);
+    any other thread may steal from the top (FIFO, the oldest task). The owner only synchronizes with thieves when
+    the deque is down to its last element.
+    The ring grows when full. A replaced ring is kept until the deque is destroyed since a thief may still read it,
+    which costs at most the size of the final ring again.
+*/
+
+template <typename T>
+class WorkStealingDeque {
+public:
+    explicit WorkStealingDeque(int64_t capacity = 1024)
+        : array_(new Ring(capacity)) {
+        rings_.emplace_back(array_.load(std::memory_order_relaxed));
+    }
+    WorkStealingDeque(const WorkStealingDeque&) = delete;
+    WorkStealingDeque& operator=(const WorkStealingDeque&) = delete;
+
+    // Owner only
+    void push(T* item) {
+        int64_t bottom = bottom_.load(std::memory_order_relaxed);
+        int64_t top = top_.load(std::memory_order_acquire);
+        Ring* ring = array_.load(std::memory_order_relaxed);
+        if (bottom - top > ring->capacity - 1) {
+            ring = grow(ring, top, bottom);
+        }
+        ring->put(bottom, item);
+        std::atomic_thread_fence(std::memory_order_release);
+        bottom_.store(bottom + 1, std::memory_order_relaxed);
+    }
+
+    // Owner only, nullptr when empty
+    T* pop() {
+        int64_t bottom = bottom_.load(std::memory_order_relaxed) - 1;
+        Ring* ring = array_.load(std::memory_order_relaxed);
+        bottom_.store(bottom, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        int64_t top = top_.load(std::memory_order_relaxed);
+
+        T* item = nullptr;
+        if (top <= bottom) {
+            item = ring->get(bottom);
+            if (top == bottom) {
+                // Last element, race the thieves for it
+                if (!top_.compare_exchange_strong(top, top + 1, std::memory_order_seq_cst, std::memory_order_relaxed)) {
+                    item = nullptr;
+                }
+                bottom_.store(bottom + 1, std::memory_order_relaxed);
+            }
+        }
+        else {
+            bottom_.store(bottom + 1, std::memory_order_relaxed);
+        }
+        return item;
+    }
+
+    // Any thread, nullptr when empty or when another thread took the element first
+    T* steal() {
+        int64_t top = top_.load(std::memory_order_acquire);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        int64_t bottom = bottom_.load(std::memory_order_acquire);
+        if (top >= bottom) {
+            return nullptr;
+        }
+        Ring* ring = array_.load(std::memory_order_acquire);
+        T* item = ring->get(top);
+        if (!top_.compare_exchange_strong(top, top + 1, std::memory_order_seq_cst, std::memory_order_relaxed)) {
+            return nullptr;
+        }
+        return item;
+    }
+
+    // Approximate, for statistics
+    size_t size() const {
+        int64_t bottom = bottom_.load(std::memory_order_relaxed);
+        int64_t top = top_.load(std::memory_order_relaxed);
+        return bottom > top ? static_cast<size_t>(bottom - top) : 0;
+    }
+
+private:
+    struct Ring {
+        explicit Ring(int64_t size)
+            : capacity(size), mask(size - 1), slots(new std::atomic<T*>[static_cast<size_t>(size)]) {}
+
+        T* get(int64_t index) const { return slots[index & mask].load(std::memory_order_relaxed); }
+        void put(int64_t index, T* item) { slots[index & mask].store(item, std::memory_order_relaxed); }
+
+        int64_t capacity;
+        int64_t mask;
+        std::unique_ptr<std::atomic<T*>[]> slots;
+    };
+
+    Ring* grow(Ring* ring, int64_t top, int64_t bottom) {
+        auto bigger = std::make_unique<Ring>(ring->capacity * 2);
+        for (int64_t i = top; i < bottom; ++i) {
+            bigger->put(i, ring->get(i));
+        }
+        Ring* next = bigger.get();
+        rings_.push_back(std::move(bigger));
+        array_.store(next, std::memory_order_release);
+        return next;
+    }
+
+    alignas(64) std::atomic<int64_t> top_{ 0 };
+    alignas(64) std::atomic<int64_t> bottom_{ 0 };
+    std::atomic<Ring*> array_;
+    // Every ring ever used, owned here (see above)
+    std::vector<std::unique_ptr<Ring>> rings_;
+};
+
+#endif //WORKSTEALINGDEQUE_H
@@ -1,7 +1,22 @@
 #include <iostream>
+#include <algorithm>
+#include <thread>
+#include <vector>
 #include <boost/asio.hpp>
 #include "RestServer.h"
 #include "TcpServer.h"
+#include "Utils.h"
+#include "DatabaseManager.h"
+#include "Storage.h"
+#include "TokenValidator.h"
+#include "UserDirectory.h"
+#include "LocalMessageBus.h"
+#include "PgMessageBus.h"
+#include "HashRing.h"
+#include "PartitionMaintainer.h"
+#include "MessageJournal.h"
+#include "RecentMessageCache.h"
+#include "CapacityController.h"
 
 
 int main()
@@ -12,16 +27,165 @@ int main()
         // In this application, io_context is used to manage restfulApi as well as TCP/IP.
         boost::asio::io_context io_context;
 
-        // Create a thread pool with 150 threads
-        ThreadPool threadPool(150);
+        // Argon2id cost, tune it so one hash takes a few tens of milliseconds on the target machine
+        PasswordHashParams hashParams;
+        hashParams.timeCost = static_cast<uint32_t>(Utils::getEnvSize("CHAT_ARGON2_TIME_COST", hashParams.timeCost));
+        hashParams.memoryCostKiB = static_cast<uint32_t>(Utils::getEnvSize("CHAT_ARGON2_MEMORY_KIB", hashParams.memoryCostKiB));
+        hashParams.parallelism = static_cast<uint32_t>(Utils::getEnvSize("CHAT_ARGON2_PARALLELISM", hashParams.parallelism));
+        Utils::setPasswordHashParams(hashParams);
+
+        // Postgres by default, CHAT_STORAGE=memory runs without a database (load tests, profiling)
+        Storage& storage = Storage::getInstance();
+        bool postgres = storage.backendName() == "postgres";
+        std::cout << "Storage backend: " << storage.backendName() << "\n";
+
+        // Keep the monthly partitions of messages created ahead of time and retire the expired ones
+        PartitionMaintainerOptions partitionOptions;
+        partitionOptions.monthsAhead = static_cast<int>(
+            Utils::getEnvSize("CHAT_MESSAGE_PARTITIONS_AHEAD", partitionOptions.monthsAhead));
+        partitionOptions.retainMonths = static_cast<int>(
+            Utils::getEnvSize("CHAT_MESSAGE_RETENTION_MONTHS", partitionOptions.retainMonths));
+        PartitionMaintainer partitionMaintainer(partitionOptions);
+
+        if (postgres) {
+            // Indexes and triggers the queries and caches rely on
+            DatabaseManager::getInstance().ensureSchema();
+            partitionMaintainer.start();
+            // Keep the user directory coherent with the users table, also across several server processes
+            UserDirectory::getInstance().startInvalidationListener(DatabaseManager::getInstance().getPrimaryConninfo());
+        }
+
+        // Seed the in-memory revocation set so tokens logged out before a restart stay rejected,
+        // then follow the logouts of the other nodes sharing the database
+        TokenValidator::getInstance().loadRevokedTokens(storage.getRevokedTokens());
+        if (postgres) {
+            TokenValidator::getInstance().startRevocationListener(DatabaseManager::getInstance().getPrimaryConninfo(),
+                []() { return Storage::getInstance().getRevokedTokens(); });
+        }
+
+        // One executor per class of work, each with its own threads and queue bound, so overload in one class is
+        // rejected at its queue (503 / busy frame) instead of taking the threads of the others.
+        // The connections themselves are coroutines on the reactor threads, see below.
+        // io: work of the chat path that is not shed with the database (directory lookups, typing)
+        size_t cpuThreads = std::max(1u, std::thread::hardware_concurrency());
+        // The capacity controller keeps the queue bound proportional to the threads when it resizes the executor
+        size_t ioThreads = std::max<size_t>(1, Utils::getEnvSize("CHAT_IO_THREADS", cpuThreads));
+        ThreadPool ioPool("io", ioThreads, Utils::getEnvSize("CHAT_IO_QUEUE_LIMIT", 4 * ioThreads),
+            Utils::getEnvSize("CHAT_IO_THREADS_MAX", 4 * cpuThreads));
+
+        // db: calls that block on the database, as many threads as connections so none of them waits for a lease.
+        // It can grow up to CHAT_DB_THREADS_MAX, on Postgres never past the largest connection pool (CHAT_DB_POOL_MAX)
+        size_t dbThreads = postgres ? DatabaseManager::getInstance().getPoolStats().maxSize : cpuThreads;
+        dbThreads = Utils::getEnvSize("CHAT_DB_THREADS", std::max<size_t>(1, dbThreads));
+        size_t dbMaxThreads = Utils::getEnvSize("CHAT_DB_THREADS_MAX",
+            postgres ? DatabaseManager::getInstance().getMaxConnections() : 4 * cpuThreads);
+        if (postgres) {
+            dbMaxThreads = std::min(dbMaxThreads, DatabaseManager::getInstance().getMaxConnections());
+        }
+        dbMaxThreads = std::max<size_t>(1, dbMaxThreads);
+        dbThreads = std::min(dbThreads, dbMaxThreads);
+        ThreadPool dbPool("db", dbThreads, Utils::getEnvSize("CHAT_DB_QUEUE_LIMIT", 4 * dbThreads), dbMaxThreads);
+
+        // cpu: password hashing, sized to the cores
+        ThreadPool cpuPool("cpu", Utils::getEnvSize("CHAT_CPU_THREADS", cpuThreads),
+            Utils::getEnvSize("CHAT_CPU_QUEUE_LIMIT", 64));
+
+        // Grow and shrink the io and db executors (and the connection pools with db) from their queue wait,
+        // CHAT_CAPACITY=off keeps the sizes above
+        CapacityOptions capacityOptions;
+        capacityOptions.interval = std::chrono::milliseconds(
+            Utils::getEnvSize("CHAT_CAPACITY_INTERVAL_MS", static_cast<size_t>(capacityOptions.interval.count())));
+        capacityOptions.growQueueWait = std::chrono::microseconds(
+            Utils::getEnvSize("CHAT_CAPACITY_GROW_WAIT_US", static_cast<size_t>(capacityOptions.growQueueWait.count())));
+        capacityOptions.shrinkQueueWait = std::chrono::microseconds(
+            Utils::getEnvSize("CHAT_CAPACITY_SHRINK_WAIT_US", static_cast<size_t>(capacityOptions.shrinkQueueWait.count())));
+        capacityOptions.growAcquireWait = std::chrono::microseconds(
+            Utils::getEnvSize("CHAT_CAPACITY_GROW_ACQUIRE_US", static_cast<size_t>(capacityOptions.growAcquireWait.count())));
+        capacityOptions.shrinkAfter = Utils::getEnvSize("CHAT_CAPACITY_SHRINK_AFTER", capacityOptions.shrinkAfter);
+        CapacityController capacityController(capacityOptions);
+        bool adaptiveCapacity = Utils::getEnv("CHAT_CAPACITY", "on") != "off";
+        if (adaptiveCapacity) {
+            capacityController.manageExecutor(ioPool, Utils::getEnvSize("CHAT_IO_THREADS_MIN", 1));
+            if (postgres) {
+                capacityController.manageDatabase(dbPool, DatabaseManager::getInstance().getMinConnections());
+            }
+            else {
+                capacityController.manageExecutor(dbPool, Utils::getEnvSize("CHAT_DB_THREADS_MIN", 1));
+            }
+            capacityController.start();
+        }
+
+        // Deliveries between nodes: in process by default, through Postgres NOTIFY when several nodes share the users
+        std::unique_ptr<MessageBus> messageBus;
+        if (Utils::getEnv("CHAT_MESSAGE_BUS", "local") == "postgres") {
+            PgMessageBusOptions busOptions;
+            busOptions.buckets = Utils::getEnvSize("CHAT_BUS_BUCKETS", busOptions.buckets);
+            busOptions.flushInterval = std::chrono::milliseconds(
+                Utils::getEnvSize("CHAT_BUS_FLUSH_MS", static_cast<size_t>(busOptions.flushInterval.count())));
+            messageBus = std::make_unique<PgMessageBus>(DatabaseManager::getInstance().getPrimaryConninfo(), busOptions);
+        }
+        else {
+            messageBus = std::make_unique<LocalMessageBus>();
+        }
+
+        // Ring of the nodes sharing the users, from a file (CHAT_CLUSTER_FILE) or the cluster_nodes table.
+        // Without membership every user is local and clients are never redirected
+        std::vector<ClusterNode> clusterNodes;
+        std::string clusterSource = Utils::getEnv("CHAT_CLUSTER_SOURCE", "none");
+        if (clusterSource == "file") {
+            clusterNodes = HashRing::loadFile(Utils::getEnv("CHAT_CLUSTER_FILE", "cluster.conf"));
+        }
+        else if (clusterSource == "db") {
+            clusterNodes = DatabaseManager::getInstance().getClusterNodes();
+        }
+        HashRing ring(clusterNodes, Utils::getEnv("CHAT_NODE_ID", ""),
+            Utils::getEnvSize("CHAT_RING_VNODES", 128));
+        if (ring.enabled() && std::none_of(clusterNodes.begin(), clusterNodes.end(),
+                [&ring](const ClusterNode& node) { return node.id == ring.selfId(); })) {
+            std::cerr << "CHAT_NODE_ID is not a member of the cluster, every client will be redirected\n";
+        }
+        // Recent messages are kept up to date by the local send path, which a clustered node or one sharing the
+        // rooms with other nodes through the Postgres bus does not see for every room, so only a single node caches
+        RecentMessageCache::getInstance().setEnabled(!ring.enabled() && Utils::getEnv("CHAT_MESSAGE_BUS", "local") != "postgres");
+
+        // Messages are acknowledged once in the local journal and stored in Postgres in the background,
+        // CHAT_JOURNAL=off stores them before the ack instead
+        std::unique_ptr<MessageJournal> journal;
+        if (Utils::getEnv("CHAT_JOURNAL", "on") != "off") {
+            JournalOptions journalOptions;
+            journalOptions.directory = Utils::getEnv("CHAT_JOURNAL_DIR", journalOptions.directory);
+            journalOptions.segmentBytes = Utils::getEnvSize("CHAT_JOURNAL_SEGMENT_BYTES", journalOptions.segmentBytes);
+            journalOptions.drainBatch = Utils::getEnvSize("CHAT_JOURNAL_DRAIN_BATCH", journalOptions.drainBatch);
+            journal = std::make_unique<MessageJournal>(journalOptions, [](const std::vector<JournalEntry>& entries) {
+                std::vector<Message> stored;
+                if (!Storage::getInstance().storeJournaledMessages(entries, stored)) {
+                    return false;
+                }
+                // The cached copies of the messages were appended with id 0
+                for (const Message& message : stored) {
+                    RecentMessageCache::getInstance().resolveJournaled(message);
+                }
+                return true;
+            });
+            journal->start();
+        }
 
         // Create a tcp server object with the io_context, port 12345
-        TcpServer tcpServer(io_context, 12345, threadPool);
+        TcpServer tcpServer(io_context, 12345, ioPool, dbPool, *messageBus, ring, journal.get());
         // Create a rest server object with the io_context, port 8080
-        RestServer restServer(io_context, tcp::endpoint(tcp::v4(), 8080), threadPool);
+        RestServer restServer(io_context, tcp::endpoint(tcp::v4(), 8080), ioPool, dbPool, cpuPool,
+            journal.get(), adaptiveCapacity ? &capacityController : nullptr);
 
-        // Run the io_context object
+        // Run the io_context on one reactor thread per core, requests and sessions only suspend on them
+        size_t reactorThreads = std::max<size_t>(1, Utils::getEnvSize("CHAT_REACTOR_THREADS", cpuThreads));
+        std::vector<std::thread> reactors;
+        for (size_t i = 1; i < reactorThreads; ++i) {
+            reactors.emplace_back([&io_context]() { io_context.run(); });
+        }
         io_context.run();
+        for (auto& reactor : reactors) {
+            reactor.join();
+        }
     }
     catch (std::exception& e) {
         std::cerr << "Exception: " << e.what() << "\n";
@@ -0,0 +1,88 @@
+-- Range-partition messages by created_at, one partition per month.
+--
+-- The existing heap is kept as the partition holding every row before the first monthly partition
+-- (messages_legacy), so no row is copied. The indexes and the bounds check it needs are built first,
+-- concurrently, which leaves the transaction at the end with only catalog changes to make under its lock.
+--
+-- Run with psql against the primary, outside of a transaction:
+--   psql -v ON_ERROR_STOP=1 -f migrations/040_partition_messages.sql chat_message_db
+-- Requires PostgreSQL 14 or later (DETACH PARTITION ... CONCURRENTLY is used to retire old months).
+
+-- 1. Indexes the partitioned table needs, built without blocking writes.
+--    A unique key of a partitioned table must contain the partition key.
+CREATE UNIQUE INDEX CONCURRENTLY IF NOT EXISTS messages_legacy_id_created_at_idx
+    ON messages (message_id, created_at);
+CREATE INDEX CONCURRENTLY IF NOT EXISTS messages_legacy_room_created_at_idx
+    ON messages (room_id, created_at);
+
+-- 2. Prove the bounds of the legacy partition ahead of time so ATTACH does not scan it under lock.
+--    It holds everything before the start of next month, the monthly partitions start there.
+DO $$
+BEGIN
+    IF NOT EXISTS (SELECT 1 FROM pg_constraint WHERE conname = 'messages_legacy_bounds') THEN
+        EXECUTE format('ALTER TABLE messages ADD CONSTRAINT messages_legacy_bounds '
+                       'CHECK (created_at IS NOT NULL AND created_at < %L) NOT VALID',
+                       date_trunc('month', now()) + interval '1 month');
+    END IF;
+END
+$$;
+ALTER TABLE messages VALIDATE CONSTRAINT messages_legacy_bounds;
+
+-- 3. Creates the monthly partitions from the current month to months_ahead months from now.
+--    Months already covered by another partition (the legacy one) are skipped.
+CREATE OR REPLACE FUNCTION ensure_message_partitions(months_ahead integer) RETURNS void AS $$
+DECLARE
+    month_start date;
+BEGIN
+    FOR i IN 0..months_ahead LOOP
+        month_start := (date_trunc('month', now()) + make_interval(months => i))::date;
+        BEGIN
+            EXECUTE format('CREATE TABLE IF NOT EXISTS %I PARTITION OF messages FOR VALUES FROM (%L) TO (%L)',
+                           'messages_p' || to_char(month_start, 'YYYYMM'),
+                           month_start, (month_start + interval '1 month')::date);
+        EXCEPTION WHEN invalid_object_definition THEN
+            -- The range overlaps an existing partition
+            NULL;
+        END;
+    END LOOP;
+END;
+$$ LANGUAGE plpgsql;
+
+-- 4. Swap the heap for the partitioned table, catalog changes only.
+BEGIN;
+
+-- message_status cannot reference message_id alone any more, the key of messages is (message_id, created_at)
+ALTER TABLE message_status DROP CONSTRAINT IF EXISTS message_status_message_id_fkey;
+
+ALTER TABLE messages RENAME TO messages_legacy;
+ALTER INDEX messages_legacy_id_created_at_idx RENAME TO messages_legacy_pkey_idx;
+
+-- Same columns and defaults, message_id keeps drawing from the existing sequence
+CREATE TABLE messages (LIKE messages_legacy INCLUDING DEFAULTS)
+    PARTITION BY RANGE (created_at);
+ALTER TABLE messages ADD CONSTRAINT messages_pkey_partitioned PRIMARY KEY (message_id, created_at);
+DO $$
+DECLARE
+    seq text := pg_get_serial_sequence('messages_legacy', 'message_id');
+BEGIN
+    -- The sequence must outlive the legacy partition once it is detached and dropped
+    IF seq IS NOT NULL THEN
+        EXECUTE format('ALTER SEQUENCE %s OWNED BY messages.message_id', seq);
+    END IF;
+END
+$$;
+CREATE INDEX messages_room_created_at_idx ON ONLY messages (room_id, created_at);
+
+-- The key columns of a partition must be NOT NULL, the validated bounds check proves it without a scan
+ALTER TABLE messages_legacy ALTER COLUMN created_at SET NOT NULL;
+DO $$
+BEGIN
+    EXECUTE format('ALTER TABLE messages ATTACH PARTITION messages_legacy FOR VALUES FROM (MINVALUE) TO (%L)',
+                   date_trunc('month', now()) + interval '1 month');
+END
+$$;
+ALTER INDEX messages_room_created_at_idx ATTACH PARTITION messages_legacy_room_created_at_idx;
+
+SELECT ensure_message_partitions(3);
+
+COMMIT;
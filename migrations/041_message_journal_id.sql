@@ -0,0 +1,33 @@
+-- Id of the MessageJournal entry a message was drained from, so an entry drained again after a crash or a retried
+-- batch is not inserted twice (INSERT ... ON CONFLICT (journal_id, created_at) DO NOTHING).
+--
+-- The unique key contains created_at since a unique key of the partitioned messages table must contain the
+-- partition key. It is built partition by partition without blocking writes, then attached to the parent index.
+-- Until it exists the journal keeps the messages and retries its drain.
+--
+-- Run with psql against the primary, outside of a transaction, after 040_partition_messages.sql:
+--   psql -v ON_ERROR_STOP=1 -f migrations/041_message_journal_id.sql chat_message_db
+
+-- 1. Nullable without a default: adding it does not rewrite the table.
+ALTER TABLE messages ADD COLUMN IF NOT EXISTS journal_id text;
+
+-- 2. The index, created invalid on the parent only, then built on each partition and attached.
+--    Partitions created later by ensure_message_partitions get it automatically.
+CREATE UNIQUE INDEX IF NOT EXISTS messages_journal_id_idx ON ONLY messages (journal_id, created_at);
+
+SELECT format('CREATE UNIQUE INDEX CONCURRENTLY IF NOT EXISTS %I ON %s (journal_id, created_at)',
+              c.relname || '_journal_id_idx', c.oid::regclass)
+FROM pg_inherits i
+JOIN pg_class c ON c.oid = i.inhrelid
+WHERE i.inhparent = 'messages'::regclass
+\gexec
+
+SELECT format('ALTER INDEX messages_journal_id_idx ATTACH PARTITION %I', c.relname || '_journal_id_idx')
+FROM pg_inherits i
+JOIN pg_class c ON c.oid = i.inhrelid
+WHERE i.inhparent = 'messages'::regclass
+  AND NOT EXISTS (
+      SELECT 1 FROM pg_inherits attached
+      WHERE attached.inhrelid = to_regclass(c.relname || '_journal_id_idx')
+        AND attached.inhparent = 'messages_journal_id_idx'::regclass)
+\gexec
@@ -0,0 +1,66 @@
+-- Full-text search over messages.content, used by GET /api/search.
+--
+-- content_tsv holds the lexemes of each message, kept up to date by a trigger on insert and on content updates.
+-- The rows written before this migration are filled in by batches of message ids, each committed on its own.
+-- The GIN index covers (room_id, content_tsv) through btree_gin, so "in these rooms and matching these words"
+-- is answered from the index without visiting the messages of other rooms.
+--
+-- Run with psql against the primary, outside of a transaction, after 040_partition_messages.sql:
+--   psql -v ON_ERROR_STOP=1 -f migrations/044_message_search.sql chat_message_db
+
+CREATE EXTENSION IF NOT EXISTS btree_gin;
+
+-- 1. Nullable without a default: adding it does not rewrite the table.
+ALTER TABLE messages ADD COLUMN IF NOT EXISTS content_tsv tsvector;
+
+-- 2. Incremental maintenance. 'simple' does no stemming nor stop words, the messages are in several languages.
+CREATE OR REPLACE FUNCTION messages_content_tsv() RETURNS trigger AS $$
+BEGIN
+    NEW.content_tsv := to_tsvector('simple', coalesce(NEW.content, ''));
+    RETURN NEW;
+END;
+$$ LANGUAGE plpgsql;
+
+DROP TRIGGER IF EXISTS messages_content_tsv ON messages;
+CREATE TRIGGER messages_content_tsv BEFORE INSERT OR UPDATE OF content ON messages
+    FOR EACH ROW EXECUTE FUNCTION messages_content_tsv();
+
+-- 3. Backfill by ranges of message_id (the leading column of the primary key), one commit per batch
+--    so the locks and the WAL of the backfill stay small.
+CREATE OR REPLACE PROCEDURE backfill_message_search(batch_size bigint DEFAULT 10000) AS $$
+DECLARE
+    low bigint;
+    high bigint;
+BEGIN
+    SELECT min(message_id), max(message_id) INTO low, high FROM messages;
+    WHILE low IS NOT NULL AND low <= high LOOP
+        UPDATE messages SET content_tsv = to_tsvector('simple', coalesce(content, ''))
+        WHERE message_id >= low AND message_id < low + batch_size AND content_tsv IS NULL;
+        COMMIT;
+        low := low + batch_size;
+    END LOOP;
+END;
+$$ LANGUAGE plpgsql;
+
+CALL backfill_message_search();
+
+-- 4. The index, built partition by partition without blocking writes, then attached to the parent index.
+--    Partitions created later by ensure_message_partitions get it automatically.
+CREATE INDEX IF NOT EXISTS messages_search_idx ON ONLY messages USING gin (room_id, content_tsv);
+
+SELECT format('CREATE INDEX CONCURRENTLY IF NOT EXISTS %I ON %s USING gin (room_id, content_tsv)',
+              c.relname || '_search_idx', c.oid::regclass)
+FROM pg_inherits i
+JOIN pg_class c ON c.oid = i.inhrelid
+WHERE i.inhparent = 'messages'::regclass
+\gexec
+
+SELECT format('ALTER INDEX messages_search_idx ATTACH PARTITION %I', c.relname || '_search_idx')
+FROM pg_inherits i
+JOIN pg_class c ON c.oid = i.inhrelid
+WHERE i.inhparent = 'messages'::regclass
+  AND NOT EXISTS (
+      SELECT 1 FROM pg_inherits attached
+      WHERE attached.inhrelid = to_regclass(c.relname || '_search_idx')
+        AND attached.inhparent = 'messages_search_idx'::regclass)
+\gexec